@@ -26,6 +26,10 @@ along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
 // TODO consolidate header files more rationally
 #include <regex>
 #include <cassert>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <chrono>
 
 #include "cxxopts.hpp"
 
@@ -73,10 +77,19 @@ Cdd::Cdd(string arr_pushd[], int count, string current_path)
     assign(arr_pushd, count, current_path);
 }
 
+Cdd::Cdd(const HistoryStore& store, string current_path)
+{
+    initialize();
+    assign(store, current_path);
+}
+
 void Cdd::initialize(void)
 {
     current_path = string();
+    current_path_normalized = string();
     current_path_added = false;
+    current_path_id = FileId();
+    current_path_id_known = false;
     opt_help = false;
     opt_version = false;
     opt_path = string();
@@ -84,15 +97,54 @@ void Cdd::initialize(void)
     opt_gc = false;
     opt_delete = false;
     opt_reset = false;
+    opt_prune = false;
+    opt_dedupe = false;
+    identity_cache_path = IdentityCache::default_path();
+    opt_stat_remote = false;
+    remote_deadline_ms = 500;
+    opt_budget_ms = 0;
+    clock = []() {
+        return int64_t(chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+    };
+    budget_deadline = INT64_MAX;
+    budget_exceeded = false;
+    budget_started = false;
+    opt_discover = false;
+    opt_discover_depth = 4;
+    opt_discover_ms = 300;
+    opt_coproc = false;
+    opt_compact = false;
+    opt_store = string();
+    opt_socket = string();
+    opt_since = 0;
     opt_limit_backwards = 10;
     opt_limit_forwards = 0;
     opt_limit_common = 10;
+    opt_limit_frecent = 10;
     opt_all = false;
+    opt_exact_count = false;
+    match_engine = PathMatcher::ENGINE_AUTO;
 #ifdef WIN32
     opt_separator = '\\';
 #else
     opt_separator = '/';
 #endif
+
+    vec_dir_stack.arena = &path_index.arena;
+    vec_dir_stack.cdd = this;
+    vec_dir_stack.fill = &Cdd::fill_stack;
+    vec_dir_last_to_first.arena = &path_index.arena;
+    vec_dir_last_to_first.cdd = this;
+    vec_dir_last_to_first.fill = &Cdd::fill_last_to_first;
+    vec_dir_first_to_last.arena = &path_index.arena;
+    vec_dir_first_to_last.cdd = this;
+    vec_dir_first_to_last.fill = &Cdd::fill_first_to_last;
+    vec_dir_most_to_least.index = &path_index;
+    vec_dir_most_to_least.cdd = this;
+    vec_dir_most_to_least.fill = &Cdd::fill_most_to_least;
+    vec_dir_frecent.index = &path_index;
+    vec_dir_frecent.cdd = this;
+    vec_dir_frecent.fill = &Cdd::fill_frecent;
 }
 
 void Cdd::assign(string arr_pushd[], int count, string current_path)
@@ -103,77 +155,439 @@ void Cdd::assign(string arr_pushd[], int count, string current_path)
 }
 
 void Cdd::assign(vector<string>& vec_pushd, string current_path)
+{
+    path_index.reserve(vec_pushd.size());
+    auto lines = make_shared<vector<string>>(vec_pushd);
+    size_t next = 0;
+    assign_source(current_path, [lines, next](string& line) mutable {
+        if (next >= lines->size())
+            return false;
+        line = (*lines)[next++];
+        return true;
+    });
+}
+
+void Cdd::assign(istream& strm, string current_path)
+{
+    // Directories go straight into the index, one line at a time,
+    // so a large stack is never held as a vector of strings.
+    // The stream is read as the stack is needed, so it has to
+    // outlive any use of the lists.
+    assign_source(current_path, [&strm](string& line) {
+        return bool(getline(strm, line));
+    });
+}
+
+void Cdd::assign(const HistoryStore& store, string current_path)
+{
+    // The store reads as a stack, top first.  Steps are read from the
+    // mapped store as the stack is needed, so the store has to outlive
+    // any use of the lists.
+    const HistoryStore *source = &store;
+    uint64_t next = 0;
+    assign_source(current_path, [this, source, next](string& line) mutable {
+        for (;;)
+        {
+            // Steps outside the window of --since are passed over
+            if (opt_since)
+                next = source->next_since(next, opt_since);
+            if (next >= source->stack_size())
+                return false;
+            string_view dir = source->stack(next++, stack_line_weight, stack_line_frecency);
+            // Skip over any damaged entry
+            if (!dir.empty())
+            {
+                line.assign(dir);
+                return true;
+            }
+        }
+    });
+}
+
+void Cdd::process_store(HistoryStore& store, const string& current_path)
+{
+    // The current directory is the top of the stack, as it is for the
+    // shell's directory stack
+    uint32_t weight;
+    if (store.stack(0, weight) != current_path && !store.record(opt_store, current_path))
+        strm_err << "** Cannot write history store: " << opt_store << endl;
+    if (store.log_tail() > HistoryStore::compact_threshold)
+        HistoryStore::compact_background(opt_store);
+    assign(store, current_path);
+    process();
+    string destination = store_destination();
+    if (!destination.empty() && !store.record(opt_store, destination))
+        strm_err << "** Cannot write history store: " << opt_store << endl;
+}
+
+string Cdd::store_destination(void) const
+{
+    const string& dir = path_destination;
+    bool absolute = !dir.empty() && (dir[0] == '/' || dir[0] == opt_separator || (dir.size() > 1 && dir[1] == ':'));
+    return absolute && dir != current_path ? dir : string();
+}
+
+void Cdd::assign(const IndexSnapshot& snapshot, string current_path)
+{
+    // The lists are filled from the snapshot as they are needed, so it
+    // has to outlive any use of them
+    assert( ! has_directory_stack );
+    this->snapshot = &snapshot;
+    this->current_path = current_path;
+    current_path_normalized = normalize_path(current_path);
+    vec_dir_stack.arena = &snapshot.index.arena;
+    vec_dir_last_to_first.arena = &snapshot.index.arena;
+    vec_dir_first_to_last.arena = &snapshot.index.arena;
+    vec_dir_most_to_least.index = &snapshot.index;
+    vec_dir_frecent.index = &snapshot.index;
+    has_directory_stack = true;
+}
+
+void Cdd::assign(const StackIndex& stack_index, string current_path)
 {
     assert( ! has_directory_stack );
-    vec_dir_stack = vec_pushd;
+    this->stack_index = &stack_index;
     this->current_path = current_path;
+    current_path_normalized = normalize_path(current_path);
+    vec_dir_stack.arena = &stack_index.index.arena;
+    vec_dir_last_to_first.arena = &stack_index.index.arena;
+    vec_dir_first_to_last.arena = &stack_index.index.arena;
+    vec_dir_most_to_least.index = &stack_index.index;
+    vec_dir_frecent.index = &stack_index.index;
+    has_directory_stack = true;
+}
+
+void Cdd::assign_cached(string_view lines, string current_path, const string& cache_dir)
+{
+    assign_source(current_path, [lines](string& line) mutable {
+        if (lines.empty())
+            return false;
+        size_t end = lines.find('\n');
+        line.assign(lines.substr(0, end));
+        lines.remove_prefix(end == string_view::npos ? lines.size() : end + 1);
+        return true;
+    });
+    cached_lines = lines;
+    stack_cache_dir = cache_dir;
+}
+
+// Read the stack from the cache, or index it whole and cache it, before
+// a command that reads all of it.  The shell pushes a new top with each
+// cd, so the next stack is seldom in the cache, and a command that only
+// looks near the top is quicker indexing the lines it needs.  Nothing
+// changes once any of the stack has been read.
+void Cdd::index_cached(void)
+{
+    if (stack_cache_dir.empty() || !vec_dir_stack.ids.empty() || !stack_source)
+        return;
+    string_view lines = cached_lines;
+    uint64_t hash = StackCache::hash(lines.data(), lines.size());
+    string key = StackCache::key(hash, lines.size());
+    string file_path = StackCache::file_path(stack_cache_dir, hash);
+    stack_cache_dir.clear();
+    const IndexSnapshot *cached = stack_cache.read(file_path, key);
+    if (!cached || cached->index.separator != opt_separator)
+    {
+        // A stack cut short by the budget is not the one to cache
+        built_snapshot.reset(IndexSnapshot::build(lines, opt_separator, [this]() { return over_budget(); }));
+        if (!budget_exceeded)
+            StackCache::write(file_path, *built_snapshot, key);
+        cached = built_snapshot.get();
+    }
+    // As with any snapshot, the current path is not put on the stack
+    stack_source = nullptr;
+    current_path_added = false;
+    has_directory_stack = false;
+    assign(*cached, current_path);
+}
+
+void Cdd::assign_source(const string& current_path, function<bool(string&)> source)
+{
+    assert( ! has_directory_stack );
+    this->current_path = current_path;
+    current_path_normalized = normalize_path(current_path);
+    path_index.separator = opt_separator;
 
 #ifdef WIN32
     if (!current_path.empty())
     {
-        vec_dir_stack.insert(vec_dir_stack.begin(), current_path);
+        string current = current_path;
+        source = [current, source](string& line) mutable {
+            if (current.empty())
+                return source(line);
+            line.swap(current);
+            current.clear();
+            return true;
+        };
         current_path_added = true;
     }
 #endif
 
-    string current_path_normalized = normalize_path(current_path);
-    int current_path_inode = get_inode(current_path_normalized);
+    stack_source = source;
+    has_directory_stack = true;
+}
+
+// Index one more directory from the stack.
+// Returns false once the whole stack has been indexed.
+bool Cdd::scan_next(void)
+{
+    if (over_budget())
+        return false;
+    if (snapshot)
+        return scan_snapshot();
+    if (stack_index)
+        return scan_stack_index();
+    if (!stack_source)
+        return false;
+    stack_line_weight = 1;
+    stack_line_frecency = NAN;
+    if (!stack_source(stack_line))
+    {
+        stack_source = nullptr;
+        return false;
+    }
 
-    // First, save the vector of pushed directories
-    set<string> set_dir1;
-    for (vector<string>::iterator it=vec_dir_stack.begin(); it!=vec_dir_stack.end(); ++it)
+    uint32_t entry_count = path_index.entries.size();
+    if (isnan(stack_line_frecency))
+        vec_dir_stack.ids.push_back(path_index.add(stack_line, stack_line_weight));
+    else
+        vec_dir_stack.ids.push_back(path_index.add(stack_line, stack_line_weight, stack_line_frecency));
+    if (path_index.entries.size() > entry_count)
     {
-        string dir = *it;
-        string normalized = normalize_path(dir);
+        // Entries are numbered in order of first appearance from the top
+        // of the stack, so they arrive in last visited to first visited
+        // order.  The current path is filtered out here, checking each
+        // distinct directory once.
+        vec_current_path_memo.push_back(-1);
+        if (!is_current_path(entry_count))
+            vec_dir_last_to_first.ids.push_back(path_index.entries[entry_count].name);
+    }
+    return true;
+}
 
-        // Check to see if this directory has already been seen
-        if (set_dir1.find(normalized) == set_dir1.end())
+// The snapshot has the stack indexed already, only the lists that
+// depend on the current path are filled here
+bool Cdd::scan_snapshot(void)
+{
+    size_t position = vec_dir_stack.ids.size();
+    if (position >= snapshot->stack_size())
+        return false;
+    vec_dir_stack.ids.push_back(snapshot->stack_name(position));
+    const PathIndex& index = snapshot->index;
+    uint32_t id = index.stack_id(position);
+    if (index.entry(id).first == position)
+    {
+        vec_current_path_memo.push_back(-1);
+        if (!is_current_path(id))
+            vec_dir_last_to_first.ids.push_back(index.entry(id).name);
+    }
+    return true;
+}
+
+// As scan_snapshot, with entries numbered in no particular order
+bool Cdd::scan_stack_index(void)
+{
+    size_t position = vec_dir_stack.ids.size();
+    if (position >= stack_index->size())
+        return false;
+    vec_dir_stack.ids.push_back(stack_index->stack_name(position));
+    uint32_t id = stack_index->stack_id(position);
+    if (stack_index->first(id) == position)
+    {
+        if (id >= vec_current_path_memo.size())
+            vec_current_path_memo.resize(id + 1, -1);
+        if (!is_current_path(id))
+            vec_dir_last_to_first.ids.push_back(stack_index->index.entries[id].name);
+    }
+    return true;
+}
+
+// Read the whole stack and index it again with every directory that is
+// reached by more than one path spelled the way it is at its most recent
+// visit, so that their counts, positions and frecency add up as one
+void Cdd::dedupe_stack(void)
+{
+    assert( vec_dir_stack.ids.empty() );
+    // Indexed again merged, which is not what the cache holds
+    stack_cache_dir.clear();
+    struct Line
+    {
+        string dir;
+        uint32_t weight;
+        double frecency;
+    };
+    auto lines = make_shared<vector<Line>>();
+    if (snapshot || stack_index)
+    {
+        // Visits are not weighed in these, see HistoryServer
+        const PathIndex& index = this->index();
+        size_t size = snapshot ? snapshot->stack_size() : stack_index->size();
+        for (size_t i=0; i<size; i++)
         {
-            // Filter out the current_path after the set inclusion test,
-            // since checking inode is potentially expensive.
-            if (paths_equal(current_path_normalized, current_path_inode, normalized))
-                continue;
-            // Directory has not been seen, add it to the vector
-            vec_dir_last_to_first.push_back(dir);
-            set_dir1.insert(normalized);
+            uint32_t name = snapshot ? snapshot->stack_name(i) : stack_index->stack_name(i);
+            lines->push_back(Line{string(index.arena[name]), 1, NAN});
         }
+        snapshot = nullptr;
+        stack_index = nullptr;
+        path_index.separator = opt_separator;
+        vec_dir_stack.arena = &path_index.arena;
+        vec_dir_last_to_first.arena = &path_index.arena;
+        vec_dir_first_to_last.arena = &path_index.arena;
+        vec_dir_most_to_least.index = &path_index;
+        vec_dir_frecent.index = &path_index;
     }
-
-    // Second, build up a vector of all directories but with removing
-    // duplicates.  This allows for assigning a unique number to each dir.
-    set<string> set_dir2;
-    vector<string>::reverse_iterator rit;
-    for (rit=vec_dir_stack.rbegin(); rit!=vec_dir_stack.rend(); ++rit)
+    else
     {
-        string dir = *rit;
-        string normalized = normalize_path(dir);
-        // Check to see if this directory has already been seen
-        if (set_dir2.find(normalized) == set_dir2.end())
+        for (;;)
         {
-            // Directory has not been seen, add it to the vector
-            vec_dir_first_to_last.push_back(dir);
-            set_dir2.insert(normalized);
+            stack_line_weight = 1;
+            stack_line_frecency = NAN;
+            if (over_budget() || !stack_source || !stack_source(stack_line))
+                break;
+            lines->push_back(Line{stack_line, stack_line_weight, stack_line_frecency});
         }
     }
 
-    // Third, build up the vector of most common directories
-    typedef map<string, Common> MapCommon;
-    MapCommon map_common;
-    for (vector<string>::iterator it=vec_dir_stack.begin(); it!=vec_dir_stack.end(); ++it)
+    // Each directory is resolved once however it is spelled, and one on
+    // a network file system only by choice
+    vector<string> paths;
+    for (size_t i=0; i<lines->size(); i++)
     {
-        string dir = *it;
-        string normalized = normalize_path(dir);
-        MapCommon::iterator mi;
-        mi = map_common.find(normalized);
-        if (mi == map_common.end())
-            map_common.insert(MapCommon::value_type(normalized, Common(1, map_common.size(), dir)));
-        else
-            mi->second.count++;
+        string path = path_index.normalized((*lines)[i].dir);
+        if ((opt_stat_remote || !is_remote_path(path)) && !over_budget())
+            paths.push_back(path);
+    }
+    sort(paths.begin(), paths.end());
+    paths.erase(unique(paths.begin(), paths.end()), paths.end());
+    IdentityCache cache;
+    if (!identity_cache_path.empty())
+        cache.load(identity_cache_path);
+    vector<FileId> ids;
+    cache.resolve(paths, [this](const vector<string>& batch, vector<StatBatch::Result>& results) {
+        stat_paths(batch, results);
+    }, time(nullptr), ids);
+    if (cache.changed && !identity_cache_path.empty())
+        cache.save(identity_cache_path);
+
+    map<FileId, string> spelling;
+    for (size_t i=0; i<lines->size(); i++)
+    {
+        string& dir = (*lines)[i].dir;
+        string path = path_index.normalized(dir);
+        size_t k = lower_bound(paths.begin(), paths.end(), path) - paths.begin();
+        if (k == paths.size() || paths[k] != path || !ids[k].valid())
+            continue;
+        auto it = spelling.insert(make_pair(ids[k], dir)).first;
+        dir = it->second;
+    }
+
+    size_t next = 0;
+    stack_source = [this, lines, next](string& line) mutable {
+        if (next >= lines->size())
+            return false;
+        const Line& item = (*lines)[next++];
+        line = item.dir;
+        stack_line_weight = item.weight;
+        stack_line_frecency = item.frecency;
+        return true;
+    };
+}
+
+void Cdd::fill_stack(size_t count)
+{
+    while (vec_dir_stack.ids.size() < count && scan_next())
+        ;
+}
+
+void Cdd::fill_last_to_first(size_t count)
+{
+    while (vec_dir_last_to_first.ids.size() < count && scan_next())
+        ;
+}
+
+// The whole list is filled at once, whatever the count, as the oldest
+// visits are at the bottom of the stack
+void Cdd::fill_first_to_last(size_t)
+{
+    if (!vec_dir_first_to_last.ids.empty())
+        return;
+    if (stack_index)
+    {
+        vector<uint32_t> ids = stack_index->first_to_last();
+        for (size_t i=0; i<ids.size(); i++)
+            vec_dir_first_to_last.ids.push_back(stack_index->index.entries[ids[i]].last_name);
+        return;
+    }
+    fill_stack(string::npos);
+
+    // A directory goes into the first to last order at its oldest visit
+    for (size_t i=vec_dir_stack.ids.size(); i-- > 0; )
+    {
+        if (index().entry(index().stack_id(i)).last == i)
+            vec_dir_first_to_last.ids.push_back(vec_dir_stack.ids[i]);
     }
-    for (MapCommon::iterator mi=map_common.begin(); mi!=map_common.end(); ++mi)
-        vec_dir_most_to_least.push_back(mi->second);
-    sort(vec_dir_most_to_least.begin(), vec_dir_most_to_least.end());
-    has_directory_stack = true;
+}
+
+void Cdd::fill_most_to_least(size_t count)
+{
+    vector<uint32_t>& ids = vec_dir_most_to_least.ids;
+    size_t total = distinct_count();
+    if (ids.size() >= min(count, total))
+        return;
+    if (stack_index)
+    {
+        // Kept in order as the stack changes
+        ids = stack_index->most_to_least(max(count, ids.size() * 2));
+        return;
+    }
+
+    // Only the top entries are ever shown, so select just those rather
+    // than sorting everything.  Asking for more than is already there at
+    // least doubles the selection, so walking the list one entry at a time
+    // stays cheap.  Each record packs the inverted count above the entry
+    // number, which doubles as the sequence for ties in count, so ordering
+    // the records orders by count descending then by sequence ascending,
+    // the same as Common::operator<.
+    size_t k = min(max(count, ids.size() * 2), total);
+    vector<uint64_t> records(total);
+    for (uint32_t id=0; id<total; id++)
+        records[id] = uint64_t(~index().entry(id).count) << 32 | id;
+    if (k < total)
+        partial_sort(records.begin(), records.begin() + k, records.end());
+    else
+        sort(records.begin(), records.end());
+
+    ids.resize(k);
+    for (size_t i=0; i<k; i++)
+        ids[i] = uint32_t(records[i]);
+}
+
+void Cdd::fill_frecent(size_t count)
+{
+    vector<uint32_t>& ids = vec_dir_frecent.ids;
+    size_t total = distinct_count();
+    if (ids.size() >= min(count, total))
+        return;
+    if (stack_index)
+    {
+        ids = stack_index->frecent(max(count, ids.size() * 2));
+        return;
+    }
+
+    // Selected the same way as fill_most_to_least, by frecency descending
+    // then by sequence ascending
+    size_t k = min(max(count, ids.size() * 2), total);
+    vector<pair<double, uint32_t>> records(total);
+    for (uint32_t id=0; id<total; id++)
+        records[id] = make_pair(-index().entry(id).frecency, id);
+    if (k < total)
+        partial_sort(records.begin(), records.begin() + k, records.end());
+    else
+        sort(records.begin(), records.end());
+
+    ids.resize(k);
+    for (size_t i=0; i<k; i++)
+        ids[i] = records[i].second;
 }
 
 void Cdd::assign_debug_input(const string& input_path)
@@ -245,47 +659,154 @@ string Cdd::get_parent_path(const string& path)
     return path;    // just return original path
 }
 
-bool Cdd::paths_equal(const string& path1, int inode1, const string& path2)
+// Check if an index entry is the current path.  The normalized strings
+// are compared first.  A different string can still name the current
+// directory through a symlink or bind mount.  Only the likely aliases are
+// stat'ed: the top of the stack, which is the shell's own spelling of the
+// current directory, and entries that end in the same directory name.  A
+// deep history then costs a handful of stat calls rather than one per
+// distinct directory.  The trade-off is that an alias by another name
+// further down the stack is not filtered out and shows in the history,
+// see --dedupe for merging those.
+bool Cdd::is_current_path(uint32_t id)
 {
-    int inode2 = get_inode(path2);
-    if (inode1 > 0 && inode2 > 0)
-        return inode1 == inode2;
-    return path1 == path2;
+    signed char& memo = vec_current_path_memo[id];
+    if (memo >= 0)
+        return memo > 0;
+
+    const PathIndex& index = this->index();
+    const PathIndex::Entry& entry = index.entry(id);
+    string_view dir = index.arena[entry.name];
+    bool result = false;
+    if (index.equal(dir, current_path_normalized))
+        result = true;
+    else if (!current_path_normalized.empty() && index.normalized_size(dir) > 0)
+    {
+        string_view base1 = current_path_normalized;
+        string_view base2 = dir.substr(0, index.normalized_size(dir));
+        base1 = base1.substr(base1.find_last_of('/') + 1);
+        for (size_t i=base2.size(); i-- > 0; )
+        {
+            if (index.normalized_char(base2[i]) == '/')
+            {
+                base2 = base2.substr(i + 1);
+                break;
+            }
+        }
+        bool top = stack_index ? stack_index->first(id) == 0 : entry.first == 0;
+        if ((top || index.equal(base1, base2)) && !over_budget())
+        {
+            if (!current_path_id_known)
+            {
+                if (opt_stat_remote || !is_remote_path(current_path_normalized))
+                    current_path_id = get_file_id(current_path_normalized);
+                current_path_id_known = true;
+            }
+            string path = index.normalized(dir);
+            if (current_path_id.valid() && (opt_stat_remote || !is_remote_path(path)))
+                result = get_file_id(path) == current_path_id;
+        }
+    }
+    memo = result ? 1 : 0;
+    return result;
 }
 
-int Cdd::get_inode(const string& path)
+FileId Cdd::get_file_id(const string& path)
 {
-#ifndef WIN32
-    struct stat st;
-    if (stat(path.c_str(), &st) == 0)
-        return st.st_ino;
-#endif
-    return 0;
+    StatBatch::Result result = probe_path(path);
+    return result.error == 0 ? result.id : FileId();
+}
+
+bool Cdd::is_remote_path(const string& path)
+{
+    if (!mount_table)
+        mount_table = MountTable::current();
+    if (mount_table->mounts.empty())
+        return false;
+    // The shell gives logical paths, which may go through a symlink onto
+    // another mount
+    if (!path.empty() && path[0] != '/' && !current_path.empty())
+        return mount_table->is_remote(mount_table->resolve(current_path + "/" + path, &mount_components));
+    return mount_table->is_remote(mount_table->resolve(path, &mount_components));
+}
+
+void Cdd::start_budget(void)
+{
+    budget_started = true;
+    budget_exceeded = false;
+    budget_deadline = opt_budget_ms > 0 ? clock() + opt_budget_ms : INT64_MAX;
+}
+
+// Checked between steps of the work, each a line of the stack, a match
+// or a stat, so a run ends within a step of the budget
+bool Cdd::over_budget(void)
+{
+    if (budget_exceeded || opt_budget_ms == 0)
+        return budget_exceeded;
+    budget_exceeded = clock() >= budget_deadline;
+    return budget_exceeded;
+}
+
+bool Cdd::held_to_budget(void) const
+{
+    return !opt_help && !opt_version && !opt_gc && !opt_delete && !opt_reset && !opt_prune && !opt_compact;
+}
+
+StatBatch::Result Cdd::probe_path(const string& path)
+{
+    if (!is_remote_path(path))
+        return StatBatch::stat_one(path);
+    StatBatch batch;
+    batch.deadline_ms = remote_deadline_ms;
+    if (opt_budget_ms > 0)
+    {
+        // No longer than the budget has left
+        int64_t left = budget_deadline - clock();
+        if (left <= 0 || over_budget())
+        {
+            StatBatch::Result result;
+            result.error = ETIMEDOUT;
+            return result;
+        }
+        batch.deadline_ms = unsigned(min<int64_t>(left, batch.deadline_ms));
+    }
+    vector<StatBatch::Result> results;
+    batch.run(vector<string>(1, path), results);
+    return results[0];
+}
+
+static bool is_separator(char c)
+{
+    return c == '/' || c == '\\';
 }
 
 string Cdd::expand_dots(string path)
 {
-    static std::regex re_dots("(?:^|[\\\\/])([.]{3,})(?:[\\\\/]|$)");
-    std::smatch what;
-    if (std::regex_search(path, what, re_dots))
+    // Each path component made only of three or more dots is rewritten
+    string result;
+    size_t start = 0;
+    while (start <= path.size())
     {
-        string s_start(what[0].first, what[1].first);
-        string s_end(what[1].second, what[0].second);
-        string dots = "..";
-        int dot_len = what[1].second - what[1].first;
-        for (int i=2; i<dot_len; i++)
+        size_t end = start;
+        while (end < path.size() && !is_separator(path[end]))
+            end++;
+        size_t dot_len = end - start;
+        if (dot_len >= 3 && path.find_first_not_of('.', start) >= end)
         {
-            dots += opt_separator;
-            dots += "..";
-// #ifdef WIN32
-//             dots += "\\..";
-// #else
-//             dots += "/..";
-// #endif
+            result += "..";
+            for (size_t i=2; i<dot_len; i++)
+            {
+                result += opt_separator;
+                result += "..";
+            }
         }
-        return string(what.prefix()) + s_start + dots + expand_dots(s_end + string(what.suffix()));
+        else
+            result.append(path, start, dot_len);
+        if (end < path.size())
+            result += path[end];
+        start = end + 1;
     }
-    return path;
+    return result;
 }
 
 int Cdd::pushd_count()
@@ -323,17 +844,31 @@ void Cdd::process(void)
         process_reset();
         return;
     }
-    else if (opt_path.size())
+    else if (opt_prune)
     {
-        change_to_path_spec();
+        process_prune();
         return;
     }
-    else if (opt_history)
+    else if (opt_compact)
     {
-        show_history();
+        process_compact();
         return;
     }
-    help();
+    // The commands above keep the stack as it is spelled, only the
+    // history and the path specs see directories merged, and only they
+    // are held to the budget, see held_to_budget
+    if (!budget_started)
+        start_budget();
+    if (opt_dedupe && has_directory_stack)
+        dedupe_stack();
+    if (opt_path.size())
+        change_to_path_spec();
+    else if (opt_history)
+        show_history();
+    else
+        help();
+    if (budget_exceeded)
+        strm_err << "cdd: over the budget of " << opt_budget_ms << " ms, the result may be incomplete" << endl;
 }
 
 bool Cdd::change_to_path_spec(void)
@@ -353,6 +888,7 @@ bool Cdd::change_to_path_spec(void)
 #else
         strm_out << "pushd '" << path_found << "'" << endl;
 #endif
+        path_destination = path_found;
         if (path_found != opt_path_original || path_extra.size())
             strm_err << "cdd: " << path_found << endl;
         vector<string>::iterator it;
@@ -366,22 +902,67 @@ bool Cdd::change_to_path_spec(void)
     return rc;
 }
 
-static std::regex re_num("(\\d+)");
-static std::regex re_dashes("-+");
-static std::regex re_two_or_more_dashes("--+");
-static std::regex re_dash_num("-(\\d+)");
-static std::regex re_pluses("[+]+");
-static std::regex re_plus_num("[+](\\d+)");
-static std::regex re_commas(",+");
-static std::regex re_comma_num(",(\\d+)");
+// Parse an unsigned number which must take up all of s
+static bool parse_amount(string_view s, unsigned& amount)
+{
+    if (s.empty())
+        return false;
+    std::from_chars_result result = std::from_chars(s.data(), s.data() + s.size(), amount);
+    return result.ec == std::errc() && result.ptr == s.data() + s.size();
+}
+
+// Parse a leading integer the way std::stoi does, ignoring any
+// whitespace before it and anything after it
+static bool parse_leading_int(string_view s, int& value)
+{
+    size_t pos = 0;
+    while (pos < s.size() && isspace((unsigned char)s[pos]))
+        pos++;
+    // from_chars accepts a minus sign but not a plus sign
+    if (pos + 1 < s.size() && s[pos] == '+' && s[pos+1] != '-')
+        pos++;
+    std::from_chars_result result = std::from_chars(s.data() + pos, s.data() + s.size(), value);
+    return result.ec == std::errc();
+}
+
+Cdd::PathSpec Cdd::PathSpec::parse(string_view spec)
+{
+    PathSpec result;
+    if (spec.empty())
+        return result;
+    char c = spec[0];
+    if (isdigit((unsigned char)c))
+    {
+        if (parse_amount(spec, result.amount))
+            result.kind = SPEC_NUMBER;
+        return result;
+    }
+    Kind run_kind, number_kind;
+    switch (c)
+    {
+    case '-': run_kind = SPEC_DASHES; number_kind = SPEC_DASH_NUMBER; break;
+    case '+': run_kind = SPEC_PLUSES; number_kind = SPEC_PLUS_NUMBER; break;
+    case ',': run_kind = SPEC_COMMAS; number_kind = SPEC_COMMA_NUMBER; break;
+    case '%': run_kind = SPEC_PERCENTS; number_kind = SPEC_PERCENT_NUMBER; break;
+    default: return result;
+    }
+    size_t run = spec.find_first_not_of(c);
+    if (run == string_view::npos)
+    {
+        result.kind = run_kind;
+        result.amount = spec.size();
+    }
+    else if (run == 1 && isdigit((unsigned char)spec[1]) && parse_amount(spec.substr(1), result.amount))
+        result.kind = number_kind;
+    return result;
+}
 
 bool is_valid_path_spec(const char *s)
 {
-    if ( std::regex_match(s, re_two_or_more_dashes) )
-        return true;
-    if ( std::regex_match(s, re_dash_num) )
-        return true;
-    return false;
+    // Two or more dashes, or a dash and a number
+    Cdd::PathSpec spec = Cdd::PathSpec::parse(s);
+    return (spec.kind == Cdd::PathSpec::SPEC_DASHES && spec.amount >= 2)
+        || spec.kind == Cdd::PathSpec::SPEC_DASH_NUMBER;
 }
 
 // Main matching engine
@@ -413,52 +994,58 @@ bool Cdd::process_path_spec(string& path_found, vector<string>& path_extra, stri
         path_found = get_parent_path(opt_path);
         return true;
     }
+    // Only the backwards and forwards positions are found without a
+    // pass over the whole stack
+    PathSpec spec = PathSpec::parse(opt_path);
+    switch (spec.kind)
+    {
+    case PathSpec::SPEC_NUMBER:
+        if (direction.is_common() || direction.is_frecent())
+            index_cached();
+        break;
+    case PathSpec::SPEC_DASH_NUMBER:
+    case PathSpec::SPEC_DASHES:
+    case PathSpec::SPEC_PLUS_NUMBER:
+    case PathSpec::SPEC_PLUSES:
+        break;
+    default:
+        index_cached();
+        break;
+    }
     if (vec_dir_stack.empty())
     {
         path_error << "No history of directories" << endl;
         return false;
     }
-    std::smatch match;
-    if (std::regex_match(opt_path, match, re_num))
+    switch (spec.kind)
     {
-        int amount = std::stoi(match[1]);
+    case PathSpec::SPEC_NUMBER:
         if (direction.is_backwards())
-            return go_backwards(amount, path_found, path_error);
+            return go_backwards(spec.amount, path_found, path_error);
         if (direction.is_forwards())
-            return go_forwards(amount, path_found, path_error);
+            return go_forwards(spec.amount, path_found, path_error);
         if (direction.is_common())
-            return go_common(amount, path_found, path_error);
+            return go_common(spec.amount, path_found, path_error);
+        if (direction.is_frecent())
+            return go_frecent(spec.amount, path_found, path_error);
         return false;
-    }
-    if (std::regex_match(opt_path, match, re_dash_num))
-    {
-        int amount = std::stoi(match[1]);
-        return go_backwards(amount, path_found, path_error);
-    }
-    if (std::regex_match(opt_path, match, re_dashes))
-    {
-        int amount = match[0].str().size();
-        return go_backwards(amount, path_found, path_error);
-    }
-    if (std::regex_match(opt_path, match, re_plus_num))
-    {
-        int amount = std::stoi(match[1]);
-        return go_forwards(amount, path_found, path_error);
-    }
-    if (std::regex_match(opt_path, match, re_pluses))
-    {
-        int amount = match[0].str().size();
-        return go_forwards(amount-1, path_found, path_error);
-    }
-    if (std::regex_match(opt_path, match, re_comma_num))
-    {
-        int amount = std::stoi(match[1]);
-        return go_common(amount, path_found, path_error);
-    }
-    if (std::regex_match(opt_path, match, re_commas))
-    {
-        int amount = match[0].str().size();
-        return go_common(amount-1, path_found, path_error);
+    case PathSpec::SPEC_DASH_NUMBER:
+    case PathSpec::SPEC_DASHES:
+        return go_backwards(spec.amount, path_found, path_error);
+    case PathSpec::SPEC_PLUS_NUMBER:
+        return go_forwards(spec.amount, path_found, path_error);
+    case PathSpec::SPEC_PLUSES:
+        return go_forwards(spec.amount-1, path_found, path_error);
+    case PathSpec::SPEC_COMMA_NUMBER:
+        return go_common(spec.amount, path_found, path_error);
+    case PathSpec::SPEC_COMMAS:
+        return go_common(spec.amount-1, path_found, path_error);
+    case PathSpec::SPEC_PERCENT_NUMBER:
+        return go_frecent(spec.amount, path_found, path_error);
+    case PathSpec::SPEC_PERCENTS:
+        return go_frecent(spec.amount-1, path_found, path_error);
+    case PathSpec::SPEC_OTHER:
+        break;
     }
 
     return process_match(path_found, path_extra, path_error);
@@ -466,7 +1053,9 @@ bool Cdd::process_path_spec(string& path_found, vector<string>& path_extra, stri
 
 bool Cdd::go_backwards(unsigned amount, string& path_found, stringstream& path_error)
 {
-    if (amount < 1 || amount > vec_dir_last_to_first.size())
+    // Only index as much of the stack as it takes to find the directory
+    fill_last_to_first(amount);
+    if (amount < 1 || amount > vec_dir_last_to_first.ids.size())
     {
         path_error << "No directory at -" << amount << endl;
         return false;
@@ -488,7 +1077,7 @@ bool Cdd::go_forwards(unsigned amount, string& path_found, stringstream& path_er
 
 bool Cdd::go_common(unsigned amount, string& path_found, stringstream& path_error)
 {
-    if (amount < 0 || amount >= vec_dir_most_to_least.size())
+    if (amount < 0 || amount >= distinct_count())
     {
         path_error << "No directory at ," << amount << endl;
         return false;
@@ -497,19 +1086,33 @@ bool Cdd::go_common(unsigned amount, string& path_found, stringstream& path_erro
     return true;
 }
 
+bool Cdd::go_frecent(unsigned amount, string& path_found, stringstream& path_error)
+{
+    if (amount >= distinct_count())
+    {
+        path_error << "No directory at %" << amount << endl;
+        return false;
+    }
+    path_found = vec_dir_frecent[amount].dir;
+    return true;
+}
+
 void Cdd::show_history(void)
 {
+    index_cached();
     if (direction.is_backwards())
         show_history_last_to_first();
     else if (direction.is_forwards())
         show_history_first_to_last();
     else if (direction.is_common())
         show_history_most_to_least();
+    else if (direction.is_frecent())
+        show_history_frecent();
 }
 
 void Cdd::show_history_first_to_last(void)
 {
-    vector<string>::iterator it;
+    PathView::const_iterator it;
     unsigned count = 0;
     int number = 0;
     for (it=vec_dir_first_to_last.begin(); it!=vec_dir_first_to_last.end(); ++it)
@@ -529,7 +1132,7 @@ void Cdd::show_history_last_to_first(void)
         strm_err << "No history of other directories" << endl;
         return;
     }
-    vector<string>::iterator it;
+    PathView::const_iterator it;
     unsigned count = 0;
     int number = -1;
     for (it=vec_dir_last_to_first.begin(); it!=vec_dir_last_to_first.end(); ++it)
@@ -544,42 +1147,125 @@ void Cdd::show_history_last_to_first(void)
 
 void Cdd::show_history_most_to_least(void)
 {
-    vector<Common>::iterator it;
+    // A full ordering is only needed when showing everything
+    bool limited = opt_limit_common > 0 && !opt_all;
+    fill_most_to_least(limited ? opt_limit_common : string::npos);
     unsigned count = 0;
     int number = 0;
-    for (it=vec_dir_most_to_least.begin(); it!=vec_dir_most_to_least.end(); ++it)
+    size_t total = distinct_count();
+    for (size_t i=0; i<total; i++)
     {
+        Common common = vec_dir_most_to_least[i];
         if (number < 10)
             strm_err << " ";
-        strm_err << "," << number++ << ": (" << setw(2) << it->count << ") " << it->dir << endl;
-        if (++count >= opt_limit_common && opt_limit_common > 0 && !opt_all)
+        strm_err << "," << number++ << ": (" << setw(2) << common.count << ") " << common.dir << endl;
+        if (++count >= opt_limit_common && limited)
             break;
     }
-    if (count < vec_dir_most_to_least.size())
-        strm_err << " ... showing top " << count << " of " << vec_dir_most_to_least.size() << endl;
+    if (count < total)
+        strm_err << " ... showing top " << count << " of " << total << endl;
+}
+
+void Cdd::show_history_frecent(void)
+{
+    bool limited = opt_limit_frecent > 0 && !opt_all;
+    fill_frecent(limited ? opt_limit_frecent : string::npos);
+    unsigned count = 0;
+    int number = 0;
+    size_t total = distinct_count();
+    for (size_t i=0; i<total; i++)
+    {
+        Common common = vec_dir_frecent[i];
+        if (number < 10)
+            strm_err << " ";
+        strm_err << "%" << number++ << ": (" << setw(2) << common.count << ") " << common.dir << endl;
+        if (++count >= opt_limit_frecent && limited)
+            break;
+    }
+    if (count < total)
+        strm_err << " ... showing top " << count << " of " << total << endl;
 }
 
 bool Cdd::is_directory(string path)
 {
     // return fs::is_directory(path);
-    struct stat info;
-    return stat(path.c_str(), &info) == 0 && info.st_mode & S_IFDIR;
+    StatBatch::Result result = probe_path(path);
+    return result.error == 0 && result.is_directory;
+}
+
+// The paths on network file systems are swept apart, so that a mount
+// that hangs holds back none of the others
+void Cdd::stat_paths(const vector<string>& paths, vector<StatBatch::Result>& results)
+{
+    vector<size_t> remote;
+    vector<string> local_paths, remote_paths;
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        if (is_remote_path(paths[i]))
+        {
+            remote.push_back(i);
+            remote_paths.push_back(paths[i]);
+        }
+        else
+            local_paths.push_back(paths[i]);
+    }
+    StatBatch batch;
+    if (remote.empty())
+    {
+        batch.run(paths, results);
+        return;
+    }
+    vector<StatBatch::Result> local_results, remote_results;
+    batch.run(local_paths, local_results);
+    batch.deadline_ms = remote_deadline_ms;
+    batch.run(remote_paths, remote_results);
+    results.resize(paths.size());
+    for (size_t i=0, k=0, j=0; i<paths.size(); i++)
+    {
+        if (k < remote.size() && remote[k] == i)
+            results[i] = remote_results[k++];
+        else
+            results[i] = local_results[j++];
+    }
+}
+
+vector<bool> Cdd::are_directories(const vector<string>& paths)
+{
+    vector<StatBatch::Result> results;
+    stat_paths(paths, results);
+    vector<bool> found(paths.size());
+    for (size_t i=0; i<paths.size(); i++)
+        found[i] = !results[i].gone();
+    return found;
 }
 
 bool Cdd::is_regular_file(string path)
 {
     // return fs::is_regular_file(path);
-    struct stat info;
-    return stat(path.c_str(), &info) == 0 && !(info.st_mode & S_IFDIR);
+    StatBatch::Result result = probe_path(path);
+    return result.error == 0 && !result.is_directory;
+}
+
+// Last line of a limited list of matches.  Unless opt_exact_count is set
+// the search stops at the first match past the limit, so the total is
+// not known.
+string Cdd::truncated_footer(const char *which, unsigned limit, unsigned count)
+{
+    stringstream strm;
+    strm << " ... showing " << which << " " << limit << " matching";
+    if (opt_exact_count)
+        strm << " of " << count;
+    else
+        strm << ", more matches available";
+    return strm.str();
 }
 
 bool Cdd::process_match(string& path_found, vector<string>& path_extra, stringstream& path_error)
 {
-    // Ignore case by default
-    std::regex re;
+    PathMatcher matcher;
     try
     {
-        re.assign(opt_path, std::regex_constants::icase);
+        matcher.compile(opt_path, match_engine);
     }
     catch (std::regex_error& e)
     {
@@ -587,17 +1273,16 @@ bool Cdd::process_match(string& path_found, vector<string>& path_extra, stringst
         return false;
     }
 
-    std::smatch what;
     if (direction.is_backwards())
     {
         unsigned count = 0;
         bool truncated = false;
         int number = -1;
-        vector<string>::iterator it;
-        for (it=vec_dir_last_to_first.begin(); it!=vec_dir_last_to_first.end(); ++it)
+        // Only as much of the stack is read as the matches need
+        for (size_t i=0; vec_dir_last_to_first.has(i) && !over_budget(); i++)
         {
-            string dir = *it;
-            if (std::regex_search(dir, what, re))
+            string_view dir = vec_dir_last_to_first[i];
+            if (matcher.search(dir))
             {
                 count ++;
                 if (path_found.empty())
@@ -609,16 +1294,16 @@ bool Cdd::process_match(string& path_found, vector<string>& path_extra, stringst
                     path_extra.push_back(strm.str());
                 }
                 else
+                {
                     truncated = true;
+                    if (!opt_exact_count)
+                        break;
+                }
             }
             number--;
         }
         if ( truncated )
-        {
-            stringstream strm;
-            strm << " ... showing last " << opt_limit_backwards << " matching of " << count;
-            path_extra.push_back(strm.str());
-        }
+            path_extra.push_back(truncated_footer("last", opt_limit_backwards, count));
     }
 
     else if (direction.is_forwards())
@@ -626,11 +1311,11 @@ bool Cdd::process_match(string& path_found, vector<string>& path_extra, stringst
         unsigned count = 0;
         bool truncated = false;
         int number = 0;
-        vector<string>::iterator it;
-        for (it=vec_dir_first_to_last.begin(); it!=vec_dir_first_to_last.end(); ++it)
+        PathView::const_iterator it;
+        for (it=vec_dir_first_to_last.begin(); it!=vec_dir_first_to_last.end() && !over_budget(); ++it)
         {
-            string dir = *it;
-            if (std::regex_search(dir, what, re))
+            string_view dir = *it;
+            if (matcher.search(dir))
             {
                 count ++;
                 if (path_found.empty())
@@ -642,53 +1327,60 @@ bool Cdd::process_match(string& path_found, vector<string>& path_extra, stringst
                     path_extra.push_back(strm.str());
                 }
                 else
+                {
                     truncated = true;
+                    if (!opt_exact_count)
+                        break;
+                }
             }
             number++;
         }
         if ( truncated )
-        {
-            stringstream strm;
-            strm << " ... showing first " << opt_limit_forwards << " matching of " << count;
-            path_extra.push_back(strm.str());
-        }
+            path_extra.push_back(truncated_footer("first", opt_limit_forwards, count));
     }
 
-    else if (direction.is_common())
+    else if (direction.is_common() || direction.is_frecent())
     {
+        // Both are ranked lists of Common, numbered with their direction
+        LazyView<CommonView>& view = direction.is_common() ? vec_dir_most_to_least : vec_dir_frecent;
+        unsigned limit = direction.is_common() ? opt_limit_common : opt_limit_frecent;
+        const char *mark = direction.is_common() ? "," : "%";
         unsigned count = 0;
         bool truncated = false;
         int number = 0;
-        vector<Common>::iterator it;
-        for (it=vec_dir_most_to_least.begin(); it!=vec_dir_most_to_least.end(); ++it)
+        // Only as much of the list is ranked as the matches need
+        for (size_t i=0; view.has(i) && !over_budget(); i++)
         {
-            string dir = it->dir;
-            if (std::regex_search(dir, what, re))
+            Common common = view[i];
+            string_view dir = common.dir;
+            if (matcher.search(dir))
             {
                 count ++;
                 if (path_found.empty())
                     path_found = dir;
-                else if ( opt_all || opt_limit_common == 0 || count <= opt_limit_common )
+                else if ( opt_all || limit == 0 || count <= limit )
                 {
                     stringstream strm;
                     if (number < 10)
                         strm << " ";
-                    strm << "," << number << ": (" << setw(2) << it->count << ") " << it->dir;
+                    strm << mark << number << ": (" << setw(2) << common.count << ") " << common.dir;
                     path_extra.push_back(strm.str());
                 }
                 else
+                {
                     truncated = true;
+                    if (!opt_exact_count)
+                        break;
+                }
             }
             number++;
         }
         if ( truncated )
-        {
-            stringstream strm;
-            strm << " ... showing top " << opt_limit_common << " matching of " << count;
-            path_extra.push_back(strm.str());
-        }
+            path_extra.push_back(truncated_footer("top", limit, count));
     }
 
+    if (path_found.empty() && opt_discover)
+        discover(matcher, path_found);
     if (path_found.empty())
     {
         path_error << "Cannot match pattern: '" << opt_path << "'" << endl;
@@ -697,15 +1389,70 @@ bool Cdd::process_match(string& path_found, vector<string>& path_extra, stringst
     return true;
 }
 
+#ifdef WIN32
+static const char path_list_separator = ';';
+#else
+static const char path_list_separator = ':';
+#endif
+
+vector<string> Cdd::discovery_roots(void)
+{
+    vector<string> roots;
+    roots.push_back(current_path.empty() ? get_working_path() : current_path);
+#ifdef WIN32
+    roots.push_back(get_environment("USERPROFILE"));
+#else
+    roots.push_back(get_environment("HOME"));
+#endif
+    vector<string> more = split(opt_discover_roots, path_list_separator);
+    roots.insert(roots.end(), more.begin(), more.end());
+    return roots;
+}
+
+// The first hit goes to the shell as a match from the history would
+bool Cdd::discover(const PathMatcher& matcher, string& path_found)
+{
+    Discovery discovery;
+    discovery.roots = discovery_roots();
+    vector<string> prune = split(opt_discover_prune, path_list_separator);
+    discovery.prune.insert(discovery.prune.end(), prune.begin(), prune.end());
+    discovery.max_depth = opt_discover_depth;
+    discovery.time_ms = opt_discover_ms;
+    if (opt_budget_ms > 0)
+    {
+        // No longer than the budget has left
+        int64_t left = budget_deadline - clock();
+        if (left <= 0 || over_budget())
+            return false;
+        discovery.time_ms = discovery.time_ms ? unsigned(min<int64_t>(left, discovery.time_ms)) : unsigned(left);
+    }
+    discovery.clock = clock;
+    if (!opt_stat_remote)
+        discovery.mounts = MountTable::current();
+    path_found = discovery.find(matcher);
+    over_budget();
+    return !path_found.empty();
+}
+
 void Cdd::garbage_collect(void)
 {
-    command_generator(vec_dir_first_to_last);
+    // A history store is kept small by compaction, which keeps the visit
+    // counts as well
+    if (!opt_store.empty())
+    {
+        if (compact_store())
+            strm_err << "cdd gc" << endl;
+        return;
+    }
+    fill_first_to_last(string::npos);
+    vector<string> vec_dir = vec_dir_first_to_last.strings();
+    command_generator(vec_dir);
     strm_err << "cdd gc" << endl;
 }
 
-bool has_string(vector<string>& vec, string str)
+bool has_string(const PathView& vec, const string& str)
 {
-    vector<string>::iterator it;
+    PathView::const_iterator it;
     for (it=vec.begin(); it!=vec.end(); ++it)
     {
         if (*it == str)
@@ -736,19 +1483,103 @@ void Cdd::process_delete(void)
         return;
     }
 
-    vector<string> vec_dir;
-    vec_dir.assign(vec_dir_stack.rbegin(), vec_dir_stack.rend());
+    if (!opt_store.empty())
+    {
+        if (compact_store([&path_found](string_view dir) { return dir != path_found; }))
+            strm_err << "cdd del: " << path_found << endl;
+        return;
+    }
+    fill_stack(string::npos);
+    vector<string> vec_dir = vec_dir_stack.strings();
+    reverse(vec_dir.begin(), vec_dir.end());
     command_generator(vec_dir, path_found);
     strm_err << "cdd del: " << path_found << endl;
 }
 
 void Cdd::process_reset(void)
 {
+    if (!opt_store.empty())
+    {
+        if (compact_store([](string_view) { return false; }))
+            strm_err << "cdd reset" << endl;
+        return;
+    }
     vector<string> vec_dir;
     command_generator(vec_dir);
     strm_err << "cdd reset" << endl;
 }
 
+void Cdd::process_compact(void)
+{
+    if (opt_store.empty())
+    {
+        strm_err << "** Compaction needs a history store, see --store" << endl;
+        return;
+    }
+    if (compact_store())
+        strm_err << "cdd compact" << endl;
+}
+
+// Remove every directory that is no longer there.  With a history store
+// they are left out of a new snapshot, otherwise the shell is given the
+// stack without them.
+void Cdd::process_prune(void)
+{
+    // Each spelling of a directory is checked once, all in one sweep
+    fill_stack(string::npos);
+    vector<string> vec_dir = vec_dir_stack.strings();
+    vector<string> paths = vec_dir;
+    sort(paths.begin(), paths.end());
+    paths.erase(unique(paths.begin(), paths.end()), paths.end());
+    vector<bool> found = are_directories(paths);
+    vector<string> pruned;
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        if (!found[i])
+            pruned.push_back(paths[i]);
+    }
+    if (pruned.empty())
+    {
+        strm_err << "cdd prune: nothing to remove" << endl;
+        return;
+    }
+
+    auto keep = [&pruned](string_view dir) { return !binary_search(pruned.begin(), pruned.end(), dir); };
+    if (!opt_store.empty())
+    {
+        if (!compact_store(keep))
+            return;
+    }
+    else
+    {
+        // The stack is built again in one go without them
+        vector<string> vec_keep;
+        for (size_t i=vec_dir.size(); i-- > 0; )
+        {
+            if (keep(vec_dir[i]))
+                vec_keep.push_back(vec_dir[i]);
+        }
+        command_generator(vec_keep);
+    }
+    for (size_t i=0; i<pruned.size(); i++)
+        strm_err << "cdd prune: " << pruned[i] << endl;
+}
+
+// With a history store the log is folded into a new snapshot,
+// there is nothing for the shell to do
+bool Cdd::compact_store(function<bool(string_view)> keep)
+{
+    string warning;
+    bool ok = HistoryStore::compact(opt_store, keep, true, &warning);
+    if (!warning.empty())
+        strm_err << "** " << warning << endl;
+    if (ok)
+        return true;
+    if (warning.empty())
+        strm_err << "** Cannot write history store: " << opt_store << endl;
+    return false;
+}
+
 void Cdd::command_generator(vector<string>& vec_dir, const string& dir_delete)
 {
 #ifdef WIN32
@@ -800,11 +1631,7 @@ void Cdd::set_opt_path(const string& opt_path)
     // Here: direction has not been assigned.
     // Try to discern the direction if an integer value has been passed.
     int ivalue;
-    try
-    {
-        ivalue = std::stoi(opt_path);
-    }
-    catch (std::logic_error &)
+    if (!parse_leading_int(opt_path, ivalue))
     {
         // Not an int, so give up
         return;
@@ -895,8 +1722,20 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
             ("limit-backwards", "Limit of history (last to first) to display", cxxopts::value(opt_limit_backwards))
             ("limit-forwards", "Limit of history (first to last) to display", cxxopts::value(opt_limit_forwards))
             ("limit-common", "Limit of history (most to least) to display", cxxopts::value(opt_limit_common))
+            ("limit-frecent", "Limit of history (most to least frecent) to display", cxxopts::value(opt_limit_frecent))
+            ("budget-ms", "Longest a search may take in milliseconds", cxxopts::value(opt_budget_ms))
+            ("discover", "Look on disk for a pattern the history has no match for")
+            ("discover-roots", "More directories for --discover to look under", cxxopts::value(opt_discover_roots))
+            ("discover-prune", "More names of directories for --discover not to enter", cxxopts::value(opt_discover_prune))
+            ("discover-depth", "Levels below each root for --discover", cxxopts::value(opt_discover_depth))
+            ("discover-ms", "Longest --discover may take in milliseconds", cxxopts::value(opt_discover_ms))
             ("path-separator", "Custom path separator", cxxopts::value(opt_separator))
             ("all", "Show all, do not limit listing")
+            ("exact-count", "Count all matches when the listing is limited")
+            ("dedupe", "Merge the directories that are the same by device and inode")
+            ("stat-remote", "Compare identities on network file systems too")
+            ("store", "Keep history in a file rather than the directory stack", cxxopts::value<string>())
+            ("socket", "Socket of a history server for the store", cxxopts::value<string>())
             ;
 
         auto vec_env_options = split(env_options);
@@ -927,6 +1766,10 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
             ("del", "Delete from history")
             ("delete", "Delete from history")
             ("reset", "Reset (erase) all history")
+            ("prune", "Remove directories that no longer exist from history")
+            ("compact", "Fold the log of the history store into its snapshot")
+            ("since", "Only history of the store since a time", cxxopts::value<string>())
+            ("coproc", "Serve requests from a shell coprocess")
             ("positional", "Positional parameters", cxxopts::value<std::vector<std::string>>(vec_action))
 #if !defined(NDEBUG)
             (param_debug_input, "Directory stack to use, parsed from a file", cxxopts::value<string>())
@@ -971,6 +1814,15 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
             opt_delete = true;
         if (opts_cmd.count("reset"))
             opt_reset = true;
+        if (opts_cmd.count("prune"))
+            opt_prune = true;
+        if (opts_cmd.count("compact"))
+            opt_compact = true;
+        if (opts_cmd.count("coproc"))
+        {
+            opt_coproc = true;
+            return true;
+        }
         string opt_direction;
         opt_direction = get_value<string>("direction", opts_cmd, opts_env);
         if ( ! opt_direction.empty() )
@@ -988,6 +1840,29 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
         }
 
         opt_all = get_value<bool>("all", opts_cmd, opts_env);
+        opt_exact_count = get_value<bool>("exact-count", opts_cmd, opts_env);
+        opt_dedupe = get_value<bool>("dedupe", opts_cmd, opts_env);
+        opt_stat_remote = get_value<bool>("stat-remote", opts_cmd, opts_env);
+        opt_discover = get_value<bool>("discover", opts_cmd, opts_env);
+        opt_store = get_value<string>("store", opts_cmd, opts_env);
+        opt_socket = get_value<string>("socket", opts_cmd, opts_env);
+        if (opts_cmd.count("since"))
+        {
+            string since = opts_cmd["since"].as<string>();
+            if (!parse_since(since, time(nullptr), opt_since))
+            {
+                strm_err << "** Options error: cannot read time for --since: " << since << endl;
+                help_tip();
+                return false;
+            }
+            // Only the store knows when a directory was visited
+            if (opt_store.empty())
+            {
+                strm_err << "** Options error: --since needs a history store (--store)" << endl;
+                help_tip();
+                return false;
+            }
+        }
 
         if (opts_cmd.count("path"))
             set_opt_path(opts_cmd["path"].as<string>());
@@ -1002,7 +1877,7 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
         if (vec_action.empty())
         {
             // Need at least history or path or one of the commands
-            if (opt_history || (! opt_path.empty()) || opt_gc || opt_delete || opt_reset)
+            if (opt_history || (! opt_path.empty()) || opt_gc || opt_delete || opt_reset || opt_prune || opt_compact)
                 return true;
             // Here: no actions specified, look in the 'action' option parameter
             string action = get_value<string>("action", opts_cmd, opts_env);
@@ -1050,12 +1925,8 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
             if (set_history_direction(vec_action[0]))
             {
                 opt_history = true;
-                unsigned amount;
-                try
-                {
-                    amount = std::stoi(vec_action[1]);
-                }
-                catch (std::logic_error &)
+                int amount;
+                if (!parse_leading_int(vec_action[1], amount))
                 {
                     strm_err << "** Options error: expecting number for second option: "
                         << vec_action[0] << " " << vec_action[1] << endl;
@@ -1068,6 +1939,8 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
                     opt_limit_forwards = amount;
                 else if (direction.is_common())
                     opt_limit_common = amount;
+                else if (direction.is_frecent())
+                    opt_limit_frecent = amount;
                 // Number specified here overrides --all
                 opt_all = false;
                 return true;
@@ -1092,6 +1965,49 @@ bool Cdd::options(int ac, const char *av[], const string& env_options)
     }
 }
 
+bool Cdd::parse_since(const string& spec, int64_t now, int64_t& since)
+{
+    // A length of time back from now: "90s", "30m", "2h", "3d" or "1w"
+    static const char units[] = "smhdw";
+    static const int64_t unit_seconds[] = {1, 60, 3600, 86400, 7 * 86400};
+    size_t digits = spec.find_first_not_of("0123456789");
+    if (digits > 0 && digits <= 9 && digits + 1 == spec.size() && strchr(units, spec[digits]))
+    {
+        int64_t amount = 0;
+        std::from_chars(spec.data(), spec.data() + digits, amount);
+        since = now - amount * unit_seconds[strchr(units, spec[digits]) - units];
+        return true;
+    }
+
+    // Otherwise the start of a day, in local time
+    time_t t = now;
+    struct tm day;
+#ifdef WIN32
+    localtime_s(&day, &t);
+#else
+    localtime_r(&t, &day);
+#endif
+    if (spec == "yesterday")
+        day.tm_mday -= 1;
+    else if (spec != "today")
+    {
+        int year, month, mday;
+        char extra;
+        if (sscanf(spec.c_str(), "%d-%d-%d%c", &year, &month, &mday, &extra) != 3
+            || month < 1 || month > 12 || mday < 1 || mday > 31)
+            return false;
+        day.tm_year = year - 1900;
+        day.tm_mon = month - 1;
+        day.tm_mday = mday;
+    }
+    day.tm_hour = 0;
+    day.tm_min = 0;
+    day.tm_sec = 0;
+    day.tm_isdst = -1;
+    since = mktime(&day);
+    return since != -1;
+}
+
 void Cdd::help_tip(void)
 {
     strm_err << "Use --help to see possible options" << endl;
@@ -1110,25 +2026,43 @@ cerr <<
 "\n"
 "  --history               Show directory history depending on the direction\n"
 "  --path=PATH_SPEC        Change to path specification (number or regular expression pattern)\n"
-"  --direction={-|+|,}     Specify direction (backwards, forwards, most common) for history or PATH_SPEC\n"
+"  --direction={-|+|,|%}   Specify direction (backwards, forwards, most common, frecent) for history or PATH_SPEC\n"
 "  --limit-backwards=n     Show at most n directories for last to first history\n"
 "  --limit-forwards=n      Show at most n directories for first to last history\n"
 "  --limit-common=n        Show at most n directories for most to least visited directories\n"
+"  --limit-frecent=n       Show at most n directories for most to least frecent directories\n"
+"  --budget-ms=n           Give the best match found within n milliseconds, with a warning if cut short\n"
+"  --discover              When no directory in the history matches, look for one on disk\n"
+"                          under the current directory and the home directory\n"
+"  --discover-roots=DIRS   Also look under these directories, separated by ':'\n"
+"  --discover-prune=NAMES  Also skip directories with these names (.git, node_modules, ...)\n"
+"  --discover-depth=n      Look at most n levels down (default 4)\n"
+"  --discover-ms=n         Look for at most n milliseconds (default 300)\n"
 "  --path-separator=n      Force path separator to be a specific character\n"
 "  --all                   Show all directories (overriding any 'limit' options)\n"
+"  --exact-count           Count every match of PATH_SPEC when the list of matches is limited\n"
+"  --dedupe                Merge directories reached by more than one path (symlinks, bind mounts)\n"
+"  --stat-remote           Compare directories on network file systems by identity, not only by name\n"
 "  --action                Default freeform option to use when nothing else specified\n"
 "  --gc                    Do garbage collection by minimizing directory stack\n"
 "  --del=PATH_SPEC         Remove from history the directory matching PATH_SPEC\n"
 "  --reset                 Reset the directory stack which clears all history\n"
+"  --prune                 Remove directories that no longer exist from history\n"
+"  --store=FILE            Keep history in FILE rather than the shell's directory stack\n"
+"  --compact               Fold the log of the history store into its snapshot\n"
+"  --socket=PATH           Ask the cdd-server on PATH about the history store\n"
+"  --since=TIME            Only history of the store since TIME, such as 2h, 3d, yesterday or 2021-06-30\n"
+"  --coproc                Keep running and serve requests from a shell coprocess (see INSTALL)\n"
 "  --help                  Show help (this information)\n"
 "  --version               Show version number\n"
 "\n"
 "FREEFORM_OPTIONS:\n"
  "\n"
-"  {-|+|,|?}?              Show directory history (backwards '-', forwards '+' or most common ',' or '?')\n"
-"  {-|+|,|?}? n            Show history limited by n amount (n == 0 means show all history)\n"
+"  {-|+|,|%|?}?            Show directory history (backwards '-', forwards '+', most common ',' or '?',\n"
+"                          or frecent '%', visits that count for less the longer ago they were)\n"
+"  {-|+|,|%|?}? n          Show history limited by n amount (n == 0 means show all history)\n"
 "  PATH_SPEC               Change to PATH_SPEC using the default direction\n"
-"  {-|+|,} PATH_SPEC       Change to PATH_SPEC using the specified direction\n"
+"  {-|+|,|%} PATH_SPEC     Change to PATH_SPEC using the specified direction\n"
 "\n"
 "PATH_SPEC can be a number, a repeated direction, or a direction and a pattern.\n"
 "\n"
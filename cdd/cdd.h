@@ -27,8 +27,18 @@ along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <sstream>
 #include <exception>
+#include <functional>
+#include <memory>
 using namespace std;
 
+#include "cdd_index.h"
+#include "cdd_match.h"
+#include "cdd_store.h"
+#include "cdd_snapshot.h"
+#include "cdd_stat.h"
+#include "cdd_mount.h"
+#include "cdd_discover.h"
+
 struct Cdd
 {
     struct Exception : public exception
@@ -39,23 +49,76 @@ struct Cdd
         virtual const char* what() const throw() { return _msg.c_str(); }
     };
 
+    // A list of directories that is filled in on first access.
+    // fill is called with the number of items needed, or npos for all.
+    template<typename View>
+    struct LazyView : View
+    {
+        static const size_t npos = size_t(-1);
+        Cdd* cdd = nullptr;
+        void (Cdd::*fill)(size_t count) = nullptr;
+        size_t size(void) { (cdd->*fill)(npos); return View::size(); }
+        bool empty(void) { (cdd->*fill)(1); return View::empty(); }
+        auto operator[](size_t i) { (cdd->*fill)(i + 1); return View::operator[](i); }
+        // Whether there is an entry at i, filling no further than that
+        bool has(size_t i) { (cdd->*fill)(i + 1); return i < View::size(); }
+        auto begin(void) { (cdd->*fill)(npos); return View::begin(); }
+        auto end(void) { (cdd->*fill)(npos); return View::end(); }
+    };
+
+    // Distinct directories of the stack with their positions and counts.
+    // The directory names themselves are interned in its arena, and the
+    // lists below hold numbers into the arena rather than string copies.
+    // The stack is indexed from the top only as far as the lists that
+    // are actually used require.
+    PathIndex path_index;
+    // A prebuilt index read in place of path_index, see assign
+    const IndexSnapshot *snapshot = nullptr;
+    // Where the snapshot comes from for assign_cached
+    StackCache stack_cache;
+    unique_ptr<IndexSnapshot> built_snapshot;
+    // The stack given to assign_cached and the cache to look it up in,
+    // until index_cached has done so
+    string_view cached_lines;
+    string stack_cache_dir;
+    // A stack kept indexed as it changes, read in place of path_index
+    const StackIndex *stack_index = nullptr;
+    const PathIndex& index(void) const
+    {
+        return stack_index ? stack_index->index : snapshot ? snapshot->index : path_index;
+    }
+    // Distinct directories on the stack
+    size_t distinct_count(void)
+    {
+        if (stack_index)
+            return stack_index->distinct_count();
+        fill_stack(string::npos);
+        return index().entry_count();
+    }
     // The raw list of of pushed directories
-    vector<string> vec_dir_stack;
+    LazyView<PathView> vec_dir_stack;
     // The vector of pushed directories,
     // stored in last visited to first visited order
-    vector<string> vec_dir_last_to_first;
+    LazyView<PathView> vec_dir_last_to_first;
     // The vector of set of directories visited (duplicates removed),
     // stored in first visited to last visited order
-    vector<string> vec_dir_first_to_last;
+    LazyView<PathView> vec_dir_first_to_last;
     bool has_directory_stack = false;
+    // Supplies the rest of the stack, one directory at a time
+    function<bool(string&)> stack_source;
+    string stack_line;
+    // Visits that stack_line stands for, a history store folds repeats
+    uint32_t stack_line_weight = 1;
+    // Log of their decayed weight from a history store, NAN otherwise
+    double stack_line_frecency = NAN;
 
     // This tracks the most common directories
     struct Common
     {
         int count;
         int sequence;
-        string dir;
-        Common(int count, int sequence, string dir) : count(count), sequence(sequence), dir(dir) {}
+        string_view dir;
+        Common(int count, int sequence, string_view dir) : count(count), sequence(sequence), dir(dir) {}
         bool operator==(const Common& obj) const
         {
             return count == obj.count && sequence == obj.sequence && dir == obj.dir;
@@ -73,26 +136,95 @@ struct Cdd
             return out;
         }
     };
-    vector<Common> vec_dir_most_to_least;
+    // Read only list of Common, held as index entry numbers
+    struct CommonView
+    {
+        const PathIndex* index = nullptr;
+        vector<uint32_t> ids;
+        size_t size(void) const { return ids.size(); }
+        bool empty(void) const { return ids.empty(); }
+        Common operator[](size_t i) const
+        {
+            const PathIndex::Entry& entry = index->entry(ids[i]);
+            return Common(entry.count, ids[i], index->arena[entry.name]);
+        }
+    };
+    LazyView<CommonView> vec_dir_most_to_least;
+    // The same directories ordered by frecency, the visits that count for
+    // less the longer ago they were (see PathIndex::Entry)
+    LazyView<CommonView> vec_dir_frecent;
 
     stringstream strm_out;
     stringstream strm_err;
 
     string current_path;
+    string current_path_normalized;
     bool current_path_added;
+    // Identity of the current path, stat'ed on first need
+    FileId current_path_id;
+    bool current_path_id_known;
+    // Read on first need, see is_remote_path
+    shared_ptr<const MountTable> mount_table;
+    MountTable::ComponentCache mount_components;
+    // Per index entry result of is_current_path: -1 unknown, 0 no, 1 yes
+    vector<signed char> vec_current_path_memo;
     bool opt_help;
     bool opt_version;
     string opt_path;
     string opt_path_original;
+    // Where process sent the shell, empty when it did not
+    string path_destination;
     bool opt_history;
     bool opt_gc;
     bool opt_delete;
     bool opt_reset;
+    bool opt_prune;
+    // Merge the directories that are the same by (dev, ino)
+    bool opt_dedupe;
+    // Where the identities for opt_dedupe are kept between runs, empty
+    // to keep them only for the run
+    string identity_cache_path;
+    // Compare the identities of paths on network file systems too, see
+    // is_remote_path
+    bool opt_stat_remote;
+    // Longest wait for a stat of a path on a network file system
+    unsigned remote_deadline_ms;
+    // Longest a run of process may take in milliseconds, 0 for no limit.
+    // Past it the stack is read no further, matching stops and identities
+    // are compared by name alone, and what was found so far is given
+    // with a warning.
+    unsigned opt_budget_ms;
+    // Milliseconds from any fixed point, steady_clock unless replaced
+    function<int64_t(void)> clock;
+    int64_t budget_deadline;
+    bool budget_exceeded;
+    bool budget_started;
+    // Look on disk for a pattern the history has no match for, see
+    // Discovery
+    bool opt_discover;
+    // More roots to look under, separated by path_list_separator
+    string opt_discover_roots;
+    // More names of directories not to enter, separated the same way
+    string opt_discover_prune;
+    unsigned opt_discover_depth;
+    unsigned opt_discover_ms;
+    bool opt_coproc;
+    bool opt_compact;
+    // History file used in place of the shell's directory stack
+    string opt_store;
+    // Socket of a history server for the store
+    string opt_socket;
+    // Only visits to the store at or after this time, 0 for all of them
+    int64_t opt_since;
     unsigned opt_limit_backwards;
     unsigned opt_limit_forwards;
     unsigned opt_limit_common;
+    unsigned opt_limit_frecent;
     bool opt_all;
+    bool opt_exact_count;
     char opt_separator;
+    // Engine used for pattern matching, only changed by tests
+    PathMatcher::Engine match_engine;
     static const string env_options_name;
 
     struct Direction
@@ -101,7 +233,7 @@ struct Cdd
         bool _direction_assigned;
         // default direction is backwards
         Direction(const string& direction="-") : _direction(direction), _direction_assigned(false) {}
-        static bool is_valid_direction(string s) { return s == "+" || s == "-" || s == ","; }
+        static bool is_valid_direction(string s) { return s == "+" || s == "-" || s == "," || s == "%"; }
         void assign(string direction)
         {
             if (!is_valid_direction(direction))
@@ -116,26 +248,85 @@ struct Cdd
         bool is_forwards() { return _direction == "+"; }
         bool is_backwards() { return _direction == "-"; }
         bool is_common() { return _direction == ","; }
+        bool is_frecent() { return _direction == "%"; }
         bool is_assigned() { return _direction_assigned; }
     };
     Direction direction;
 
+    // Classification of a PATH_SPEC such as "3", "--", "-2", "+++", ",1" or "%%".
+    // Anything else is a directory name or a pattern.
+    struct PathSpec
+    {
+        enum Kind
+        {
+            SPEC_OTHER,
+            SPEC_NUMBER,            // 3
+            SPEC_DASHES,            // ---
+            SPEC_DASH_NUMBER,       // -3
+            SPEC_PLUSES,            // +++
+            SPEC_PLUS_NUMBER,       // +3
+            SPEC_COMMAS,            // ,,,
+            SPEC_COMMA_NUMBER,      // ,3
+            SPEC_PERCENTS,          // %%%
+            SPEC_PERCENT_NUMBER,    // %3
+        };
+        Kind kind = SPEC_OTHER;
+        // The number, or the length of a run of dashes, pluses, commas or percents
+        unsigned amount = 0;
+
+        static PathSpec parse(string_view spec);
+    };
+
     Cdd(void);
     Cdd(vector<string>& vec_pushd, string current_path);
     Cdd(string arr_pushd[], int count, string current_path=string());
+    Cdd(const HistoryStore& store, string current_path);
     void assign(vector<string>& vec_pushd, string current_path);
     void assign(string arr_pushd[], int count, string current_path=string());
+    void assign(istream& strm, string current_path);
+    void assign(const HistoryStore& store, string current_path);
+    // Record a visit to current_path in the open store, then process
+    // with the store as the directory stack
+    void process_store(HistoryStore& store, const string& current_path);
+    // Where process sent the shell, to record on top of a store as pushd
+    // puts it on top of the stack.  Empty for none or a relative path.
+    string store_destination(void) const;
+    // Read the stack from a snapshot built with the same path separator,
+    // nothing is indexed again
+    void assign(const IndexSnapshot& snapshot, string current_path);
+    // Read the stack from an index built with the same path separator
+    // and kept up to date with push, pop and erase.  It has to outlive
+    // any use of the lists and not change meanwhile.
+    void assign(const StackIndex& stack_index, string current_path);
+    // Read a stack given as lines of text, top first.  The lines are
+    // indexed as they are needed, and only a command that reads the
+    // whole stack anyway looks it up in the cache of stacks in
+    // cache_dir, see index_cached.  The lines have to outlive any use
+    // of the lists.
+    void assign_cached(string_view lines, string current_path, const string& cache_dir);
+    void index_cached(void);
+    void assign_source(const string& current_path, function<bool(string&)> source);
+    bool scan_next(void);
+    bool scan_snapshot(void);
+    bool scan_stack_index(void);
+    void dedupe_stack(void);
+    void fill_stack(size_t count);
+    void fill_last_to_first(size_t count);
+    void fill_first_to_last(size_t count);
+    void fill_most_to_least(size_t count);
+    void fill_frecent(size_t count);
     void assign_debug_input(const string& input_path);
     void initialize(void);
     bool options(int ac, const char *av[], const string& options=string());
     void help_tip(void);
     static void help(void);
+    // Read a --since time such as "2h", "3d", "yesterday" or "2021-06-30"
+    static bool parse_since(const string& spec, int64_t now, int64_t& since);
     static void version(void);
     string normalize_path(const string& path);
     string windowize_path(const string& path);
     string get_parent_path(const string& path);
-    static bool paths_equal(const string& path1, int inode1, const string& path2);
-    static int get_inode(const string& path);
+    bool is_current_path(uint32_t id);
     string expand_dots(string path);
     int pushd_count();
 
@@ -145,14 +336,20 @@ struct Cdd
     bool go_backwards(unsigned amount, string& path_found, stringstream& path_error);
     bool go_forwards(unsigned amount, string& path_found, stringstream& path_error);
     bool go_common(unsigned amount, string& path_found, stringstream& path_error);
+    bool go_frecent(unsigned amount, string& path_found, stringstream& path_error);
     bool process_match(string& path_found, vector<string>& path_extra, stringstream& path_error);
+    string truncated_footer(const char *which, unsigned limit, unsigned count);
     void show_history(void);
     void show_history_first_to_last(void);
     void show_history_last_to_first(void);
     void show_history_most_to_least(void);
+    void show_history_frecent(void);
     void garbage_collect(void);
     void process_delete(void);
     void process_reset(void);
+    void process_prune(void);
+    void process_compact(void);
+    bool compact_store(function<bool(string_view)> keep=nullptr);
     void command_generator(vector<string>& vec_dir, const string& dir_delete=string());
     void command_generator_win32(vector<string>& vec_dir, const string& dir_delete=string());
     void command_generator_bash(vector<string>& vec_dir, const string& dir_delete=string());
@@ -160,7 +357,31 @@ struct Cdd
     bool set_history_direction(const string& spec);
 
     virtual bool is_directory(string path);
+    // is_directory for many paths at once, see StatBatch.  Only a path
+    // known not to be a directory is false, one that could not be
+    // checked is taken to be there still.
+    virtual vector<bool> are_directories(const vector<string>& paths);
+    // A batch of stats through StatBatch
+    virtual void stat_paths(const vector<string>& paths, vector<StatBatch::Result>& results);
     virtual bool is_regular_file(string path);
+    // Not valid when the path cannot be stat'ed
+    virtual FileId get_file_id(const string& path);
+    // On a network file system, where a stat can hang on a server that
+    // has gone away.  Identities are only compared by spelling there
+    // unless opt_stat_remote is set, and a stat that cannot be avoided
+    // waits at most remote_deadline_ms.
+    virtual bool is_remote_path(const string& path);
+    StatBatch::Result probe_path(const string& path);
+    // Start counting the budget.  process starts it unless main already
+    // has, before the stack was read.
+    void start_budget(void);
+    bool over_budget(void);
+    // Whether process only searches or lists the history, the commands
+    // held to the budget
+    bool held_to_budget(void) const;
+    bool discover(const PathMatcher& matcher, string& path_found);
+    // The current path, the home directory and opt_discover_roots
+    virtual vector<string> discovery_roots(void);
 };
 
 #endif
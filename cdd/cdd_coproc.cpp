@@ -0,0 +1,179 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include "cdd_coproc.h"
+
+// More arguments than any shell function would pass
+static const long long max_args = 1024;
+
+static size_t count_lines(string& text)
+{
+    if (!text.empty() && text.back() != '\n')
+        text += '\n';
+    return count(text.begin(), text.end(), '\n');
+}
+
+void CoprocServer::respond(ostream& out, const string& status, const string& text_out, const string& text_err)
+{
+    string lines_out = text_out;
+    string lines_err = text_err;
+    size_t count_out = count_lines(lines_out);
+    size_t count_err = count_lines(lines_err);
+    out << "cdd-response " << status << " " << count_out << " " << count_err << "\n"
+        << lines_out << lines_err;
+    // The shell is waiting on the whole response
+    out.flush();
+}
+
+bool CoprocServer::serve_one(istream& in, ostream& out)
+{
+    string header;
+    if (!getline(in, header))
+        return false;
+    if (header.compare(0, 10, "cdd-delta ") == 0)
+        return serve_delta(header, in, out);
+    istringstream strm(header);
+    string tag, push_text;
+    long long arg_count, keep, push = 0;
+    bool to_empty_line = false;
+    if (strm >> tag >> arg_count >> keep >> push_text)
+    {
+        to_empty_line = push_text == "-";
+        if (!to_empty_line)
+            istringstream(push_text) >> push;
+    }
+    if (!strm || tag != "cdd-request" || arg_count < 0 || arg_count > max_args
+        || keep < 0 || push < 0 || (!to_empty_line && push_text.find_first_not_of("0123456789") != string::npos))
+    {
+        respond(out, "error", "", "** Malformed coproc request: " + header);
+        return true;
+    }
+
+    vector<string> args(arg_count);
+    string cwd, env_options;
+    for (size_t i=0; i<args.size(); i++)
+    {
+        if (!getline(in, args[i]))
+            return false;
+    }
+    if (!getline(in, cwd) || !getline(in, env_options))
+        return false;
+    vector<string> pushed;
+    string line;
+    for (long long i=0; to_empty_line || i<push; i++)
+    {
+        if (!getline(in, line))
+            return false;
+        if (to_empty_line && line.empty())
+            break;
+        pushed.push_back(line);
+    }
+
+    if (size_t(keep) > stack.size())
+    {
+        respond(out, "resync", "", "");
+        return true;
+    }
+    if (keep == 0)
+    {
+        keep = stack.shared_bottom(pushed);
+        pushed.resize(pushed.size() - keep);
+    }
+    stack.pop(stack.size() - keep);
+    for (size_t i=pushed.size(); i-- > 0; )
+        stack.push(pushed[i]);
+
+    if (change_directory && !cwd.empty())
+        set_working_path(cwd);
+
+    Cdd cdd;
+    vector<const char *> av;
+    av.push_back("_cdd");
+    for (size_t i=0; i<args.size(); i++)
+        av.push_back(args[i].c_str());
+    try
+    {
+        if (cdd.options(av.size(), av.data(), env_options))
+        {
+            if (!cdd.has_directory_stack && cdd.opt_separator == stack.index.separator)
+                cdd.assign(stack, cwd);
+            else if (!cdd.has_directory_stack)
+            {
+                // Indexed again for another separator, top first
+                size_t pos = 0;
+                cdd.assign_source(cwd, [this, pos](string& dir) mutable {
+                    if (pos >= stack.size())
+                        return false;
+                    dir.assign(stack[pos++]);
+                    return true;
+                });
+            }
+            cdd.process();
+        }
+        respond(out, "ok", cdd.strm_out.str(), cdd.strm_err.str());
+    }
+    catch (exception& e)
+    {
+        respond(out, "ok", "", cdd.strm_err.str() + "** Caught exception: " + e.what());
+    }
+    return true;
+}
+
+bool CoprocServer::serve_delta(const string& header, istream& in, ostream& out)
+{
+    istringstream strm(header);
+    string tag, op, amount_text, extra;
+    long long amount = -1;
+    strm >> tag >> op;
+    if ((op == "pop" || op == "delete") && strm >> amount_text
+        && amount_text.find_first_not_of("0123456789") == string::npos)
+        istringstream(amount_text) >> amount;
+    if ((op != "push" && amount < 0) || strm >> extra)
+    {
+        respond(out, "error", "", "** Malformed coproc request: " + header);
+        return true;
+    }
+
+    bool held = true;
+    if (op == "push")
+    {
+        string dir;
+        if (!getline(in, dir))
+            return false;
+        stack.push(dir);
+    }
+    else if (op == "pop")
+        held = stack.pop(amount);
+    else
+        held = stack.erase(amount);
+    respond(out, held ? "ok" : "resync", "", "");
+    return true;
+}
+
+void CoprocServer::serve(istream& in, ostream& out)
+{
+    while (serve_one(in, out))
+        ;
+}
+
+// vim:ff=unix
@@ -0,0 +1,84 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CDD_COPROC_H
+#define CDD_COPROC_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+#include "cdd_index.h"
+
+// Serves cdd requests from a shell that runs "_cdd --coproc" as a
+// coprocess, so that a cd costs no fork or exec.  The shell sends only
+// the part of its directory stack that changed since the last request.
+//
+// A request is a header line followed by one line per item:
+//
+//     cdd-request ARGC KEEP PUSH
+//     ARGC lines of arguments
+//     the working directory of the shell
+//     the value of CDD_OPTIONS
+//     PUSH lines of directories, top of the stack first
+//
+// The new stack is the PUSH directories on top of the bottom KEEP
+// directories of the previous stack.  PUSH may also be "-", for
+// directories up to an empty line, which lets bash send its stack with
+// "dirs -l -p" and no fork.  The response is
+//
+//     cdd-response STATUS OUT ERR
+//     OUT lines for the shell to eval
+//     ERR lines to show on stderr
+//
+// where STATUS is "ok", or "resync" when fewer than KEEP directories are
+// held, in which case the shell sends the request again with all of its
+// stack, or "error" for a request that cannot be read.  With KEEP 0 the
+// directories at the bottom that are held already are kept, so a shell
+// that always sends all of its stack costs only what changed.
+//
+// A change to the stack can also be sent on its own, answered with no
+// lines, or with "resync" when fewer directories are held than it needs:
+//
+//     cdd-delta push       one line follows, the directory pushed
+//     cdd-delta pop N      N directories popped from the top
+//     cdd-delta delete K   the directory at position K from the top removed
+struct CoprocServer
+{
+    // The directory stack, indexed as it changes
+    StackIndex stack;
+    // Change to the working directory of the shell for each request,
+    // relative paths are resolved against it
+    bool change_directory = true;
+
+    // Handle one request, false at the end of input
+    bool serve_one(istream& in, ostream& out);
+    bool serve_delta(const string& header, istream& in, ostream& out);
+    void serve(istream& in, ostream& out);
+    // Write a response, also used by the history server
+    static void respond(ostream& out, const string& status, const string& text_out, const string& text_err);
+};
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,635 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include "cdd_dfa.h"
+#include <cstring>
+#include <cctype>
+
+// Limits which keep a hostile pattern from using unbounded memory
+static const size_t max_nfa_states = 10000;
+static const size_t max_dfa_states = 2000;
+static const int max_repeat = 1000;
+static const int max_depth = 200;
+
+namespace {
+
+// Thrown for syntax the DFA does not handle
+struct Unsupported {};
+
+struct Node
+{
+    enum Type
+    {
+        EMPTY,
+        SET,
+        BOL,
+        EOL,
+        CONCAT,
+        ALT,
+        REPEAT,
+    };
+
+    Type type;
+    int set = -1;
+    int min = 0;
+    int max = 0;    // -1 for no limit
+    vector<Node> kids;
+
+    explicit Node(Type type) : type(type) {}
+};
+
+// Recursive descent parser for the supported ECMAScript subset
+struct Parser
+{
+    const string& pattern;
+    size_t pos = 0;
+    int depth = 0;
+    bool icase;
+    vector<bitset<256>>& sets;
+
+    Parser(const string& pattern, bool icase, vector<bitset<256>>& sets)
+        : pattern(pattern), icase(icase), sets(sets) {}
+
+    bool at_end(void) const { return pos >= pattern.size(); }
+    char peek(void) const { return pattern[pos]; }
+
+    int add_set(bitset<256> set, bool negate)
+    {
+        if (icase)
+        {
+            for (int c='a'; c<='z'; c++)
+            {
+                if (set[c] || set[c - 'a' + 'A'])
+                    set[c] = set[c - 'a' + 'A'] = true;
+            }
+        }
+        if (negate)
+            set.flip();
+        sets.push_back(set);
+        return sets.size() - 1;
+    }
+
+    Node set_node(const bitset<256>& set, bool negate=false)
+    {
+        Node node(Node::SET);
+        node.set = add_set(set, negate);
+        return node;
+    }
+
+    static bitset<256> class_set(char c)
+    {
+        bitset<256> set;
+        switch (c)
+        {
+        case 'd': case 'D':
+            for (int i='0'; i<='9'; i++)
+                set[i] = true;
+            break;
+        case 'w': case 'W':
+            for (int i='0'; i<='9'; i++)
+                set[i] = true;
+            for (int i='a'; i<='z'; i++)
+                set[i] = set[i - 'a' + 'A'] = true;
+            set['_'] = true;
+            break;
+        case 's': case 'S':
+            for (const char *p=" \t\n\r\f\v"; *p; p++)
+                set[(unsigned char)*p] = true;
+            break;
+        }
+        if (c >= 'A' && c <= 'Z')
+            set.flip();
+        return set;
+    }
+
+    static bool is_class_escape(char c)
+    {
+        return c && strchr("dDwWsS", c) != nullptr;
+    }
+
+    // Character for an escape which stands for a single character
+    static unsigned char escaped_char(char c)
+    {
+        switch (c)
+        {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        }
+        // Back references, \b, \x, \u, \c and the like
+        if (isalnum((unsigned char)c))
+            throw Unsupported();
+        return c;
+    }
+
+    Node parse_alt(void)
+    {
+        Node alt(Node::ALT);
+        alt.kids.push_back(parse_concat());
+        while (!at_end() && peek() == '|')
+        {
+            pos++;
+            alt.kids.push_back(parse_concat());
+        }
+        if (alt.kids.size() == 1)
+            return std::move(alt.kids[0]);
+        return alt;
+    }
+
+    Node parse_concat(void)
+    {
+        Node concat(Node::CONCAT);
+        while (!at_end() && peek() != '|' && peek() != ')')
+            concat.kids.push_back(parse_repeat());
+        return concat;
+    }
+
+    bool parse_number(int& value)
+    {
+        size_t start = pos;
+        value = 0;
+        while (!at_end() && isdigit((unsigned char)peek()))
+        {
+            value = value * 10 + (pattern[pos++] - '0');
+            if (value > max_repeat)
+                throw Unsupported();
+        }
+        return pos > start;
+    }
+
+    Node parse_repeat(void)
+    {
+        Node atom = parse_atom();
+        if (at_end())
+            return atom;
+        int min, max;
+        switch (peek())
+        {
+        case '*': min = 0; max = -1; pos++; break;
+        case '+': min = 1; max = -1; pos++; break;
+        case '?': min = 0; max = 1; pos++; break;
+        case '{':
+            pos++;
+            if (!parse_number(min))
+                throw Unsupported();
+            max = min;
+            if (!at_end() && peek() == ',')
+            {
+                pos++;
+                if (!parse_number(max))
+                    max = -1;
+            }
+            if (at_end() || peek() != '}' || (max >= 0 && max < min))
+                throw Unsupported();
+            pos++;
+            break;
+        default:
+            return atom;
+        }
+        if (atom.type == Node::BOL || atom.type == Node::EOL)
+            throw Unsupported();
+        // Lazy quantifiers find the same matches when only asking whether
+        // there is one
+        if (!at_end() && peek() == '?')
+            pos++;
+        Node repeat(Node::REPEAT);
+        repeat.min = min;
+        repeat.max = max;
+        repeat.kids.push_back(std::move(atom));
+        return repeat;
+    }
+
+    Node parse_atom(void)
+    {
+        char c = pattern[pos++];
+        switch (c)
+        {
+        case '(':
+        {
+            if (++depth > max_depth)
+                throw Unsupported();
+            if (!at_end() && peek() == '?')
+            {
+                if (pattern.compare(pos, 2, "?:") != 0)
+                    throw Unsupported();
+                pos += 2;
+            }
+            Node node = parse_alt();
+            if (at_end() || peek() != ')')
+                throw Unsupported();
+            pos++;
+            depth--;
+            return node;
+        }
+        case '[':
+            return parse_class();
+        case '.':
+        {
+            bitset<256> set;
+            set['\n'] = set['\r'] = true;
+            return set_node(set, true);
+        }
+        case '^':
+            return Node(Node::BOL);
+        case '$':
+            return Node(Node::EOL);
+        case '\\':
+        {
+            if (at_end())
+                throw Unsupported();
+            c = pattern[pos++];
+            if (is_class_escape(c))
+                return set_node(class_set(c));
+            bitset<256> set;
+            set[escaped_char(c)] = true;
+            return set_node(set);
+        }
+        case '*': case '+': case '?': case '{': case '}': case ']': case ')':
+            throw Unsupported();
+        }
+        bitset<256> set;
+        set[(unsigned char)c] = true;
+        return set_node(set);
+    }
+
+    // One character of a class, false if it was a class escape added to set
+    bool parse_class_char(unsigned char& c, bitset<256>& set)
+    {
+        if (at_end())
+            throw Unsupported();
+        c = pattern[pos++];
+        if (c != '\\')
+            return true;
+        if (at_end())
+            throw Unsupported();
+        c = pattern[pos++];
+        if (is_class_escape(c))
+        {
+            set |= class_set(c);
+            return false;
+        }
+        c = escaped_char(c);
+        return true;
+    }
+
+    Node parse_class(void)
+    {
+        bitset<256> set;
+        bool negate = false;
+        if (!at_end() && peek() == '^')
+        {
+            negate = true;
+            pos++;
+        }
+        // Empty classes and POSIX classes such as [[:alpha:]]
+        if (at_end() || peek() == ']' || (peek() == '[' && pos + 1 < pattern.size()
+                                          && strchr(":.=", pattern[pos+1])))
+            throw Unsupported();
+        while (!at_end() && peek() != ']')
+        {
+            unsigned char low;
+            if (!parse_class_char(low, set))
+                continue;
+            if (pos + 1 < pattern.size() && peek() == '-' && pattern[pos+1] != ']')
+            {
+                pos++;
+                unsigned char high;
+                if (!parse_class_char(high, set) || high < low)
+                    throw Unsupported();
+                for (int i=low; i<=high; i++)
+                    set[i] = true;
+            }
+            else
+                set[low] = true;
+        }
+        if (at_end())
+            throw Unsupported();
+        pos++;
+        return set_node(set, negate);
+    }
+};
+
+// Thompson construction, each fragment ends in an empty state whose
+// out is filled in by whatever follows
+struct Builder
+{
+    vector<DfaRegex::NfaState>& nfa;
+
+    struct Frag
+    {
+        int start;
+        int end;
+    };
+
+    int add(DfaRegex::NfaType type, int set=-1)
+    {
+        if (nfa.size() >= max_nfa_states)
+            throw Unsupported();
+        nfa.push_back(DfaRegex::NfaState{type, set, -1, -1});
+        return nfa.size() - 1;
+    }
+
+    Frag single(DfaRegex::NfaType type, int set=-1)
+    {
+        int start = add(type, set);
+        int end = add(DfaRegex::NFA_EMPTY);
+        nfa[start].out = end;
+        return Frag{start, end};
+    }
+
+    void append(Frag& frag, const Frag& next)
+    {
+        nfa[frag.end].out = next.start;
+        frag.end = next.end;
+    }
+
+    // Either frag or nothing, loop makes it repeat
+    Frag optional(const Node& node, bool loop)
+    {
+        int split = add(DfaRegex::NFA_SPLIT);
+        Frag body = build(node);
+        int end = add(DfaRegex::NFA_EMPTY);
+        nfa[split].out = body.start;
+        nfa[split].out1 = end;
+        nfa[body.end].out = loop ? split : end;
+        return Frag{split, end};
+    }
+
+    Frag build(const Node& node)
+    {
+        switch (node.type)
+        {
+        case Node::SET:
+            return single(DfaRegex::NFA_CHAR, node.set);
+        case Node::BOL:
+            return single(DfaRegex::NFA_BOL);
+        case Node::EOL:
+            return single(DfaRegex::NFA_EOL);
+        case Node::CONCAT:
+        {
+            int empty = add(DfaRegex::NFA_EMPTY);
+            Frag frag{empty, empty};
+            for (size_t i=0; i<node.kids.size(); i++)
+                append(frag, build(node.kids[i]));
+            return frag;
+        }
+        case Node::ALT:
+        {
+            int end = add(DfaRegex::NFA_EMPTY);
+            int start = -1;
+            for (size_t i=node.kids.size(); i-->0; )
+            {
+                Frag kid = build(node.kids[i]);
+                nfa[kid.end].out = end;
+                if (start < 0)
+                    start = kid.start;
+                else
+                {
+                    int split = add(DfaRegex::NFA_SPLIT);
+                    nfa[split].out = kid.start;
+                    nfa[split].out1 = start;
+                    start = split;
+                }
+            }
+            return Frag{start, end};
+        }
+        case Node::REPEAT:
+        {
+            int empty = add(DfaRegex::NFA_EMPTY);
+            Frag frag{empty, empty};
+            for (int i=0; i<node.min; i++)
+                append(frag, build(node.kids[0]));
+            if (node.max < 0)
+                append(frag, optional(node.kids[0], true));
+            for (int i=node.min; i<node.max; i++)
+                append(frag, optional(node.kids[0], false));
+            return frag;
+        }
+        case Node::EMPTY:
+            break;
+        }
+        int empty = add(DfaRegex::NFA_EMPTY);
+        return Frag{empty, empty};
+    }
+};
+
+}
+
+bool DfaRegex::compile(const string& pattern, bool icase)
+{
+    nfa.clear();
+    sets.clear();
+    flush();
+    try
+    {
+        Parser parser(pattern, icase, sets);
+        Node root = parser.parse_alt();
+        if (!parser.at_end())
+            throw Unsupported();
+        Builder builder{nfa};
+        Builder::Frag frag = builder.build(root);
+        nfa[frag.end].out = builder.add(NFA_MATCH);
+        nfa_start = frag.start;
+    }
+    catch (Unsupported&)
+    {
+        nfa.clear();
+        sets.clear();
+        return false;
+    }
+    mark.assign(nfa.size(), 0);
+    mark_generation = 0;
+
+    // Group bytes by which sets they belong to
+    map<vector<bool>, int> classes;
+    for (int c=0; c<256; c++)
+    {
+        vector<bool> signature(sets.size());
+        for (size_t i=0; i<sets.size(); i++)
+            signature[i] = sets[i][c];
+        map<vector<bool>, int>::iterator it = classes.find(signature);
+        if (it == classes.end())
+            it = classes.insert(make_pair(signature, int(classes.size()))).first;
+        byte_class[c] = it->second;
+    }
+    class_count = classes.size();
+    return true;
+}
+
+void DfaRegex::flush(void) const
+{
+    dfa_states.clear();
+    dfa_next.clear();
+    dfa_map.clear();
+    dfa_initial = -1;
+}
+
+// Follow the empty transitions out of the states on stack.  ^ and $
+// are only crossed at the start and the end of the name.  Only states
+// that matter for later steps are kept in result.
+void DfaRegex::closure(vector<int>& stack, bool at_start, bool at_end, vector<int>& result) const
+{
+    if (++mark_generation == 0)
+    {
+        mark.assign(nfa.size(), 0);
+        mark_generation = 1;
+    }
+    result.clear();
+    while (!stack.empty())
+    {
+        int s = stack.back();
+        stack.pop_back();
+        if (mark[s] == mark_generation)
+            continue;
+        mark[s] = mark_generation;
+        const NfaState& state = nfa[s];
+        switch (state.type)
+        {
+        case NFA_EMPTY:
+            stack.push_back(state.out);
+            break;
+        case NFA_SPLIT:
+            stack.push_back(state.out1);
+            stack.push_back(state.out);
+            break;
+        case NFA_BOL:
+            if (at_start)
+                stack.push_back(state.out);
+            break;
+        case NFA_EOL:
+            result.push_back(s);
+            if (at_end)
+                stack.push_back(state.out);
+            break;
+        case NFA_CHAR:
+        case NFA_MATCH:
+            result.push_back(s);
+            break;
+        }
+    }
+    sort(result.begin(), result.end());
+}
+
+int DfaRegex::add_state(vector<int>& key, bool initial, bool& flushed) const
+{
+    // The initial state may cross ^ at the end as well, so it is kept
+    // apart from any other state with the same NFA states
+    if (initial)
+        key.push_back(-1);
+    map<vector<int>, int>::iterator it = dfa_map.find(key);
+    if (it != dfa_map.end())
+        return it->second;
+    if (dfa_states.size() >= max_dfa_states)
+    {
+        flush();
+        flushed = true;
+    }
+    if (initial)
+        key.pop_back();
+
+    DfaState state;
+    state.nfa = key;
+    state.accept = false;
+    bool has_char = false;
+    vector<int> stack;
+    for (size_t i=0; i<key.size(); i++)
+    {
+        if (nfa[key[i]].type == NFA_MATCH)
+            state.accept = true;
+        if (nfa[key[i]].type == NFA_CHAR)
+            has_char = true;
+        else
+            stack.push_back(key[i]);
+    }
+    vector<int> at_end;
+    closure(stack, initial, true, at_end);
+    state.accept_at_end = state.accept;
+    for (size_t i=0; i<at_end.size(); i++)
+    {
+        if (nfa[at_end[i]].type == NFA_MATCH)
+            state.accept_at_end = true;
+    }
+    // Without any character to consume only the start of the pattern is
+    // left, which is already part of this state
+    state.dead = !has_char && !state.accept_at_end;
+
+    if (initial)
+        key.push_back(-1);
+    int id = dfa_states.size();
+    dfa_map[key] = id;
+    dfa_states.push_back(std::move(state));
+    dfa_next.resize(dfa_next.size() + class_count, -1);
+    return id;
+}
+
+int DfaRegex::step(int from, unsigned char c) const
+{
+    vector<int> stack;
+    const vector<int>& current = dfa_states[from].nfa;
+    for (size_t i=0; i<current.size(); i++)
+    {
+        const NfaState& state = nfa[current[i]];
+        if (state.type == NFA_CHAR && sets[state.set][c])
+            stack.push_back(state.out);
+    }
+    // A match may also start at the next character
+    stack.push_back(nfa_start);
+    vector<int> key;
+    closure(stack, false, false, key);
+    bool flushed = false;
+    int to = add_state(key, false, flushed);
+    if (!flushed)
+        dfa_next[from * class_count + byte_class[c]] = to;
+    return to;
+}
+
+bool DfaRegex::search(string_view s) const
+{
+    if (nfa.empty())
+        return false;
+    if (dfa_initial < 0)
+    {
+        vector<int> stack(1, nfa_start);
+        vector<int> key;
+        closure(stack, true, false, key);
+        bool flushed = false;
+        dfa_initial = add_state(key, true, flushed);
+    }
+    int current = dfa_initial;
+    for (size_t i=0; i<s.size(); i++)
+    {
+        const DfaState& state = dfa_states[current];
+        if (state.accept)
+            return true;
+        if (state.dead)
+            return false;
+        unsigned char c = s[i];
+        int next = dfa_next[current * class_count + byte_class[c]];
+        current = next >= 0 ? next : step(current, c);
+    }
+    return dfa_states[current].accept_at_end;
+}
+
+// vim:ff=unix
@@ -0,0 +1,105 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CDD_DFA_H
+#define CDD_DFA_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <bitset>
+#include <map>
+#include <cstdint>
+using namespace std;
+
+// Regular expression search for directory patterns.  The pattern is
+// compiled to a Thompson NFA, which is turned into a DFA lazily, one
+// transition at a time, while directory names are searched.  Each
+// character of a name costs at most one table lookup once the DFA is
+// warm, so matching is linear in the length of the name whatever the
+// pattern.
+//
+// Only the subset of ECMAScript syntax that makes sense for directory
+// patterns is supported: literals, '.', classes, \d \w \s and their
+// negations, groups, alternation, ^ and $ and the usual quantifiers.
+// compile returns false for anything else (back references, look ahead,
+// word boundaries, ...) so the caller can fall back to std::regex.
+struct DfaRegex
+{
+    // Letters match either case when icase is set
+    bool compile(const string& pattern, bool icase=true);
+    bool search(string_view s) const;
+    // Number of DFA states built so far
+    size_t state_count(void) const { return dfa_states.size(); }
+
+    enum NfaType
+    {
+        NFA_EMPTY,
+        NFA_SPLIT,
+        NFA_CHAR,
+        NFA_BOL,
+        NFA_EOL,
+        NFA_MATCH,
+    };
+
+    struct NfaState
+    {
+        NfaType type;
+        int set;    // character set for NFA_CHAR
+        int out;
+        int out1;   // second branch of NFA_SPLIT
+    };
+
+private:
+    struct DfaState
+    {
+        // Sorted NFA states, only those of type CHAR, EOL and MATCH
+        vector<int> nfa;
+        bool accept;            // a match has been seen
+        bool accept_at_end;     // a match is seen if the name ends here
+        bool dead;              // no match is possible any more
+    };
+
+    vector<NfaState> nfa;
+    vector<bitset<256>> sets;
+    int nfa_start = 0;
+    // Bytes which no character set tells apart share a class
+    uint8_t byte_class[256];
+    int class_count = 0;
+
+    // The DFA is a cache, it is thrown away when it grows too large
+    mutable vector<DfaState> dfa_states;
+    mutable vector<int> dfa_next;
+    mutable map<vector<int>, int> dfa_map;
+    mutable int dfa_initial = -1;
+    mutable vector<unsigned> mark;
+    mutable unsigned mark_generation = 0;
+
+    void closure(vector<int>& stack, bool at_start, bool at_end, vector<int>& result) const;
+    int add_state(vector<int>& key, bool initial, bool& flushed) const;
+    int step(int from, unsigned char c) const;
+    void flush(void) const;
+};
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,288 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include "cdd_discover.h"
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
+
+#ifdef WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <dirent.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/syscall.h>
+#endif
+
+#ifdef WIN32
+static const char separator = '\\';
+#else
+static const char separator = '/';
+#endif
+
+vector<string> Discovery::default_prune(void)
+{
+    return {
+        ".git", ".hg", ".svn", "node_modules", "__pycache__", ".cache", ".venv",
+        ".tox", ".npm", ".cargo", ".rustup", ".gradle", ".m2", ".Trash",
+    };
+}
+
+static bool is_dot_or_dot_dot(const char *name)
+{
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#ifdef __linux__
+
+// As the kernel lays out each entry, glibc has no wrapper for the call
+struct Dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+bool Discovery::read_directory(const string& dir, vector<string>& names)
+{
+    names.clear();
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    // Many entries for each call, rather than one readdir at a time
+    alignas(8) char buffer[32 * 1024];
+    long size;
+    while ((size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (long offset=0; offset<size; )
+        {
+            const Dirent64 *entry = (const Dirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (is_dot_or_dot_dot(entry->d_name))
+                continue;
+            bool is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                // Some file systems do not fill in the type
+                struct stat info;
+                is_dir = fstatat(fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
+            }
+            if (is_dir)
+                names.push_back(entry->d_name);
+        }
+    }
+    close(fd);
+    return size == 0;
+}
+
+#elif defined(WIN32)
+
+bool Discovery::read_directory(const string& dir, vector<string>& names)
+{
+    names.clear();
+    WIN32_FIND_DATAA data;
+    HANDLE handle = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+    do
+    {
+        // Junctions and symlinks are not followed
+        if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            && !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+            && !is_dot_or_dot_dot(data.cFileName))
+            names.push_back(data.cFileName);
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+    return true;
+}
+
+#else
+
+bool Discovery::read_directory(const string& dir, vector<string>& names)
+{
+    names.clear();
+    DIR *handle = opendir(dir.c_str());
+    if (!handle)
+        return false;
+    while (dirent *entry = readdir(handle))
+    {
+        if (is_dot_or_dot_dot(entry->d_name))
+            continue;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat info;
+            is_dir = lstat((dir + "/" + entry->d_name).c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+        }
+        if (is_dir)
+            names.push_back(entry->d_name);
+    }
+    closedir(handle);
+    return true;
+}
+
+#endif
+
+string Discovery::find(const PathMatcher& matcher)
+{
+    timed_out = false;
+    directory_count = 0;
+    if (!clock)
+    {
+        clock = []() {
+            return int64_t(chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+        };
+    }
+    int64_t deadline = time_ms > 0 ? clock() + time_ms : INT64_MAX;
+
+    struct Item
+    {
+        string path;
+        uint32_t root;
+    };
+    vector<Item> level;
+    set<string> root_set;
+    vector<size_t> root_sizes(roots.size());
+    for (size_t i=0; i<roots.size(); i++)
+    {
+        string root = roots[i];
+        while (root.size() > 1 && root.back() == separator)
+            root.pop_back();
+        root_sizes[i] = root.size();
+        if (root.empty() || !root_set.insert(root).second || (mounts && mounts->is_remote(mounts->resolve(root))))
+            continue;
+        level.push_back(Item{root, uint32_t(i)});
+    }
+    set<string> pruned(prune.begin(), prune.end());
+
+    struct Queue
+    {
+        mutex lock;
+        deque<size_t> items;
+    };
+    size_t cores = thread_count ? thread_count : max(1u, thread::hardware_concurrency());
+    for (unsigned depth=1; depth<=max_depth && !level.empty() && !timed_out; depth++)
+    {
+        // Each thread starts with a share of the level and steals from
+        // the back of another's queue when its own is empty
+        size_t count = min(cores, (level.size() + 3) / 4);
+        vector<Queue> queues(count);
+        for (size_t i=0; i<level.size(); i++)
+            queues[i % count].items.push_back(i);
+        vector<vector<Item>> next(count), hits(count);
+        atomic<bool> out_of_time(false);
+        atomic<size_t> read_count(0);
+        auto take = [&](size_t self, size_t& index) {
+            for (size_t k=0; k<count; k++)
+            {
+                Queue& queue = queues[(self + k) % count];
+                lock_guard<mutex> guard(queue.lock);
+                if (queue.items.empty())
+                    continue;
+                if (k == 0)
+                {
+                    index = queue.items.front();
+                    queue.items.pop_front();
+                }
+                else
+                {
+                    index = queue.items.back();
+                    queue.items.pop_back();
+                }
+                return true;
+            }
+            return false;
+        };
+        auto work = [&](size_t self) {
+            // The matcher keeps state as it runs, each thread has its own
+            PathMatcher local = matcher;
+            vector<string> names;
+            size_t index;
+            while (!out_of_time && take(self, index))
+            {
+                if (clock() >= deadline)
+                {
+                    out_of_time = true;
+                    break;
+                }
+                const Item& item = level[index];
+                read_directory(item.path, names);
+                read_count++;
+                size_t root_size = root_sizes[item.root];
+                for (size_t i=0; i<names.size(); i++)
+                {
+                    if (pruned.count(names[i]))
+                        continue;
+                    string path = item.path;
+                    if (path.back() != separator)
+                        path += separator;
+                    path += names[i];
+                    // Another root covers it, or a server that may hang
+                    if (root_set.count(path) || (mounts && mounts->is_remote(path)))
+                        continue;
+                    if (local.search(string_view(path).substr(min(root_size, path.size()))))
+                        hits[self].push_back(Item{path, item.root});
+                    next[self].push_back(Item{path, item.root});
+                }
+            }
+        };
+        vector<thread> threads;
+        for (size_t i=1; i<count; i++)
+            threads.emplace_back(work, i);
+        work(0);
+        for (size_t i=0; i<threads.size(); i++)
+            threads[i].join();
+        directory_count += read_count;
+        timed_out = out_of_time;
+
+        // The hits of a level come in no set order
+        const Item *best = nullptr;
+        for (size_t t=0; t<count; t++)
+        {
+            for (const Item& hit : hits[t])
+            {
+                if (!best || hit.root < best->root || (hit.root == best->root && hit.path < best->path))
+                    best = &hit;
+            }
+        }
+        if (best)
+            return best->path;
+        vector<Item> deeper;
+        for (size_t t=0; t<count; t++)
+            move(next[t].begin(), next[t].end(), back_inserter(deeper));
+        level.swap(deeper);
+    }
+    return string();
+}
+
+// vim:ff=unix
@@ -0,0 +1,78 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef CDD_DISCOVER_H
+#define CDD_DISCOVER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
+using namespace std;
+
+#include "cdd_match.h"
+#include "cdd_mount.h"
+
+// Looks on disk for a directory that matches a pattern, for when the
+// history has none.  The roots are walked breadth first, one depth at a
+// time, so the hit is the shallowest there is.  The directories of each
+// depth are shared out among a pool of threads, each taking from its own
+// queue and stealing from the others once it runs dry, and each reading
+// a directory with getdents64 where there is one.
+//
+// A directory matches on its path below its root, so a pattern that
+// matches the root itself does not match everything under it.  Symlinks
+// are not followed, and the names in prune and the mounts of network
+// file systems are not entered.
+struct Discovery
+{
+    vector<string> roots;
+    // Names of directories not to enter
+    vector<string> prune = default_prune();
+    // Levels below a root, the root's own entries are at depth 1
+    unsigned max_depth = 4;
+    // Longest the walk may take in milliseconds, 0 for no limit
+    unsigned time_ms = 0;
+    // Threads in the pool, 0 for one per core
+    unsigned thread_count = 0;
+    // Milliseconds from any fixed point, called from the pool
+    function<int64_t(void)> clock;
+    // Mounts not to enter when on a network file system, none if null
+    shared_ptr<const MountTable> mounts;
+
+    // Whether the last walk ran out of time, and how far it got
+    bool timed_out = false;
+    size_t directory_count = 0;
+
+    static vector<string> default_prune(void);
+    // The shallowest match, of the first root that has one, the first by
+    // name among those.  Empty when there is none.
+    string find(const PathMatcher& matcher);
+    // The subdirectories of dir, false when it cannot be read
+    static bool read_directory(const string& dir, vector<string>& names);
+};
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,528 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include "cdd_index.h"
+
+void PathArena::clear(void)
+{
+    buffer.clear();
+    offsets.assign(1, 0);
+}
+
+uint32_t PathArena::add(string_view s)
+{
+    buffer.insert(buffer.end(), s.begin(), s.end());
+    buffer.push_back('\0');
+    offsets.push_back(buffer.size());
+    return offsets.size() - 2;
+}
+
+void PathArena::borrow(const char *chars, size_t chars_size, const uint32_t *starts, uint32_t count)
+{
+    borrowed_chars = chars;
+    borrowed_chars_size = chars_size;
+    borrowed_starts = starts;
+    borrowed_count = count;
+}
+
+string_view PathArena::borrowed(uint32_t id) const
+{
+    if (id >= borrowed_count)
+        return string_view();
+    uint32_t start = borrowed_starts[id];
+    uint32_t end = borrowed_starts[id+1];
+    if (start >= end || end > borrowed_chars_size)
+        return string_view();
+    return string_view(borrowed_chars + start, end - start - 1);
+}
+
+vector<string> PathView::strings(void) const
+{
+    vector<string> result;
+    result.reserve(ids.size());
+    for (const_iterator it=begin(); it!=end(); ++it)
+        result.push_back(string(*it));
+    return result;
+}
+
+//----------------------------------------------------------------------
+
+const PathIndex::Entry PathIndex::empty_entry = PathIndex::Entry();
+
+void PathIndex::borrow(const Entry *entries, size_t entry_count, const uint32_t *stack_ids, size_t stack_size)
+{
+    borrowed_entries = entries;
+    borrowed_entry_count = entry_count;
+    borrowed_stack_ids = stack_ids;
+    borrowed_stack_size = stack_size;
+}
+
+void PathIndex::clear(void)
+{
+    arena.clear();
+    entries.clear();
+    stack_ids.clear();
+    slots.clear();
+    mask = 0;
+    visits = 0;
+}
+
+void PathIndex::reserve(size_t count)
+{
+    entries.reserve(count);
+    stack_ids.reserve(count);
+    // Keep the load factor at or below one half
+    size_t capacity = 16;
+    while (capacity < count * 2)
+        capacity *= 2;
+    if (capacity > slots.size())
+    {
+        slots.assign(capacity, Slot{0, 0});
+        mask = capacity - 1;
+        for (uint32_t id=0; id<entries.size(); id++)
+        {
+            size_t pos = entries[id].hash & mask;
+            while (slots[pos].id)
+                pos = (pos + 1) & mask;
+            slots[pos] = Slot{uint32_t(entries[id].hash), id + 1};
+        }
+    }
+}
+
+void PathIndex::grow(void)
+{
+    reserve(slots.size());
+}
+
+uint32_t PathIndex::add(string_view path, uint32_t weight)
+{
+    // Visits further down the stack are older, and weigh less the
+    // further down they are
+    double frecency = log(double(weight)) - frecency_rate * visits;
+    return add(path, weight, frecency);
+}
+
+uint32_t PathIndex::add(string_view path, uint32_t weight, double frecency)
+{
+    visits += weight;
+    if ((entries.size() + 1) * 2 > slots.size())
+        grow();
+
+    uint32_t position = stack_ids.size();
+    uint64_t h = hash(path);
+    size_t pos = h & mask;
+    for (;;)
+    {
+        Slot& slot = slots[pos];
+        if (slot.id == 0)
+        {
+            uint32_t id = entries.size();
+            uint32_t name = arena.add(path);
+            entries.push_back(Entry{h, frecency, name, name, position, position, weight});
+            slot = Slot{uint32_t(h), id + 1};
+            stack_ids.push_back(id);
+            return name;
+        }
+        if (slot.hash == uint32_t(h))
+        {
+            Entry& entry = entries[slot.id - 1];
+            if (entry.hash == h && equal(arena[entry.name], path))
+            {
+                // Most directories are always spelled the same way,
+                // only a new spelling takes space in the arena
+                if (arena[entry.last_name] != path)
+                    entry.last_name = arena[entry.name] == path ? entry.name : arena.add(path);
+                entry.last = position;
+                entry.count += weight;
+                entry.frecency = log_add(entry.frecency, frecency);
+                stack_ids.push_back(slot.id - 1);
+                return entry.last_name;
+            }
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+uint32_t PathIndex::intern(string_view path)
+{
+    if ((entries.size() + 1) * 2 > slots.size())
+        grow();
+
+    uint64_t h = hash(path);
+    size_t pos = h & mask;
+    for (;;)
+    {
+        Slot& slot = slots[pos];
+        if (slot.id == 0)
+        {
+            uint32_t id = entries.size();
+            uint32_t name = arena.add(path);
+            entries.push_back(Entry{h, 0, name, name, 0, 0, 0});
+            slot = Slot{uint32_t(h), id + 1};
+            return id;
+        }
+        if (slot.hash == uint32_t(h))
+        {
+            const Entry& entry = entries[slot.id - 1];
+            if (entry.hash == h && equal(arena[entry.name], path))
+                return slot.id - 1;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+char PathIndex::normalized_char(char c) const
+{
+#ifdef WIN32
+    // Windows pathnames are case insensitive
+    c = tolower(c);
+#endif
+    return c == separator ? '/' : c;
+}
+
+size_t PathIndex::normalized_size(string_view path) const
+{
+    // Don't count a trailing slash
+    if (!path.empty() && normalized_char(path.back()) == '/')
+        return path.size() - 1;
+    return path.size();
+}
+
+uint64_t PathIndex::hash(string_view path) const
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    size_t size = normalized_size(path);
+    for (size_t i=0; i<size; i++)
+    {
+        h ^= (unsigned char)normalized_char(path[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool PathIndex::equal(string_view path1, string_view path2) const
+{
+    size_t size = normalized_size(path1);
+    if (size != normalized_size(path2))
+        return false;
+    for (size_t i=0; i<size; i++)
+    {
+        if (path1[i] != path2[i] && normalized_char(path1[i]) != normalized_char(path2[i]))
+            return false;
+    }
+    return true;
+}
+
+string PathIndex::normalized(string_view path) const
+{
+    string result;
+    size_t size = normalized_size(path);
+    result.reserve(size);
+    for (size_t i=0; i<size; i++)
+        result.push_back(normalized_char(path[i]));
+    return result;
+}
+
+//----------------------------------------------------------------------
+
+void StackIndex::clear(void)
+{
+    index.clear();
+    visits.clear();
+    next_stamp = 0;
+    visit_count = 0;
+    tree.clear();
+    newest.clear();
+    oldest.clear();
+    common.clear();
+    frecent_order.clear();
+    oldest_stamps.clear();
+}
+
+void StackIndex::push(string_view path)
+{
+    if (next_stamp + 1 >= tree.size())
+        renumber((visit_count + 1) * 2);
+
+    uint32_t id = index.intern(path);
+    if (id >= newest.size())
+    {
+        newest.resize(id + 1, none);
+        oldest.resize(id + 1, none);
+    }
+    PathIndex::Entry& entry = index.entries[id];
+    // The top of the stack is always the highest stamp in use
+    uint64_t tick = visit_count ? visits[next_stamp - 1].tick + 1 : 0;
+    uint32_t stamp = next_stamp++;
+    Visit& visit = visits[stamp];
+    visit.tick = tick;
+    // Most directories are always spelled the same way, only a new
+    // spelling takes space in the arena
+    const PathArena& arena = index.arena;
+    if (arena[entry.name] == path)
+        visit.name = entry.name;
+    else if (arena[entry.last_name] == path)
+        visit.name = entry.last_name;
+    else
+        visit.name = index.arena.add(path);
+    visit.id = id;
+    visit.newer = none;
+    if (entry.count > 0)
+    {
+        common.erase(common_key(id));
+        frecent_order.erase(frecent_key(id));
+        visit.older = newest[id];
+        visits[newest[id]].newer = stamp;
+        entry.frecency = PathIndex::log_add(entry.frecency, tick_score(tick));
+    }
+    else
+    {
+        visit.older = none;
+        oldest[id] = stamp;
+        oldest_stamps.insert(stamp);
+        entry.last_name = visit.name;
+        entry.frecency = tick_score(tick);
+    }
+    newest[id] = stamp;
+    entry.name = visit.name;
+    entry.count++;
+    common.insert(common_key(id));
+    frecent_order.insert(frecent_key(id));
+    tree_add(stamp, 1);
+    visit_count++;
+}
+
+bool StackIndex::pop(size_t count)
+{
+    if (count > visit_count)
+        return false;
+    for (size_t i=0; i<count; i++)
+        remove(stamp_at(0));
+    // The stamps above the top are free again
+    next_stamp = empty() ? 0 : stamp_at(0) + 1;
+    return true;
+}
+
+bool StackIndex::erase(size_t position)
+{
+    if (position >= visit_count)
+        return false;
+    if (position == 0)
+        return pop(1);
+    remove(stamp_at(position));
+    return true;
+}
+
+size_t StackIndex::shared_bottom(const vector<string>& stack) const
+{
+    size_t shared = 0;
+    for (uint32_t stamp=0; stamp<next_stamp && shared<stack.size(); stamp++)
+    {
+        const Visit& visit = visits[stamp];
+        if (visit.id == none)
+            continue;
+        if (index.arena[visit.name] != stack[stack.size() - 1 - shared])
+            break;
+        shared++;
+    }
+    return shared;
+}
+
+vector<uint32_t> StackIndex::most_to_least(size_t count) const
+{
+    vector<uint32_t> ids;
+    ids.reserve(min(count, common.size()));
+    for (auto it=common.begin(); it!=common.end() && ids.size()<count; ++it)
+        ids.push_back(visits[~uint32_t(*it)].id);
+    return ids;
+}
+
+vector<uint32_t> StackIndex::first_to_last(void) const
+{
+    vector<uint32_t> ids;
+    ids.reserve(oldest_stamps.size());
+    for (auto it=oldest_stamps.begin(); it!=oldest_stamps.end(); ++it)
+        ids.push_back(visits[*it].id);
+    return ids;
+}
+
+vector<uint32_t> StackIndex::frecent(size_t count) const
+{
+    vector<uint32_t> ids;
+    ids.reserve(min(count, frecent_order.size()));
+    for (auto it=frecent_order.begin(); it!=frecent_order.end() && ids.size()<count; ++it)
+        ids.push_back(visits[~it->second].id);
+    return ids;
+}
+
+void StackIndex::rescore(uint32_t id)
+{
+    // Newest first, each visit adds less than the one before, and the
+    // walk ends once the rest could not change the sum
+    PathIndex::Entry& entry = index.entries[id];
+    uint32_t stamp = newest[id];
+    entry.frecency = tick_score(visits[stamp].tick);
+    uint32_t rest = entry.count - 1;
+    for (stamp=visits[stamp].older; stamp!=none; stamp=visits[stamp].older, rest--)
+    {
+        double score = tick_score(visits[stamp].tick);
+        if (score + log(double(rest)) < entry.frecency - 40)
+            break;
+        entry.frecency = PathIndex::log_add(entry.frecency, score);
+    }
+}
+
+void StackIndex::remove(uint32_t stamp)
+{
+    Visit& visit = visits[stamp];
+    uint32_t id = visit.id;
+    PathIndex::Entry& entry = index.entries[id];
+    common.erase(common_key(id));
+    frecent_order.erase(frecent_key(id));
+    if (visit.newer != none)
+        visits[visit.newer].older = visit.older;
+    else
+        newest[id] = visit.older;
+    if (visit.older != none)
+        visits[visit.older].newer = visit.newer;
+    else
+    {
+        oldest_stamps.erase(stamp);
+        oldest[id] = visit.newer;
+        if (visit.newer != none)
+            oldest_stamps.insert(visit.newer);
+    }
+    visit.id = none;
+    entry.count--;
+    if (entry.count > 0)
+    {
+        entry.name = visits[newest[id]].name;
+        entry.last_name = visits[oldest[id]].name;
+        // The visit's share is taken out of the score, unless it is most
+        // of it and too little would be left of the precision
+        double share = tick_score(visit.tick) - entry.frecency;
+        if (share < -log(2.0))
+            entry.frecency += log1p(-exp(share));
+        else
+            rescore(id);
+        common.insert(common_key(id));
+        frecent_order.insert(frecent_key(id));
+    }
+    tree_add(stamp, -1);
+    visit_count--;
+}
+
+uint32_t StackIndex::stamp_at(size_t position) const
+{
+    // Find the stamp with visit_count - position stamps at or below it
+    size_t capacity = tree.size() - 1;
+    size_t rest = visit_count - position;
+    size_t pos = 0;
+    for (size_t step=capacity; step>0; step/=2)
+    {
+        if (pos + step <= capacity && tree[pos + step] < rest)
+        {
+            pos += step;
+            rest -= tree[pos];
+        }
+    }
+    return pos;
+}
+
+size_t StackIndex::position(uint32_t stamp) const
+{
+    size_t below = 0;
+    for (size_t i=stamp+1; i>0; i-=i&-i)
+        below += tree[i];
+    return visit_count - below;
+}
+
+void StackIndex::tree_add(uint32_t stamp, int delta)
+{
+    for (size_t i=stamp+1; i<tree.size(); i+=i&-i)
+        tree[i] += delta;
+}
+
+void StackIndex::renumber(size_t capacity)
+{
+    size_t size = 16;
+    while (size < capacity)
+        size *= 2;
+
+    vector<uint32_t> renamed(next_stamp, none);
+    uint32_t count = 0;
+    for (uint32_t stamp=0; stamp<next_stamp; stamp++)
+    {
+        if (visits[stamp].id != none)
+            renamed[stamp] = count++;
+    }
+    vector<Visit> moved(size);
+    for (uint32_t stamp=0; stamp<next_stamp; stamp++)
+    {
+        if (renamed[stamp] == none)
+            continue;
+        Visit& visit = moved[renamed[stamp]];
+        visit = visits[stamp];
+        if (visit.newer != none)
+            visit.newer = renamed[visit.newer];
+        if (visit.older != none)
+            visit.older = renamed[visit.older];
+    }
+    visits.swap(moved);
+    next_stamp = count;
+
+    // Ticks count from the bottom of the stack again, which moves every
+    // score by the same amount
+    uint64_t base = count ? visits[0].tick : 0;
+    for (uint32_t stamp=0; stamp<count; stamp++)
+        visits[stamp].tick -= base;
+
+    common.clear();
+    frecent_order.clear();
+    oldest_stamps.clear();
+    for (uint32_t id=0; id<newest.size(); id++)
+    {
+        if (index.entries[id].count == 0)
+            continue;
+        newest[id] = renamed[newest[id]];
+        oldest[id] = renamed[oldest[id]];
+        index.entries[id].frecency -= tick_score(base);
+        common.insert(common_key(id));
+        frecent_order.insert(frecent_key(id));
+        oldest_stamps.insert(oldest[id]);
+    }
+
+    // The stamps in use are now all those below next_stamp
+    tree.assign(size + 1, 0);
+    for (size_t i=1; i<=size; i++)
+    {
+        if (i <= next_stamp)
+            tree[i]++;
+        size_t parent = i + (i & -i);
+        if (parent <= size)
+            tree[parent] += tree[i];
+    }
+}
+
+// vim:ff=unix
@@ -0,0 +1,306 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CDD_INDEX_H
+#define CDD_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <cstdint>
+#include <cmath>
+using namespace std;
+
+// Interned directory names.  Each distinct string is stored once in a
+// single contiguous buffer and referred to by its number.
+struct PathArena
+{
+    // Strings back to back, each followed by a NUL
+    vector<char> buffer;
+    // Start of each string in buffer, plus one entry past the last string
+    vector<uint32_t> offsets;
+
+    PathArena(void) : offsets(1, 0) {}
+    void clear(void);
+    uint32_t add(string_view s);
+    // Read the strings in place from tables laid out as buffer and
+    // offsets in memory owned elsewhere, see PathIndex::borrow
+    void borrow(const char *chars, size_t chars_size, const uint32_t *starts, uint32_t count);
+    uint32_t size(void) const { return borrowed_starts ? borrowed_count : offsets.size() - 1; }
+    string_view operator[](uint32_t id) const
+    {
+        if (borrowed_starts)
+            return borrowed(id);
+        return string_view(&buffer[offsets[id]], offsets[id+1] - offsets[id] - 1);
+    }
+
+private:
+    const char *borrowed_chars = nullptr;
+    size_t borrowed_chars_size = 0;
+    const uint32_t *borrowed_starts = nullptr;
+    uint32_t borrowed_count = 0;
+
+    string_view borrowed(uint32_t id) const;
+};
+
+// Read only list of directories held as numbers into a PathArena
+struct PathView
+{
+    const PathArena* arena = nullptr;
+    vector<uint32_t> ids;
+
+    struct const_iterator
+    {
+        const PathArena* arena;
+        vector<uint32_t>::const_iterator it;
+        string_view operator*() const { return (*arena)[*it]; }
+        const_iterator& operator++() { ++it; return *this; }
+        bool operator==(const const_iterator& obj) const { return it == obj.it; }
+        bool operator!=(const const_iterator& obj) const { return it != obj.it; }
+    };
+
+    size_t size(void) const { return ids.size(); }
+    bool empty(void) const { return ids.empty(); }
+    string_view operator[](size_t i) const { return (*arena)[ids[i]]; }
+    const_iterator begin(void) const { return const_iterator{arena, ids.begin()}; }
+    const_iterator end(void) const { return const_iterator{arena, ids.end()}; }
+    vector<string> strings(void) const;
+};
+
+// Index of the distinct directories in the directory stack.
+// Built in a single pass from the top of the stack (most recent) to the
+// bottom (first visited).  Each distinct normalized path gets one entry,
+// numbered in order of first appearance, which is also its "sequence"
+// for the most common ordering.  Paths are compared in normalized form
+// (see Cdd::normalize_path) without building the normalized string.
+//
+// Each entry also keeps a frecency, the sum of its visits each decayed
+// by half every frecency_half_life visits, as a shell's stack has no
+// times.  A history store gives the weight of each visit by its time
+// instead, see HistoryStore::frecency_rate.  It is held as a logarithm
+// against a fixed point in time rather than against the present, so that
+// a visit adds one term and no entry is ever aged again: the present
+// only shifts every score by the same amount, which leaves their order
+// alone.
+struct PathIndex
+{
+    static constexpr double frecency_half_life = 500;
+    // Decay per visit in the log of a score
+    static constexpr double frecency_rate = 0.69314718055994531 / frecency_half_life;
+
+    struct Entry
+    {
+        uint64_t hash;
+        // Log of the decayed visits, see frecency_rate
+        double frecency;
+        // Arena numbers of the spellings at the first and last positions
+        uint32_t name;
+        uint32_t last_name;
+        // Stack position of the most recent visit
+        uint32_t first;
+        // Stack position of the oldest visit
+        uint32_t last;
+        uint32_t count;
+    };
+
+    PathArena arena;
+    // Entries in order of first appearance from the top of the stack
+    vector<Entry> entries;
+    // Entry number for each position in the stack
+    vector<uint32_t> stack_ids;
+    char separator = '/';
+
+    // Read the tables in place from memory owned elsewhere, such as a
+    // mapped file that another process may rewrite at any time.  Reads
+    // never leave the tables then, whatever they hold, and an index that
+    // borrows is never added to.
+    void borrow(const Entry *entries, size_t entry_count, const uint32_t *stack_ids, size_t stack_size);
+    const Entry& entry(uint32_t id) const
+    {
+        if (borrowed_entries)
+            return id < borrowed_entry_count ? borrowed_entries[id] : empty_entry;
+        return entries[id];
+    }
+    size_t entry_count(void) const { return borrowed_entries ? borrowed_entry_count : entries.size(); }
+    uint32_t stack_id(size_t position) const
+    {
+        if (borrowed_entries)
+            return position < borrowed_stack_size ? borrowed_stack_ids[position] : 0;
+        return stack_ids[position];
+    }
+
+    void clear(void);
+    void reserve(size_t count);
+    // Record a visit to path at the next stack position, weight is the
+    // number of visits the position stands for.  Returns the arena
+    // number of its interned spelling.  The visits are taken to be the
+    // ones after those already added, going down the stack, unless
+    // frecency gives the log of their decayed weight.
+    uint32_t add(string_view path, uint32_t weight=1);
+    uint32_t add(string_view path, uint32_t weight, double frecency);
+    // Entry number of path, adding an entry with no visits and nothing
+    // on the stack when it is new
+    uint32_t intern(string_view path);
+    // log(exp(a) + exp(b)) without leaving the range of a double
+    static double log_add(double a, double b)
+    {
+        return a < b ? b + log1p(exp(a - b)) : a + log1p(exp(b - a));
+    }
+    // Hash and comparison of the normalized forms of paths
+    uint64_t hash(string_view path) const;
+    bool equal(string_view path1, string_view path2) const;
+    string normalized(string_view path) const;
+    size_t normalized_size(string_view path) const;
+    char normalized_char(char c) const;
+
+private:
+    // Open addressing table with linear probing.  The low bits of the
+    // hash are kept alongside the entry number so most probes never
+    // touch the entry itself.
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t id;    // entry number + 1, 0 when the slot is empty
+    };
+    vector<Slot> slots;
+    size_t mask = 0;
+    // Visits added so far, the age of the next one from the top
+    uint64_t visits = 0;
+    static const Entry empty_entry;
+    const Entry *borrowed_entries = nullptr;
+    size_t borrowed_entry_count = 0;
+    const uint32_t *borrowed_stack_ids = nullptr;
+    size_t borrowed_stack_size = 0;
+
+    void grow(void);
+};
+
+// Index of a directory stack that is kept up to date as the stack
+// changes, rather than built again each time.  Pushing a directory,
+// popping from the top or deleting anywhere costs O(log n).
+//
+// Positions shift with every push, so each visit is held under a stamp
+// that never changes while it is on the stack, higher stamps nearer the
+// top.  A Fenwick tree counts the stamps in use, which turns a stamp
+// into its position from the top and back.  The visits of each entry
+// are linked newest to oldest, so its first and last positions are at
+// the ends of its list, and the entries are held in the most common
+// order, in frecent order and in order of their oldest visit.
+//
+// A visit is scored by its tick, one more than the visit below it had
+// when it was pushed, rather than by its position, so that the scores
+// stay put as the stack changes.  On a stack that has only been pushed
+// and popped the ticks are the positions counted from the bottom, and
+// the order is the one PathIndex::add gives.  A visit deleted from
+// the middle leaves a gap in the ticks, which counts as a visit.
+//
+// index interns the names and holds the entries, where name and
+// last_name are the spellings at the newest and oldest visits, and
+// count and frecency are current.  Their first and last are not kept,
+// see position.
+struct StackIndex
+{
+    PathIndex index;
+
+    StackIndex(void) {}
+    StackIndex(const StackIndex&) = delete;
+    StackIndex& operator=(const StackIndex&) = delete;
+
+    void clear(void);
+    void push(string_view path);
+    // False, changing nothing, when there are not that many directories
+    bool pop(size_t count);
+    bool erase(size_t position);
+    // How many directories at the bottom of stack, top first, are the
+    // ones held, spelled the same way
+    size_t shared_bottom(const vector<string>& stack) const;
+
+    size_t size(void) const { return visit_count; }
+    bool empty(void) const { return visit_count == 0; }
+    // The stack top first
+    string_view operator[](size_t position) const { return index.arena[stack_name(position)]; }
+    uint32_t stack_name(size_t position) const { return visits[stamp_at(position)].name; }
+    uint32_t stack_id(size_t position) const { return visits[stamp_at(position)].id; }
+    // Directories on the stack, entries with no visits left are kept
+    size_t distinct_count(void) const { return common.size(); }
+    uint32_t count(uint32_t id) const { return index.entries[id].count; }
+    // Positions of the newest and oldest visits of an entry on the stack
+    size_t first(uint32_t id) const { return position(newest[id]); }
+    size_t last(uint32_t id) const { return position(oldest[id]); }
+    // Entries by count descending then by first position, the top count
+    // of them
+    vector<uint32_t> most_to_least(size_t count) const;
+    // Entries by last position descending
+    vector<uint32_t> first_to_last(void) const;
+    // Entries by frecency descending then by first position, the top
+    // count of them
+    vector<uint32_t> frecent(size_t count) const;
+
+private:
+    static constexpr uint32_t none = uint32_t(-1);
+    struct Visit
+    {
+        uint32_t id = none;     // none for a stamp not in use
+        uint32_t name = 0;
+        // Stamps of the visits of the same entry either side
+        uint32_t newer = none;
+        uint32_t older = none;
+        uint64_t tick = 0;
+    };
+    // By stamp, up to next_stamp
+    vector<Visit> visits;
+    uint32_t next_stamp = 0;
+    size_t visit_count = 0;
+    // Fenwick tree of the stamps in use, its size a power of two
+    vector<uint32_t> tree;
+    // Stamps of the newest and oldest visits of each entry
+    vector<uint32_t> newest;
+    vector<uint32_t> oldest;
+    // Packed ~count above ~newest stamp, so ascending is the most common order
+    set<uint64_t> common;
+    // Negated frecency and ~newest stamp, so ascending is the frecent order
+    set<pair<double, uint32_t>> frecent_order;
+    set<uint32_t> oldest_stamps;
+
+    uint64_t common_key(uint32_t id) const
+    {
+        return uint64_t(~index.entries[id].count) << 32 | uint32_t(~newest[id]);
+    }
+    pair<double, uint32_t> frecent_key(uint32_t id) const
+    {
+        return make_pair(-index.entries[id].frecency, uint32_t(~newest[id]));
+    }
+    static double tick_score(uint64_t tick) { return PathIndex::frecency_rate * tick; }
+    // Score an entry again from its visits
+    void rescore(uint32_t id);
+    void remove(uint32_t stamp);
+    uint32_t stamp_at(size_t position) const;
+    size_t position(uint32_t stamp) const;
+    void tree_add(uint32_t stamp, int delta);
+    // Renumber the stamps in use from zero, in a tree of at least capacity
+    void renumber(size_t capacity);
+};
+
+#endif
+
+// vim:ff=unix
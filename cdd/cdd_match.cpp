@@ -0,0 +1,219 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include "cdd_match.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CDD_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is picked at run time, which needs the gcc/clang target attribute
+#if defined(CDD_SSE2) && defined(__GNUC__)
+#define CDD_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline char fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+static inline unsigned lowest_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Compare count characters of s, folded to lower case, against needle
+static inline bool equal_icase(const char *s, const char *needle, size_t count)
+{
+    for (size_t i=0; i<count; i++)
+    {
+        if (fold(s[i]) != needle[i])
+            return false;
+    }
+    return true;
+}
+
+bool find_icase_scalar(string_view haystack, string_view needle)
+{
+    size_t count = needle.size();
+    if (count == 0)
+        return true;
+    if (count > haystack.size())
+        return false;
+    const char *s = haystack.data();
+    for (size_t i=0, end=haystack.size()-count; i<=end; i++)
+    {
+        if (fold(s[i]) == needle[0] && equal_icase(s + i + 1, needle.data() + 1, count - 1))
+            return true;
+    }
+    return false;
+}
+
+// The vector versions compare a block of candidate positions against the
+// first and the last character of the needle at once, and only check the
+// rest of the needle where both of those match.  Whatever is left over
+// at the end of the haystack goes to the scalar version.
+
+#ifdef CDD_SSE2
+
+static inline __m128i fold_sse2(__m128i v)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static bool find_icase_sse2(string_view haystack, string_view needle)
+{
+    size_t count = needle.size();
+    const char *s = haystack.data();
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[count-1]);
+    size_t i = 0;
+    for (; i + count + 15 <= haystack.size(); i += 16)
+    {
+        __m128i block_first = fold_sse2(_mm_loadu_si128((const __m128i *)(s + i)));
+        __m128i block_last = fold_sse2(_mm_loadu_si128((const __m128i *)(s + i + count - 1)));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+        while (mask)
+        {
+            unsigned bit = lowest_bit(mask);
+            if (count <= 2 || equal_icase(s + i + bit + 1, needle.data() + 1, count - 2))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return find_icase_scalar(haystack.substr(i), needle);
+}
+
+#endif
+
+#ifdef CDD_AVX2
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v)
+{
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static bool find_icase_avx2(string_view haystack, string_view needle)
+{
+    size_t count = needle.size();
+    const char *s = haystack.data();
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[count-1]);
+    size_t i = 0;
+    for (; i + count + 31 <= haystack.size(); i += 32)
+    {
+        __m256i block_first = fold_avx2(_mm256_loadu_si256((const __m256i *)(s + i)));
+        __m256i block_last = fold_avx2(_mm256_loadu_si256((const __m256i *)(s + i + count - 1)));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+        while (mask)
+        {
+            unsigned bit = lowest_bit(mask);
+            if (count <= 2 || equal_icase(s + i + bit + 1, needle.data() + 1, count - 2))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return find_icase_sse2(haystack.substr(i), needle);
+}
+
+#endif
+
+bool find_icase(string_view haystack, string_view needle)
+{
+    if (needle.empty())
+        return true;
+    if (needle.size() > haystack.size())
+        return false;
+#ifdef CDD_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+        return find_icase_avx2(haystack, needle);
+#endif
+#ifdef CDD_SSE2
+    return find_icase_sse2(haystack, needle);
+#else
+    return find_icase_scalar(haystack, needle);
+#endif
+}
+
+//----------------------------------------------------------------------
+
+bool PathMatcher::is_literal_pattern(const string& pattern)
+{
+    return pattern.find_first_of("^$\\.*+?()[]{}|") == string::npos;
+}
+
+void PathMatcher::compile(const string& pattern, Engine engine)
+{
+    if (engine == ENGINE_AUTO && is_literal_pattern(pattern))
+    {
+        kind = KIND_LITERAL;
+        needle.clear();
+        for (string::const_iterator it=pattern.begin(); it!=pattern.end(); ++it)
+            needle.push_back(fold(*it));
+        return;
+    }
+    if (engine != ENGINE_REGEX && dfa.compile(pattern))
+    {
+        kind = KIND_DFA;
+        return;
+    }
+    kind = KIND_REGEX;
+    // Ignore case by default
+    re.assign(pattern, std::regex_constants::icase);
+}
+
+bool PathMatcher::search(string_view dir) const
+{
+    switch (kind)
+    {
+    case KIND_LITERAL:
+        return find_icase(dir, needle);
+    case KIND_DFA:
+        return dfa.search(dir);
+    default:
+        return std::regex_search(dir.begin(), dir.end(), re);
+    }
+}
+
+// vim:ff=unix
@@ -0,0 +1,73 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CDD_MATCH_H
+#define CDD_MATCH_H
+
+#include <string>
+#include <string_view>
+#include <regex>
+#include "cdd_dfa.h"
+using namespace std;
+
+// Case insensitive (ASCII) search for needle in haystack.
+// needle must already be in lower case.
+bool find_icase(string_view haystack, string_view needle);
+bool find_icase_scalar(string_view haystack, string_view needle);
+
+// Matches directory names against a history pattern, ignoring case.
+// Most patterns are plain words, those are searched for directly.
+// Other patterns go through DfaRegex, or std::regex for the syntax
+// that DfaRegex does not support.
+struct PathMatcher
+{
+    enum Engine
+    {
+        ENGINE_AUTO,    // pick the fastest engine for the pattern
+        ENGINE_DFA,     // DfaRegex even for plain words
+        ENGINE_REGEX,   // always use std::regex
+    };
+
+    // Throws std::regex_error if the pattern cannot be compiled
+    void compile(const string& pattern, Engine engine=ENGINE_AUTO);
+    bool search(string_view dir) const;
+    bool is_literal(void) const { return kind == KIND_LITERAL; }
+    bool is_dfa(void) const { return kind == KIND_DFA; }
+    static bool is_literal_pattern(const string& pattern);
+
+private:
+    enum Kind
+    {
+        KIND_LITERAL,
+        KIND_DFA,
+        KIND_REGEX,
+    };
+
+    Kind kind = KIND_REGEX;
+    string needle;
+    DfaRegex dfa;
+    std::regex re;
+};
+
+#endif
+
+// vim:ff=unix
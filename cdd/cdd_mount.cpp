@@ -0,0 +1,251 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include "cdd_mount.h"
+#include <mutex>
+#include <cstdio>
+
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+#endif
+
+static const char mountinfo_path[] = "/proc/self/mountinfo";
+
+// Mount points have space, tab, newline and backslash escaped as \ooo
+static bool is_octal(char c)
+{
+    return c >= '0' && c <= '7';
+}
+
+static string unescape(const string& field)
+{
+    string result;
+    for (size_t i=0; i<field.size(); i++)
+    {
+        if (field[i] == '\\' && i + 3 < field.size()
+            && is_octal(field[i+1]) && is_octal(field[i+2]) && is_octal(field[i+3]))
+        {
+            result += char((field[i+1] - '0') * 64 + (field[i+2] - '0') * 8 + (field[i+3] - '0'));
+            i += 3;
+        }
+        else
+            result += field[i];
+    }
+    return result;
+}
+
+bool MountTable::load(const string& file_path)
+{
+    mounts.clear();
+    FILE *file = fopen(file_path.c_str(), "r");
+    if (!file)
+        return false;
+    string text;
+    char buffer[8192];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, size);
+    fclose(file);
+    parse(text);
+    return true;
+}
+
+// Each line is
+//
+//     ID PARENT MAJOR:MINOR ROOT POINT OPTIONS [TAGS...] - TYPE SOURCE OPTIONS
+//
+// with as many optional tags as there are, up to the lone "-"
+void MountTable::parse(const string& text)
+{
+    mounts.clear();
+    istringstream lines(text);
+    string line;
+    while (getline(lines, line))
+    {
+        istringstream strm(line);
+        string field;
+        vector<string> fields;
+        while (strm >> field && field != "-")
+            fields.push_back(field);
+        Mount mount;
+        if (fields.size() < 6 || !(strm >> mount.type))
+            continue;
+        mount.point = unescape(fields[4]);
+        mounts.push_back(mount);
+    }
+    // The last mount on a point hides the ones before it
+    stable_sort(mounts.begin(), mounts.end(), [](const Mount& a, const Mount& b) {
+        return a.point.size() != b.point.size() ? a.point.size() > b.point.size() : a.point < b.point;
+    });
+    for (size_t i=mounts.size(); i-- > 1; )
+    {
+        if (mounts[i-1].point == mounts[i].point)
+            mounts.erase(mounts.begin() + i - 1);
+    }
+}
+
+const MountTable::Mount *MountTable::find(const string& path) const
+{
+    for (size_t i=0; i<mounts.size(); i++)
+    {
+        const string& point = mounts[i].point;
+        if (path.compare(0, point.size(), point) == 0
+            && (path.size() == point.size() || path[point.size()] == '/' || point == "/"))
+            return &mounts[i];
+    }
+    return nullptr;
+}
+
+bool MountTable::is_remote(const string& path) const
+{
+    const Mount *mount = find(path);
+    return mount && is_remote_type(mount->type);
+}
+
+// As the kernel follows a path, but with no stat of a component that
+// could hang
+string MountTable::resolve(const string& path, ComponentCache *cache) const
+{
+#ifdef __linux__
+    if (path.empty() || path[0] != '/')
+        return path;
+    // Loops end as the kernel's do, with ELOOP after 40 links
+    const int max_links = 40;
+    int links = 0;
+    string resolved;
+    string rest = path;
+    size_t pos = 0;
+    while (pos < rest.size())
+    {
+        size_t end = rest.find('/', pos);
+        if (end == string::npos)
+            end = rest.size();
+        string name = rest.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.empty() || name == ".")
+            continue;
+        if (name == "..")
+        {
+            size_t slash = resolved.find_last_of('/');
+            resolved.erase(slash == string::npos ? 0 : slash);
+            continue;
+        }
+        string next = resolved + "/" + name;
+        string remaining = pos < rest.size() ? rest.substr(pos) : string();
+        if (is_remote(next))
+            return remaining.empty() ? next : next + "/" + remaining;
+
+        Component found;
+        auto it = cache ? cache->find(next) : ComponentCache::iterator();
+        if (cache && it != cache->end())
+            found = it->second;
+        else
+        {
+            struct stat st;
+            found.found = lstat(next.c_str(), &st) == 0;
+            if (found.found && S_ISLNK(st.st_mode))
+            {
+                char target[4096];
+                ssize_t size = readlink(next.c_str(), target, sizeof(target));
+                if (size > 0 && size < ssize_t(sizeof(target)))
+                    found.link.assign(target, size);
+            }
+            if (cache)
+                (*cache)[next] = found;
+        }
+        if (!found.found || (!found.link.empty() && ++links > max_links))
+            return remaining.empty() ? next : next + "/" + remaining;
+        if (found.link.empty())
+        {
+            resolved = next;
+            continue;
+        }
+        // Go on from the target, which an absolute link starts over
+        if (found.link[0] == '/')
+            resolved.clear();
+        rest = remaining.empty() ? found.link : found.link + "/" + remaining;
+        pos = 0;
+    }
+    return resolved.empty() ? "/" : resolved;
+#else
+    return path;
+#endif
+}
+
+bool MountTable::is_remote_type(const string& type)
+{
+    static const char *remote_types[] = {
+        "nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "afs", "coda", "9p", "ceph",
+        "glusterfs", "lustre", "gfs2", "ocfs2", "davfs", "fuse.sshfs", "fuse.rclone",
+        "fuse.s3fs", "fuse.gcsfuse", "fuse.davfs2", "fuse.glusterfs", "fuse.cephfs",
+    };
+    for (size_t i=0; i<sizeof(remote_types)/sizeof(remote_types[0]); i++)
+    {
+        if (type == remote_types[i])
+            return true;
+    }
+    return false;
+}
+
+shared_ptr<const MountTable> MountTable::current(void)
+{
+    static mutex lock;
+    static shared_ptr<const MountTable> table;
+    lock_guard<mutex> guard(lock);
+#ifdef __linux__
+    // Its mtime does not move, but a poll on the open file wakes with
+    // POLLPRI whenever the mounts of the process change
+    static int fd = -1;
+    bool changed = fd < 0;
+    if (fd >= 0)
+    {
+        pollfd item = {fd, POLLPRI, 0};
+        changed = poll(&item, 1, 0) > 0;
+    }
+    if (changed || !table)
+    {
+        if (fd < 0)
+            fd = open(mountinfo_path, O_RDONLY | O_CLOEXEC);
+        string text;
+        char buffer[8192];
+        ssize_t size;
+        if (fd >= 0)
+            lseek(fd, 0, SEEK_SET);
+        while (fd >= 0 && (size = read(fd, buffer, sizeof(buffer))) > 0)
+            text.append(buffer, size);
+        auto fresh = make_shared<MountTable>();
+        fresh->parse(text);
+        table = fresh;
+    }
+#else
+    if (!table)
+        table = make_shared<MountTable>();
+#endif
+    return table;
+}
+
+// vim:ff=unix
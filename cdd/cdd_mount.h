@@ -0,0 +1,80 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef CDD_MOUNT_H
+#define CDD_MOUNT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+using namespace std;
+
+// The mounts of this process, read from /proc/self/mountinfo, so that a
+// path on a network file system is known before anything is asked of it.
+// A stat on a mount whose server has gone away waits out the whole RPC
+// timeout, and the shell waits with it.
+//
+// A path is placed by its spelling, under the longest mount point that
+// it starts with.  A logical path, as dirs -l gives it, may go through
+// a symlink onto another mount, so it is given to resolve first.  Where
+// there is no mountinfo every path is local.
+struct MountTable
+{
+    struct Mount
+    {
+        string point;
+        string type;
+    };
+    // What lstat found at a resolved path, kept by a caller that
+    // resolves many paths with much of their prefixes in common
+    struct Component
+    {
+        bool found = false;
+        // Its target when it is a symlink
+        string link;
+    };
+    typedef unordered_map<string, Component> ComponentCache;
+    // Longest mount point first
+    vector<Mount> mounts;
+
+    bool load(const string& file_path);
+    void parse(const string& text);
+    // The mount that holds an absolute path, nullptr when none does
+    const Mount *find(const string& path) const;
+    bool is_remote(const string& path) const;
+    // An absolute path with the symlinks among its components followed,
+    // one component at a time, and "." and ".." taken out.  Only what is
+    // on a local mount is looked at, the rest of a path from the first
+    // component on a network file system, or from one that is not there,
+    // is kept as it is spelled.
+    string resolve(const string& path, ComponentCache *cache=nullptr) const;
+    static bool is_remote_type(const string& type);
+    // The mounts as they are now, read once and shared by every request
+    // of a server, read again only when a mount comes or goes
+    static shared_ptr<const MountTable> current(void);
+};
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,628 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include "cdd_server.h"
+#include "cdd_coproc.h"
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+#ifdef __linux__
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/inotify.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
+
+// Larger than any request a shell would send
+static const size_t max_request = 1 << 20;
+// How long a client waits on a server that has stopped answering
+static const int client_timeout_ms = 2000;
+
+string HistoryServer::default_socket_path(void)
+{
+    string dir = get_environment("XDG_RUNTIME_DIR");
+    return dir.empty() ? string() : dir + "/cdd-server.sock";
+}
+
+string HistoryServer::handle(const string& request)
+{
+    string response;
+    answer(request, false, response);
+    return response;
+}
+
+bool HistoryServer::answer(const string& request, bool may_wait, string& response)
+{
+    ostringstream out;
+    istringstream strm(request);
+    string header, tag;
+    long long arg_count = -1;
+    getline(strm, header);
+    istringstream(header) >> tag >> arg_count;
+    vector<string> args(arg_count >= 0 && arg_count <= 1024 ? arg_count : 0);
+    string cwd, env_options;
+    for (size_t i=0; i<args.size(); i++)
+        getline(strm, args[i]);
+    getline(strm, cwd);
+    if (tag != "cdd-server-request" || arg_count < 0 || arg_count > 1024 || !getline(strm, env_options))
+    {
+        CoprocServer::respond(out, "error", "", "** Malformed server request: " + header);
+        response = out.str();
+        return true;
+    }
+
+    if (change_directory && !cwd.empty())
+        set_working_path(cwd);
+
+    Cdd cdd;
+    vector<const char *> av;
+    av.push_back("_cdd");
+    for (size_t i=0; i<args.size(); i++)
+        av.push_back(args[i].c_str());
+    SnapshotPublisher::Reader reader(publisher);
+    try
+    {
+        if (cdd.options(av.size(), av.data(), env_options))
+        {
+            // Only requests for the store held here are answered
+            string request_store = cdd.opt_store;
+            if (!request_store.empty() && request_store[0] != '/')
+                request_store = cwd + "/" + request_store;
+            const IndexSnapshot *snapshot = reader.acquire();
+            // A window of time is read from the store, see --since.
+            // Requests are answered on the one thread that serves every
+            // client, so one that stats or walks directories, or changes
+            // the store and may wait on its lock, is left to the client.
+            if (cdd.has_directory_stack || cdd.opt_coproc || cdd.opt_since || cdd.opt_dedupe || cdd.opt_discover
+                || cdd.opt_gc || cdd.opt_delete || cdd.opt_reset || cdd.opt_prune || cdd.opt_compact
+                || request_store != store_path || !snapshot || snapshot->index.separator != cdd.opt_separator)
+            {
+                CoprocServer::respond(out, "decline", "", "");
+                response = out.str();
+                return true;
+            }
+            // The current directory is the top of the stack, as it is
+            // for the shell's directory stack
+            if (may_wait && (snapshot->stack_size() == 0 || snapshot->index.arena[snapshot->stack_name(0)] != cwd
+                             || !(HistoryStore::current_state(store_path) == snapshot->state)))
+            {
+                add_job(cwd);
+                return false;
+            }
+            cdd.opt_store = store_path;
+            cdd.assign(*snapshot, cwd);
+            cdd.process();
+            if (!cdd.store_destination().empty())
+                add_job(cdd.store_destination());
+        }
+        CoprocServer::respond(out, "ok", cdd.strm_out.str(), cdd.strm_err.str());
+    }
+    catch (exception& e)
+    {
+        CoprocServer::respond(out, "ok", "", cdd.strm_err.str() + "** Caught exception: " + e.what());
+    }
+    response = out.str();
+    return true;
+}
+
+void HistoryServer::add_job(const string& dir)
+{
+    lock_guard<mutex> lock(jobs_mutex);
+    jobs.push_back(dir);
+    jobs_ready.notify_one();
+}
+
+void HistoryServer::write_loop(void)
+{
+    unique_lock<mutex> lock(jobs_mutex);
+    for (;;)
+    {
+        jobs_ready.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+            return;
+        vector<string> dirs;
+        dirs.swap(jobs);
+        lock.unlock();
+        update(dirs);
+        lock.lock();
+    }
+}
+
+void HistoryServer::update(const vector<string>& dirs)
+{
+    bool changed = store.changed(store_path);
+    if (changed)
+        store.open(store_path);
+    bool recorded = false;
+    for (size_t i=0; i<dirs.size(); i++)
+    {
+        uint32_t weight;
+        if (!dirs[i].empty() && store.stack(0, weight) != dirs[i])
+            recorded = store.record(store_path, dirs[i]) || recorded;
+    }
+    // Most notices from the store are for visits recorded here
+    if (changed || recorded)
+    {
+        // Readers go on with the snapshot they have meanwhile
+        if (store.log_tail() > HistoryStore::compact_threshold && HistoryStore::compact(store_path, nullptr, false))
+            store.open(store_path);
+        IndexSnapshot *snapshot = IndexSnapshot::build(store);
+        publisher.publish(snapshot);
+        // Still held by the publisher, which only this thread replaces
+        shared.publish(*snapshot, store_path);
+    }
+    // Parked requests are answered either way
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(published_fd, &one, sizeof(one)) < 0)
+        return;
+#endif
+}
+
+#ifdef __linux__
+
+HistoryServer::~HistoryServer(void)
+{
+    if (writer.joinable())
+    {
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            stopping = true;
+        }
+        jobs_ready.notify_one();
+        writer.join();
+    }
+    for (auto it=connections.begin(); it!=connections.end(); ++it)
+        close(it->first);
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        unlink(shared_index_path(socket_path).c_str());
+    }
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (wake_fd >= 0)
+        close(wake_fd);
+    if (published_fd >= 0)
+        close(published_fd);
+    if (notify_fd >= 0)
+        close(notify_fd);
+}
+
+static bool socket_address(const string& socket_path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, socket_path.data(), socket_path.size());
+    return true;
+}
+
+bool HistoryServer::listen(string& error)
+{
+    if (!store_path.empty() && store_path[0] != '/')
+        store_path = get_working_path() + "/" + store_path;
+    sockaddr_un address;
+    if (!socket_address(socket_path, address))
+    {
+        error = "Cannot use socket path: " + socket_path;
+        return false;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        error = string("Cannot create socket: ") + strerror(errno);
+        return false;
+    }
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        // A socket left behind by a server that is gone is replaced,
+        // one that still answers is not
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool running = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (running || errno != ECONNREFUSED || unlink(socket_path.c_str()) != 0
+            || bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            error = running ? "A server is already running on " + socket_path
+                            : "Cannot bind " + socket_path + ": " + strerror(errno);
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+    }
+    // Only this user may ask for the history
+    chmod(socket_path.c_str(), 0600);
+    if (::listen(listen_fd, SOMAXCONN) != 0)
+    {
+        error = string("Cannot listen: ") + strerror(errno);
+        return false;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    published_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0 || published_fd < 0 || notify_fd < 0)
+    {
+        error = string("Cannot create event loop: ") + strerror(errno);
+        return false;
+    }
+    epoll_event event = epoll_event();
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    event.data.fd = published_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, published_fd, &event);
+    // The snapshot is renamed into place and the log may be created, so
+    // the directory is watched rather than the files
+    string store_dir = store_path.substr(0, store_path.find_last_of('/') + 1);
+    if (inotify_add_watch(notify_fd, store_dir.c_str(), IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_DELETE) < 0)
+    {
+        error = "Cannot watch " + store_dir + ": " + strerror(errno);
+        return false;
+    }
+    event.data.fd = notify_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notify_fd, &event);
+    if (!shared.create(shared_index_path(socket_path), error))
+        return false;
+
+    store.open(store_path);
+    IndexSnapshot *snapshot = IndexSnapshot::build(store);
+    publisher.publish(snapshot);
+    shared.publish(*snapshot, store_path);
+    writer = thread([this]() { write_loop(); });
+    return true;
+}
+
+void HistoryServer::stop(void)
+{
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+void HistoryServer::run(void)
+{
+    epoll_event events[64];
+    for (;;)
+    {
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        if (count < 0 && errno != EINTR)
+            return;
+        for (int i=0; i<count; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd)
+                return;
+            if (fd == listen_fd)
+            {
+                accept_all();
+                continue;
+            }
+            if (fd == published_fd)
+            {
+                answer_parked();
+                continue;
+            }
+            if (fd == notify_fd)
+            {
+                store_notified();
+                continue;
+            }
+            auto it = connections.find(fd);
+            if (it == connections.end() || it->second.parked)
+                continue;
+            bool open = it->second.out.empty() ? read_request(fd, it->second) : write_response(fd, it->second);
+            if (!open)
+                close_connection(fd);
+        }
+    }
+}
+
+void HistoryServer::accept_all(void)
+{
+    for (;;)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        epoll_event event = epoll_event();
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        connections[fd] = Connection();
+    }
+}
+
+void HistoryServer::close_connection(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(fd);
+}
+
+bool HistoryServer::read_request(int fd, Connection& connection)
+{
+    char buffer[4096];
+    for (;;)
+    {
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count > 0)
+        {
+            connection.in.append(buffer, count);
+            if (connection.in.size() > max_request)
+                return false;
+            continue;
+        }
+        if (count < 0)
+            return errno == EAGAIN || errno == EINTR;
+        break;
+    }
+
+    // The client has sent all of its request
+    epoll_event event = epoll_event();
+    event.data.fd = fd;
+    if (!answer(connection.in, true, connection.out))
+    {
+        event.events = 0;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        connection.parked = true;
+        return true;
+    }
+    event.events = EPOLLOUT;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    return write_response(fd, connection);
+}
+
+void HistoryServer::answer_parked(void)
+{
+    uint64_t count;
+    if (read(published_fd, &count, sizeof(count)) < 0)
+        return;
+    vector<int> finished;
+    for (auto it=connections.begin(); it!=connections.end(); ++it)
+    {
+        Connection& connection = it->second;
+        if (!connection.parked)
+            continue;
+        // Answered from the snapshot as it is now, whatever else has
+        // changed meanwhile
+        answer(connection.in, false, connection.out);
+        connection.parked = false;
+        epoll_event event = epoll_event();
+        event.events = EPOLLOUT;
+        event.data.fd = it->first;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, it->first, &event);
+        if (!write_response(it->first, connection))
+            finished.push_back(it->first);
+    }
+    for (size_t i=0; i<finished.size(); i++)
+        close_connection(finished[i]);
+}
+
+void HistoryServer::store_notified(void)
+{
+    string store_name = store_path.substr(store_path.find_last_of('/') + 1);
+    string log_name = HistoryStore::log_path(store_name);
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t size;
+    while ((size = read(notify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t i=0; i<size; )
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + i);
+            string name = event->len ? event->name : "";
+            if (name == store_name || name == log_name)
+                changed = true;
+            i += sizeof(inotify_event) + event->len;
+        }
+    }
+    if (changed)
+        add_job(string());
+}
+
+bool HistoryServer::write_response(int fd, Connection& connection)
+{
+    while (connection.sent < connection.out.size())
+    {
+        ssize_t count = send(fd, connection.out.data() + connection.sent,
+            connection.out.size() - connection.sent, MSG_NOSIGNAL);
+        if (count < 0)
+            return errno == EAGAIN || errno == EINTR;
+        connection.sent += count;
+    }
+    return false;
+}
+
+// Wait for fd to be ready, false on a timeout
+static bool wait_for(int fd, short events)
+{
+    pollfd item = {fd, events, 0};
+    int count;
+    while ((count = poll(&item, 1, client_timeout_ms)) < 0 && errno == EINTR)
+        ;
+    return count > 0;
+}
+
+bool server_request(const string& socket_path, const vector<string>& args, const string& cwd,
+    const string& env_options, string& text_out, string& text_err)
+{
+    sockaddr_un address;
+    if (!socket_address(socket_path, address))
+        return false;
+    for (size_t i=0; i<args.size(); i++)
+    {
+        // Arguments are sent a line each
+        if (args[i].find('\n') != string::npos)
+            return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    string response;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+    {
+        ostringstream strm;
+        strm << "cdd-server-request " << args.size() << "\n";
+        for (size_t i=0; i<args.size(); i++)
+            strm << args[i] << "\n";
+        strm << cwd << "\n" << env_options << "\n";
+        string request = strm.str();
+        size_t sent = 0;
+        while (sent < request.size() && wait_for(fd, POLLOUT))
+        {
+            ssize_t count = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+                break;
+            sent += count;
+        }
+        if (sent == request.size() && shutdown(fd, SHUT_WR) == 0)
+        {
+            char buffer[4096];
+            ssize_t count;
+            while (wait_for(fd, POLLIN) && (count = read(fd, buffer, sizeof(buffer))) > 0)
+                response.append(buffer, count);
+        }
+    }
+    close(fd);
+
+    istringstream strm(response);
+    string header, tag, status;
+    long long count_out = -1, count_err = -1;
+    getline(strm, header);
+    istringstream(header) >> tag >> status >> count_out >> count_err;
+    if (tag != "cdd-response" || status != "ok" || count_out < 0 || count_err < 0)
+        return false;
+    string line;
+    text_out.clear();
+    text_err.clear();
+    for (long long i=0; i<count_out && getline(strm, line); i++)
+        text_out += line + "\n";
+    for (long long i=0; i<count_err && getline(strm, line); i++)
+        text_err += line + "\n";
+    return true;
+}
+
+bool shared_request(const string& socket_path, const vector<string>& args, const string& cwd,
+    const string& env_options, string& text_out, string& text_err)
+{
+    SharedIndexReader reader;
+    if (socket_path.empty() || !reader.open(HistoryServer::shared_index_path(socket_path)))
+        return false;
+    vector<const char *> av;
+    av.push_back("_cdd");
+    for (size_t i=0; i<args.size(); i++)
+        av.push_back(args[i].c_str());
+    for (int attempt=0; attempt<4; attempt++)
+    {
+        Cdd cdd;
+        // Left to the server, these change the store, and a window of
+        // time is read from the store itself
+        if (!cdd.options(av.size(), av.data(), env_options) || cdd.opt_store.empty() || cdd.has_directory_stack
+            || cdd.opt_coproc || cdd.opt_gc || cdd.opt_delete || cdd.opt_reset || cdd.opt_prune || cdd.opt_compact
+            || cdd.opt_since || cdd.opt_dedupe)
+            return false;
+        string store_path = cdd.opt_store;
+        if (store_path[0] != '/')
+            store_path = cwd + "/" + store_path;
+        const IndexSnapshot *snapshot = reader.acquire(store_path);
+        // The current directory has to be the top of the stack already,
+        // and the store as the snapshot has it
+        if (!snapshot || snapshot->index.separator != cdd.opt_separator || snapshot->stack_size() == 0
+            || snapshot->index.arena[snapshot->stack_name(0)] != cwd
+            || !(HistoryStore::current_state(store_path) == snapshot->state))
+            return false;
+        cdd.assign(*snapshot, cwd);
+        cdd.process();
+        // Rewritten while it was read, what was read may be wrong
+        if (!reader.unchanged())
+            continue;
+        // The server publishes the visit once it sees it
+        string destination = cdd.store_destination();
+        if (!destination.empty())
+            HistoryStore::append(store_path, destination, time(nullptr));
+        text_out = cdd.strm_out.str();
+        text_err = cdd.strm_err.str();
+        return true;
+    }
+    return false;
+}
+
+#else
+
+// Only built for Linux, elsewhere there is never a server to ask
+
+HistoryServer::~HistoryServer(void)
+{
+}
+
+bool HistoryServer::listen(string& error)
+{
+    error = "The history server needs Linux";
+    return false;
+}
+
+void HistoryServer::run(void)
+{
+}
+
+void HistoryServer::stop(void)
+{
+}
+
+bool server_request(const string& socket_path, const vector<string>& args, const string& cwd,
+    const string& env_options, string& text_out, string& text_err)
+{
+    return false;
+}
+
+bool shared_request(const string& socket_path, const vector<string>& args, const string& cwd,
+    const string& env_options, string& text_out, string& text_err)
+{
+    return false;
+}
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,153 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef CDD_SERVER_H
+#define CDD_SERVER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "cdd_store.h"
+#include "cdd_snapshot.h"
+using namespace std;
+
+// Answers cdd requests for a history store from many shells at once, so
+// that a cd does not open and read the store itself.  Clients are served
+// over a Unix domain socket from one epoll loop.
+//
+// Requests are answered from an index snapshot of the store, read with
+// no lock.  Only the writer thread touches the store: it records visits,
+// opens the store again when another process has changed it, and
+// publishes a new snapshot.  A request that records a visit, or that
+// finds the store changed, waits for the snapshot with it, all others
+// are answered at once from the snapshot they find.  The directory a
+// request sends the shell to is recorded as well, as pushd puts it on
+// top of a directory stack.  A request that could hold up the loop, one
+// that looks on disk or changes the store, is declined for the client
+// to run itself.
+//
+// Each snapshot is also published in a SharedIndex next to the socket,
+// which a client reads for itself, see shared_request.  The writer watches
+// the files of the store, so that visits recorded by other processes
+// are published without waiting for a request.
+//
+// A client connects, sends one request and shuts down its side:
+//
+//     cdd-server-request ARGC
+//     ARGC lines of arguments
+//     the working directory of the client
+//     the value of CDD_OPTIONS
+//
+// The response is the same as for a coprocess, see cdd_coproc.h, with
+// STATUS "decline" for a request that is not for the store the server
+// holds, which the client then handles itself.
+struct HistoryServer
+{
+    // The store served, made absolute by listen
+    string store_path;
+    string socket_path;
+    // Change to the working directory of the client for each request,
+    // relative paths are resolved against it
+    bool change_directory = true;
+
+    HistoryServer(void) {}
+    ~HistoryServer(void);
+    HistoryServer(const HistoryServer&) = delete;
+    HistoryServer& operator=(const HistoryServer&) = delete;
+
+    // "cdd-server.sock" in XDG_RUNTIME_DIR, empty if that is not set
+    static string default_socket_path(void);
+    static string shared_index_path(const string& socket_path) { return socket_path + ".index"; }
+
+    // Create the socket and publish the first snapshot, false with a
+    // message in error on failure
+    bool listen(string& error);
+    // Serve until stop is called
+    void run(void);
+    // Safe to call from another thread or a signal handler
+    void stop(void);
+    // Answer one complete request without waiting for the writer
+    string handle(const string& request);
+
+private:
+    struct Connection
+    {
+        string in;
+        string out;
+        size_t sent = 0;
+        // Waiting for the writer to publish
+        bool parked = false;
+    };
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    // Signalled by the writer after each snapshot it publishes
+    int published_fd = -1;
+    // Changes to the files of the store
+    int notify_fd = -1;
+    map<int, Connection> connections;
+    SnapshotPublisher publisher;
+
+    // Only used by the writer thread once it runs
+    HistoryStore store;
+    SharedIndex shared;
+    thread writer;
+    mutex jobs_mutex;
+    condition_variable jobs_ready;
+    // Directories to record, an empty one only asks for a new snapshot
+    vector<string> jobs;
+    bool stopping = false;
+
+    // Answer a request, false when it has to wait for the writer first
+    bool answer(const string& request, bool may_wait, string& response);
+    void add_job(const string& dir);
+    void write_loop(void);
+    void update(const vector<string>& dirs);
+    void answer_parked(void);
+    void store_notified(void);
+    void accept_all(void);
+    void close_connection(int fd);
+    // False once the connection is finished with
+    bool read_request(int fd, Connection& connection);
+    bool write_response(int fd, Connection& connection);
+};
+
+// Send a request to the server at socket_path.  False if there is no
+// server or it declines, the caller then handles the request itself.
+bool server_request(const string& socket_path, const vector<string>& args, const string& cwd,
+    const string& env_options, string& text_out, string& text_err);
+
+// Answer a request from the index the server at socket_path publishes,
+// read in place, with no round trip to the server.  False when there is
+// no such index, or it is not current for the store with cwd at the top
+// of its stack, or the request would change the store.  The caller then
+// asks the server.
+bool shared_request(const string& socket_path, const vector<string>& args, const string& cwd,
+    const string& env_options, string& text_out, string& text_err);
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,543 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include "cdd_snapshot.h"
+#include <cstring>
+
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sched.h>
+    #include <sys/mman.h>
+#endif
+
+const char SharedIndex::magic[8] = {'C', 'D', 'D', 'I', 'N', 'D', 'E', 'X'};
+
+IndexSnapshot *IndexSnapshot::build(const HistoryStore& store, char separator)
+{
+    IndexSnapshot *snapshot = new IndexSnapshot();
+    snapshot->index.separator = separator;
+    snapshot->index.reserve(store.path_count() + store.log_visits().size());
+    snapshot->stack.reserve(store.stack_size());
+    snapshot->state = store.state();
+    for (uint64_t i=0; i<store.stack_size(); i++)
+    {
+        uint32_t weight;
+        double frecency;
+        string_view dir = store.stack(i, weight, frecency);
+        // Skip over any damaged entry
+        if (!dir.empty())
+            snapshot->stack.push_back(snapshot->index.add(dir, weight, frecency));
+    }
+    return snapshot;
+}
+
+IndexSnapshot *IndexSnapshot::build(const vector<string>& stack, char separator)
+{
+    IndexSnapshot *snapshot = new IndexSnapshot();
+    snapshot->index.separator = separator;
+    snapshot->index.reserve(stack.size());
+    snapshot->stack.reserve(stack.size());
+    for (size_t i=0; i<stack.size(); i++)
+        snapshot->stack.push_back(snapshot->index.add(stack[i]));
+    return snapshot;
+}
+
+IndexSnapshot *IndexSnapshot::build(string_view lines, char separator, function<bool(void)> stop)
+{
+    IndexSnapshot *snapshot = new IndexSnapshot();
+    snapshot->index.separator = separator;
+    size_t count = std::count(lines.begin(), lines.end(), '\n') + 1;
+    snapshot->index.reserve(count);
+    snapshot->stack.reserve(count);
+    while (!lines.empty() && !(stop && stop()))
+    {
+        size_t end = lines.find('\n');
+        snapshot->stack.push_back(snapshot->index.add(lines.substr(0, end)));
+        lines.remove_prefix(end == string_view::npos ? lines.size() : end + 1);
+    }
+    return snapshot;
+}
+
+void IndexSnapshot::borrow_stack(const uint32_t *names, size_t size)
+{
+    borrowed_names = names;
+    borrowed_size = size;
+}
+
+SnapshotPublisher::SnapshotPublisher(void) : current(nullptr), epoch(1)
+{
+    for (size_t i=0; i<max_readers; i++)
+    {
+        slots[i].epoch = 0;
+        slots[i].used = false;
+    }
+}
+
+SnapshotPublisher::~SnapshotPublisher(void)
+{
+    // No reader may be left by now
+    delete current.load();
+    for (size_t i=0; i<retired.size(); i++)
+        delete retired[i].snapshot;
+}
+
+SnapshotPublisher::Reader::Reader(SnapshotPublisher& publisher) : publisher(publisher), slot(0)
+{
+    for (;; slot = (slot + 1) % max_readers)
+    {
+        bool used = false;
+        if (publisher.slots[slot].used.compare_exchange_weak(used, true))
+            break;
+    }
+}
+
+SnapshotPublisher::Reader::~Reader(void)
+{
+    release();
+    publisher.slots[slot].used = false;
+}
+
+const IndexSnapshot *SnapshotPublisher::Reader::acquire(void)
+{
+    // The announcement has to be visible before the pointer is loaded,
+    // both are sequentially consistent
+    publisher.slots[slot].epoch = publisher.epoch.load();
+    return publisher.current.load();
+}
+
+void SnapshotPublisher::Reader::release(void)
+{
+    publisher.slots[slot].epoch.store(0, memory_order_release);
+}
+
+void SnapshotPublisher::publish(IndexSnapshot *snapshot)
+{
+    lock_guard<mutex> lock(writer_mutex);
+    IndexSnapshot *old = current.exchange(snapshot);
+    // Readers that announce a later epoch started after the exchange
+    uint64_t replaced = epoch.fetch_add(1);
+    if (old)
+        retired.push_back(Retired{old, replaced});
+    reclaim_locked();
+}
+
+void SnapshotPublisher::reclaim(void)
+{
+    lock_guard<mutex> lock(writer_mutex);
+    reclaim_locked();
+}
+
+size_t SnapshotPublisher::retired_count(void)
+{
+    lock_guard<mutex> lock(writer_mutex);
+    return retired.size();
+}
+
+void SnapshotPublisher::reclaim_locked(void)
+{
+    if (retired.empty())
+        return;
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i=0; i<max_readers; i++)
+    {
+        uint64_t reader = slots[i].epoch.load();
+        if (reader != 0 && reader < oldest)
+            oldest = reader;
+    }
+    size_t kept = 0;
+    for (size_t i=0; i<retired.size(); i++)
+    {
+        if (retired[i].epoch < oldest)
+            delete retired[i].snapshot;
+        else
+            retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+}
+
+#ifdef __linux__
+
+static_assert(atomic<uint64_t>::is_always_lock_free, "the sequence is shared between processes");
+
+// Times a reader starts over on an image that is being written before it
+// gives up, as the writer may have died halfway
+static const int max_read_attempts = 64;
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~size_t(7);
+}
+
+// Where each section of an image starts, and where the image ends
+struct ImageLayout
+{
+    size_t entries, offsets, stack_ids, stack, key, buffer, end;
+
+    ImageLayout(uint64_t entry_count, uint64_t offset_count, uint64_t stack_count,
+                uint64_t key_size, uint64_t buffer_size)
+    {
+        entries = align8(sizeof(SharedIndexHeader));
+        offsets = align8(entries + entry_count * sizeof(PathIndex::Entry));
+        stack_ids = align8(offsets + offset_count * sizeof(uint32_t));
+        stack = align8(stack_ids + stack_count * sizeof(uint32_t));
+        key = align8(stack + stack_count * sizeof(uint32_t));
+        buffer = align8(key + key_size);
+        end = buffer + buffer_size;
+    }
+
+    ImageLayout(const IndexSnapshot& snapshot, const string& key)
+        : ImageLayout(snapshot.index.entries.size(), snapshot.index.arena.offsets.size(), snapshot.stack.size(),
+                      key.size(), snapshot.index.arena.buffer.size())
+    {
+    }
+};
+
+// All of the header of an image of snapshot under key but its sequence
+static void fill_header(SharedIndexHeader *header, const IndexSnapshot& snapshot, const string& key)
+{
+    const PathIndex& index = snapshot.index;
+    memcpy(header->magic, SharedIndex::magic, sizeof(SharedIndex::magic));
+    header->version = SharedIndex::version;
+    header->separator = index.separator;
+    header->state = snapshot.state;
+    header->entry_count = index.entries.size();
+    header->offset_count = index.arena.offsets.size();
+    header->stack_count = snapshot.stack.size();
+    header->key_size = key.size();
+    header->buffer_size = index.arena.buffer.size();
+}
+
+// Hand each section of the image to copy, with where it goes
+template<typename Copy>
+static void copy_sections(const IndexSnapshot& snapshot, const string& key, const ImageLayout& layout, Copy copy)
+{
+    const PathIndex& index = snapshot.index;
+    copy(layout.entries, index.entries.data(), index.entries.size() * sizeof(PathIndex::Entry));
+    copy(layout.offsets, index.arena.offsets.data(), index.arena.offsets.size() * sizeof(uint32_t));
+    copy(layout.stack_ids, index.stack_ids.data(), index.stack_ids.size() * sizeof(uint32_t));
+    copy(layout.stack, snapshot.stack.data(), snapshot.stack.size() * sizeof(uint32_t));
+    copy(layout.key, key.data(), key.size());
+    copy(layout.buffer, index.arena.buffer.data(), index.arena.buffer.size());
+}
+
+bool SharedIndex::create(const string& file_path, string& error)
+{
+    close();
+    // Only the owner reads the history
+    fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        error = "** Cannot open " + file_path + ": " + strerror(errno);
+        close();
+        return false;
+    }
+    // Never shrunk, a reader may have mapped all of it
+    size = max(size_t(st.st_size), sizeof(SharedIndexHeader));
+    if (size_t(st.st_size) < size && ftruncate(fd, size) != 0)
+    {
+        error = "** Cannot size " + file_path + ": " + strerror(errno);
+        close();
+        return false;
+    }
+    void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        error = "** Cannot map " + file_path + ": " + strerror(errno);
+        close();
+        return false;
+    }
+    data = static_cast<char *>(address);
+    return true;
+}
+
+void SharedIndex::close(void)
+{
+    if (data)
+        munmap(data, size);
+    if (fd >= 0)
+        ::close(fd);
+    data = nullptr;
+    size = 0;
+    fd = -1;
+}
+
+bool SharedIndex::publish(const IndexSnapshot& snapshot, const string& key)
+{
+    if (!data)
+        return false;
+    ImageLayout layout(snapshot, key);
+    if (layout.end > size)
+    {
+        // Room to grow, so that a longer history is not mapped anew each
+        // time it is published
+        size_t new_size = max(layout.end, size * 2);
+        void *address = MAP_FAILED;
+        if (ftruncate(fd, new_size) == 0)
+            address = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED)
+            return false;
+        munmap(data, size);
+        data = static_cast<char *>(address);
+        size = new_size;
+    }
+
+    SharedIndexHeader *header = reinterpret_cast<SharedIndexHeader *>(data);
+    // Made odd even if a writer that died left it odd
+    uint64_t sequence = header->sequence.load(memory_order_relaxed) | 1;
+    header->sequence.store(sequence, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    fill_header(header, snapshot, key);
+    copy_sections(snapshot, key, layout, [this](size_t offset, const void *section, size_t section_size) {
+        memcpy(data + offset, section, section_size);
+    });
+
+    header->sequence.store(sequence + 1, memory_order_release);
+    return true;
+}
+
+bool SharedIndexReader::open(const string& file_path)
+{
+    close();
+    fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    return fd >= 0 && remap();
+}
+
+void SharedIndexReader::close(void)
+{
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    if (fd >= 0)
+        ::close(fd);
+    data = nullptr;
+    size = 0;
+    fd = -1;
+}
+
+// Map all of the file as it is now
+bool SharedIndexReader::remap(void)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SharedIndexHeader))
+        return false;
+    if (size_t(st.st_size) == size)
+        return true;
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    void *address = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    data = address == MAP_FAILED ? nullptr : static_cast<const char *>(address);
+    size = data ? st.st_size : 0;
+    return data != nullptr;
+}
+
+const IndexSnapshot *SharedIndexReader::acquire(const string& key)
+{
+    if (!data)
+        return nullptr;
+    const SharedIndexHeader *header = reinterpret_cast<const SharedIndexHeader *>(data);
+    for (int attempt=0; attempt<max_read_attempts; attempt++)
+    {
+        sequence = header->sequence.load(memory_order_acquire);
+        if (sequence & 1)
+        {
+            // Let the writer finish
+            sched_yield();
+            continue;
+        }
+        // Nothing read here is trusted until the sequence is seen again
+        bool valid = memcmp(header->magic, SharedIndex::magic, sizeof(SharedIndex::magic)) == 0
+            && header->version == SharedIndex::version;
+        uint64_t entry_count = header->entry_count;
+        uint64_t offset_count = header->offset_count;
+        uint64_t stack_count = header->stack_count;
+        uint64_t key_size = header->key_size;
+        uint64_t buffer_size = header->buffer_size;
+        // Counts that cannot overflow the layout
+        valid = valid && entry_count <= UINT32_MAX && offset_count > 0 && offset_count <= UINT32_MAX
+            && stack_count <= UINT32_MAX && key_size <= UINT32_MAX && buffer_size <= UINT32_MAX;
+        ImageLayout layout(entry_count, offset_count, stack_count, key_size, buffer_size);
+        bool fits = layout.end <= size;
+        bool same_key = valid && fits && string_view(data + layout.key, key_size) == key;
+        snapshot.index.separator = char(header->separator);
+        snapshot.state = header->state;
+        if (!unchanged())
+            continue;
+        if (!valid)
+            return nullptr;
+        if (!fits)
+        {
+            // Grown since it was mapped
+            if (!remap())
+                return nullptr;
+            header = reinterpret_cast<const SharedIndexHeader *>(data);
+            continue;
+        }
+        if (!same_key)
+            return nullptr;
+
+        // The counts and the layout are good, the tables they point at
+        // are only read within it
+        snapshot.index.borrow(reinterpret_cast<const PathIndex::Entry *>(data + layout.entries), entry_count,
+                              reinterpret_cast<const uint32_t *>(data + layout.stack_ids), stack_count);
+        snapshot.index.arena.borrow(data + layout.buffer, buffer_size,
+                                    reinterpret_cast<const uint32_t *>(data + layout.offsets), offset_count - 1);
+        snapshot.borrow_stack(reinterpret_cast<const uint32_t *>(data + layout.stack), stack_count);
+        return &snapshot;
+    }
+    return nullptr;
+}
+
+bool SharedIndexReader::unchanged(void) const
+{
+    if (!data)
+        return false;
+    const SharedIndexHeader *header = reinterpret_cast<const SharedIndexHeader *>(data);
+    atomic_thread_fence(memory_order_acquire);
+    return header->sequence.load(memory_order_relaxed) == sequence;
+}
+
+bool StackCache::write(const string& file_path, const IndexSnapshot& snapshot, const string& key)
+{
+    // Any number of shells may write the same file, each renames a whole
+    // image over it.  Written rather than mapped, as the pages of a new
+    // mapping cost more to fault in than to copy.
+    string temp_path = file_path + ".tmp" + to_string(getpid());
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    ImageLayout layout(snapshot, key);
+    SharedIndexHeader header = SharedIndexHeader();
+    fill_header(&header, snapshot, key);
+    bool written = pwrite(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+    copy_sections(snapshot, key, layout, [fd, &written](size_t offset, const void *section, size_t section_size) {
+        written = written && pwrite(fd, section, section_size, offset) == ssize_t(section_size);
+    });
+    // The gaps between sections read as zeros
+    written = written && ftruncate(fd, layout.end) == 0;
+    ::close(fd);
+    if (!written || rename(temp_path.c_str(), file_path.c_str()) != 0)
+    {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+const IndexSnapshot *StackCache::read(const string& file_path, const string& key)
+{
+    // The file is never written once it is in place, so there is no
+    // need to check that it is unchanged after reading
+    if (!reader.open(file_path))
+        return nullptr;
+    return reader.acquire(key);
+}
+
+#else
+
+// Only built for Linux, as is the server that publishes
+
+bool SharedIndex::create(const string& file_path, string& error)
+{
+    error = "A shared index needs Linux";
+    return false;
+}
+
+void SharedIndex::close(void)
+{
+}
+
+bool SharedIndex::publish(const IndexSnapshot& snapshot, const string& key)
+{
+    return false;
+}
+
+bool SharedIndexReader::open(const string& file_path)
+{
+    return false;
+}
+
+void SharedIndexReader::close(void)
+{
+}
+
+bool SharedIndexReader::remap(void)
+{
+    return false;
+}
+
+const IndexSnapshot *SharedIndexReader::acquire(const string& key)
+{
+    return nullptr;
+}
+
+bool SharedIndexReader::unchanged(void) const
+{
+    return false;
+}
+
+bool StackCache::write(const string& file_path, const IndexSnapshot& snapshot, const string& key)
+{
+    return false;
+}
+
+const IndexSnapshot *StackCache::read(const string& file_path, const string& key)
+{
+    return nullptr;
+}
+
+#endif
+
+uint64_t StackCache::hash(const char *data, size_t size)
+{
+    // Eight bytes at a time, as a long stack is megabytes of text
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    h = (h ^ tail) * 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 29);
+}
+
+string StackCache::key(uint64_t hash, size_t size)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "stack %016llx %llu", (unsigned long long)hash, (unsigned long long)size);
+    return text;
+}
+
+string StackCache::file_path(const string& dir, uint64_t hash)
+{
+    return dir + "/cdd-stack-" + to_string(hash % slot_count) + ".index";
+}
+
+// vim:ff=unix
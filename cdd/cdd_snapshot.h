@@ -0,0 +1,245 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef CDD_SNAPSHOT_H
+#define CDD_SNAPSHOT_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "cdd_index.h"
+#include "cdd_store.h"
+using namespace std;
+
+// The index of a whole directory stack, built once and never changed
+// afterwards, so any number of threads can read it at once.  A Cdd
+// assigned a snapshot reads it in place rather than indexing the stack.
+struct IndexSnapshot
+{
+    PathIndex index;
+    // Arena number of the spelling at each stack position, top first
+    vector<uint32_t> stack;
+    // The store the snapshot was built from, as it was then
+    StoreState state;
+
+    // Index the stack of an open store
+    static IndexSnapshot *build(const HistoryStore& store, char separator='/');
+    // Index a directory stack, top first
+    static IndexSnapshot *build(const vector<string>& stack, char separator='/');
+    // The same for a stack given as lines of text, read no further once
+    // stop is true, which it is asked before each line
+    static IndexSnapshot *build(string_view lines, char separator='/', function<bool(void)> stop=nullptr);
+
+    // Read the stack in place, as the index may, see PathIndex::borrow
+    void borrow_stack(const uint32_t *names, size_t size);
+    size_t stack_size(void) const { return borrowed_names ? borrowed_size : stack.size(); }
+    uint32_t stack_name(size_t position) const
+    {
+        if (borrowed_names)
+            return position < borrowed_size ? borrowed_names[position] : 0;
+        return stack[position];
+    }
+
+private:
+    const uint32_t *borrowed_names = nullptr;
+    size_t borrowed_size = 0;
+};
+
+// Publishes the current snapshot to reader threads through one atomic
+// pointer, with epoch based reclamation of the snapshots it replaces.
+// Readers take no lock and never wait: a reader announces the epoch it
+// started in, loads the pointer, and clears its announcement when done.
+// A replaced snapshot is deleted once no reader announces an epoch at or
+// before the one in which it was replaced, as only those could have
+// loaded it.  Publishing takes a lock that only writers contend for.
+struct SnapshotPublisher
+{
+    // Readers registered at once, each is a thread that reads
+    static const size_t max_readers = 128;
+
+    // Held by one reader thread for as long as it reads
+    struct Reader
+    {
+        explicit Reader(SnapshotPublisher& publisher);
+        ~Reader(void);
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        // The current snapshot, valid until release or the next acquire.
+        // Null when nothing was published yet.
+        const IndexSnapshot *acquire(void);
+        void release(void);
+
+    private:
+        SnapshotPublisher& publisher;
+        size_t slot;
+    };
+
+    SnapshotPublisher(void);
+    ~SnapshotPublisher(void);
+    SnapshotPublisher(const SnapshotPublisher&) = delete;
+    SnapshotPublisher& operator=(const SnapshotPublisher&) = delete;
+
+    // Make snapshot current and take ownership of it
+    void publish(IndexSnapshot *snapshot);
+    // Delete replaced snapshots that no reader can hold any more
+    void reclaim(void);
+    // Replaced snapshots not deleted yet
+    size_t retired_count(void);
+
+private:
+    // Kept on a cache line of its own so that readers do not slow each
+    // other down
+    struct alignas(64) Slot
+    {
+        // Epoch the reader started in, 0 when not reading
+        atomic<uint64_t> epoch;
+        atomic<bool> used;
+    };
+    struct Retired
+    {
+        IndexSnapshot *snapshot;
+        uint64_t epoch;
+    };
+
+    atomic<IndexSnapshot *> current;
+    atomic<uint64_t> epoch;
+    Slot slots[max_readers];
+    mutex writer_mutex;
+    vector<Retired> retired;
+
+    void reclaim_locked(void);
+};
+
+// Start of a snapshot published in a file that other processes map, so
+// that they can answer a request with no round trip to the publisher.
+// The header is followed by the entries, the arena offsets, the stack
+// ids, the stack, the key and the arena buffer, each on an 8 byte
+// boundary.  The key tells what the image was built from, the path of a
+// store or, see StackCache, a hash of a directory stack.  Nothing in the
+// image is an address, so it is read wherever it is mapped.
+//
+// The image is guarded by a sequence lock.  The one writer makes the
+// sequence odd, rewrites the image in place and makes it even again.  A
+// reader reads the image in place and keeps what it found only when it
+// sees the same even sequence before and after.  The file only ever
+// grows, so a reader never touches a page beyond its end.
+struct SharedIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t separator;
+    atomic<uint64_t> sequence;
+    StoreState state;
+    uint64_t entry_count;
+    uint64_t offset_count;
+    uint64_t stack_count;
+    uint64_t key_size;
+    uint64_t buffer_size;
+};
+
+// Publishes snapshots into a shared index file
+struct SharedIndex
+{
+    static const char magic[8];
+    static const uint32_t version = 2;
+
+    SharedIndex(void) {}
+    ~SharedIndex(void) { close(); }
+    SharedIndex(const SharedIndex&) = delete;
+    SharedIndex& operator=(const SharedIndex&) = delete;
+
+    // Open file_path to publish into, false with a message in error on
+    // failure
+    bool create(const string& file_path, string& error);
+    void close(void);
+    // Replace the image with snapshot, built from what key names
+    bool publish(const IndexSnapshot& snapshot, const string& key);
+
+private:
+    int fd = -1;
+    char *data = nullptr;
+    size_t size = 0;
+};
+
+// Reads a shared index file in place.  The snapshot it hands out borrows
+// its tables from the mapped file, which the writer may be rewriting,
+// so whatever is read from it is only good if unchanged says so after.
+struct SharedIndexReader
+{
+    SharedIndexReader(void) {}
+    ~SharedIndexReader(void) { close(); }
+    SharedIndexReader(const SharedIndexReader&) = delete;
+    SharedIndexReader& operator=(const SharedIndexReader&) = delete;
+
+    bool open(const string& file_path);
+    void close(void);
+    // The image as it is now, valid until the next acquire.  Null when
+    // there is none under key, or the writer is busy for too long.
+    const IndexSnapshot *acquire(const string& key);
+    // True when the image has not changed since it was acquired
+    bool unchanged(void) const;
+
+private:
+    int fd = -1;
+    const char *data = nullptr;
+    size_t size = 0;
+    uint64_t sequence = 0;
+    IndexSnapshot snapshot;
+
+    bool remap(void);
+};
+
+// Indexes of the directory stacks given to cdd, kept in files so that a
+// cdd given a stack it has seen before maps the index it built then
+// rather than building it again.  A cache file holds a shared index
+// image under a key made from a hash of the stack.  A file is written
+// beside its place and renamed into it, so it never changes once a
+// reader can see it.  Stacks go to one of slot_count files by their
+// hash, which keeps the stacks of a few shells apart without letting
+// the files pile up.
+struct StackCache
+{
+    static const unsigned slot_count = 16;
+
+    // Hash of a stack as read, with its size it makes the key
+    static uint64_t hash(const char *data, size_t size);
+    static string key(uint64_t hash, size_t size);
+    // The file for a stack with hash in the directory dir
+    static string file_path(const string& dir, uint64_t hash);
+    // Write snapshot to file_path under key
+    static bool write(const string& file_path, const IndexSnapshot& snapshot, const string& key);
+
+    // The index cached in file_path under key, valid as long as the
+    // cache is.  Null when there is none.
+    const IndexSnapshot *read(const string& file_path, const string& key);
+
+private:
+    SharedIndexReader reader;
+};
+
+#endif
+
+// vim:ff=unix
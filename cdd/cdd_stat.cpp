@@ -0,0 +1,499 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include "cdd_stat.h"
+#include "cdd_util.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+
+#ifdef WIN32
+    #include <process.h>
+    #define getpid _getpid
+#else
+    #include <unistd.h>
+#endif
+
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <sys/sysmacros.h>
+    #include <linux/io_uring.h>
+#endif
+
+static StatBatch::Result stat_path(const string& path)
+{
+    StatBatch::Result result;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+    {
+        result.error = errno;
+        return result;
+    }
+    result.is_directory = (info.st_mode & S_IFMT) == S_IFDIR;
+    result.id.dev = info.st_dev;
+    result.id.ino = info.st_ino;
+    return result;
+}
+
+StatBatch::Result StatBatch::stat_one(const string& path)
+{
+    return stat_path(path);
+}
+
+void StatBatch::run(const vector<string>& paths, vector<Result>& results)
+{
+    timed_out = false;
+    if (deadline_ms > 0)
+    {
+        run_deadline(paths, results);
+        return;
+    }
+    results.assign(paths.size(), Result());
+    used_uring = engine == ENGINE_AUTO && paths.size() > 1 && run_uring(paths, results);
+    if (!used_uring)
+        run_threads(paths, results);
+}
+
+void StatBatch::run_deadline(const vector<string>& paths, vector<Result>& results)
+{
+    // Owned by the worker as much as by the caller, which may be gone
+    // by the time a hung stat returns
+    struct Shared
+    {
+        mutex lock;
+        condition_variable finished;
+        bool done = false;
+        bool used_uring = false;
+        vector<string> paths;
+        vector<Result> results;
+    };
+    auto shared = make_shared<Shared>();
+    shared->paths = paths;
+    StatBatch batch = *this;
+    batch.deadline_ms = 0;
+    thread([shared, batch]() mutable {
+        vector<Result> results;
+        batch.run(shared->paths, results);
+        lock_guard<mutex> guard(shared->lock);
+        shared->results.swap(results);
+        shared->used_uring = batch.used_uring;
+        shared->done = true;
+        shared->finished.notify_one();
+    }).detach();
+
+    unique_lock<mutex> guard(shared->lock);
+    timed_out = !shared->finished.wait_for(guard, chrono::milliseconds(deadline_ms), [&]() { return shared->done; });
+    if (timed_out)
+    {
+        results.assign(paths.size(), Result());
+        for (size_t i=0; i<results.size(); i++)
+            results[i].error = ETIMEDOUT;
+        used_uring = false;
+    }
+    else
+    {
+        results.swap(shared->results);
+        used_uring = shared->used_uring;
+    }
+}
+
+void StatBatch::run_threads(const vector<string>& paths, vector<Result>& results)
+{
+    // Enough paths for each thread to be worth starting
+    size_t count = thread_count ? thread_count : 2 * max(1u, thread::hardware_concurrency());
+    count = min(count, (paths.size() + 15) / 16);
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < paths.size(); )
+            results[i] = stat_path(paths[i]);
+    };
+    vector<thread> threads;
+    for (size_t i=1; i<count; i++)
+        threads.emplace_back(work);
+    work();
+    for (size_t i=0; i<threads.size(); i++)
+        threads[i].join();
+}
+
+#ifdef __linux__
+
+// A ring set up with the raw system calls, liburing is not needed for
+// the one operation used here
+struct Uring
+{
+    int fd = -1;
+    void *sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void *cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    ~Uring(void)
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool open(unsigned depth)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, depth, &params);
+        if (fd < 0 || !has_statx())
+            return false;
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            return false;
+        cq_ring = single_mmap ? sq_ring
+            : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+            return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        char *sq = (char *)sq_ring;
+        char *cq = (char *)cq_ring;
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq + params.sq_off.array);
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    bool has_statx(void)
+    {
+        // Kernels before 5.6 have neither the probe nor the operation
+        vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        io_uring_probe *probe = (io_uring_probe *)buffer.data();
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        return probe->last_op >= IORING_OP_STATX && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    // The entry at the tail, cleared, for the caller to fill in
+    io_uring_sqe *next_sqe(void)
+    {
+        unsigned index = *sq_tail & *sq_mask;
+        memset(&sqes[index], 0, sizeof(io_uring_sqe));
+        return &sqes[index];
+    }
+
+    // Hand the entry from next_sqe to the kernel once it is filled in,
+    // the release store makes it visible before the new tail is
+    void queue_sqe(void)
+    {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Submit what is queued and wait for at least one completion
+    bool enter(unsigned submit)
+    {
+        for (;;)
+        {
+            if (syscall(__NR_io_uring_enter, fd, submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0)
+                return true;
+            if (errno != EINTR)
+                return false;
+        }
+    }
+};
+
+bool StatBatch::has_uring(void)
+{
+    Uring ring;
+    return ring.open(1);
+}
+
+bool StatBatch::run_uring(const vector<string>& paths, vector<Result>& results)
+{
+    // Not asked again once the kernel has said no
+    static atomic<bool> unsupported(false);
+    if (unsupported)
+        return false;
+    // One statx buffer for each check in flight, the slot goes along
+    // with the path number in the user data.  They outlive the ring.
+    uint32_t depth = min<size_t>(max(queue_depth, 1u), paths.size());
+    vector<struct statx> buffers(depth);
+    vector<uint32_t> free_slots;
+    for (uint32_t slot=depth; slot-- > 0; )
+        free_slots.push_back(slot);
+    Uring ring;
+    if (!ring.open(depth))
+    {
+        unsupported = true;
+        return false;
+    }
+    size_t next = 0;
+    size_t done = 0;
+    while (done < paths.size())
+    {
+        unsigned queued = 0;
+        for (; next < paths.size() && !free_slots.empty(); next++, queued++)
+        {
+            uint32_t slot = free_slots.back();
+            free_slots.pop_back();
+            io_uring_sqe *sqe = ring.next_sqe();
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = uintptr_t(paths[next].c_str());
+            sqe->len = STATX_TYPE | STATX_INO;
+            sqe->off = uintptr_t(&buffers[slot]);
+            sqe->user_data = uint64_t(slot) << 32 | next;
+            ring.queue_sqe();
+        }
+        if (!ring.enter(queued))
+        {
+            // Not seen on a ring that works at all, check everything
+            // again rather than track what is still out
+            for (size_t i=0; i<paths.size(); i++)
+                results[i] = stat_path(paths[i]);
+            return true;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe& cqe = ring.cqes[head & *ring.cq_mask];
+            uint32_t slot = cqe.user_data >> 32;
+            Result& result = results[uint32_t(cqe.user_data)];
+            const struct statx& info = buffers[slot];
+            if (cqe.res < 0)
+                result.error = -cqe.res;
+            else
+            {
+                result.is_directory = S_ISDIR(info.stx_mode);
+                result.id.dev = makedev(info.stx_dev_major, info.stx_dev_minor);
+                result.id.ino = info.stx_ino;
+            }
+            free_slots.push_back(slot);
+            done++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+#else
+
+bool StatBatch::has_uring(void)
+{
+    return false;
+}
+
+bool StatBatch::run_uring(const vector<string>& paths, vector<Result>& results)
+{
+    return false;
+}
+
+#endif
+
+//----------------------------------------------------------------------
+
+static const char identity_magic[] = "cdd-identity 2";
+
+string IdentityCache::default_path(void)
+{
+    string dir = get_environment("XDG_RUNTIME_DIR");
+    return dir.empty() ? string() : dir + "/cdd-identity.cache";
+}
+
+// One line per entry: dev ino checked path
+bool IdentityCache::load(const string& file_path)
+{
+    entries.clear();
+    changed = false;
+    FILE *file = fopen(file_path.c_str(), "r");
+    if (!file)
+        return false;
+    char line[4096 + 128];
+    bool valid = fgets(line, sizeof(line), file) && string(line) == string(identity_magic) + "\n";
+    while (valid && fgets(line, sizeof(line), file))
+    {
+        unsigned long long dev, ino;
+        long long checked;
+        int offset = 0;
+        size_t size = strlen(line);
+        if (size == 0 || line[size-1] != '\n')
+            continue;
+        line[size-1] = '\0';
+        if (sscanf(line, "%llu %llu %lld %n", &dev, &ino, &checked, &offset) != 3 || offset == 0)
+            continue;
+        Entry& entry = entries[line + offset];
+        entry.id.dev = dev;
+        entry.id.ino = ino;
+        entry.checked = checked;
+    }
+    fclose(file);
+    return valid;
+}
+
+bool IdentityCache::save(const string& file_path)
+{
+    // The entries of this run, and as many of the others as were most
+    // recently checked
+    vector<pair<int64_t, const string *>> extra;
+    for (auto it=entries.begin(); it!=entries.end(); ++it)
+    {
+        if (!it->second.current)
+            extra.push_back(make_pair(-it->second.checked, &it->first));
+    }
+    if (extra.size() > max_extra)
+    {
+        nth_element(extra.begin(), extra.begin() + max_extra, extra.end());
+        for (size_t i=max_extra; i<extra.size(); i++)
+            entries.erase(*extra[i].second);
+    }
+
+    // Written whole and renamed into place, a reader sees the old file
+    // or the new one
+    string temp_path = file_path + ".tmp" + to_string(getpid());
+    FILE *file = fopen(temp_path.c_str(), "w");
+    if (!file)
+        return false;
+    fprintf(file, "%s\n", identity_magic);
+    for (auto it=entries.begin(); it!=entries.end(); ++it)
+    {
+        if (it->first.find('\n') != string::npos || it->first.size() > 4096)
+            continue;
+        const Entry& entry = it->second;
+        fprintf(file, "%llu %llu %lld %s\n", (unsigned long long)entry.id.dev, (unsigned long long)entry.id.ino,
+                (long long)entry.checked, it->first.c_str());
+    }
+    bool ok = fclose(file) == 0 && rename(temp_path.c_str(), file_path.c_str()) == 0;
+    if (!ok)
+        remove(temp_path.c_str());
+    changed = !ok;
+    return ok;
+}
+
+void IdentityCache::resolve(const vector<string>& paths, const StatPaths& stat_paths, int64_t now, vector<FileId>& ids)
+{
+    // Paths not in the cache, or not checked for too long, are resolved
+    // in one batch
+    vector<Entry*> found(paths.size(), nullptr);
+    vector<size_t> which;
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        auto it = entries.find(paths[i]);
+        if (it == entries.end() || now - it->second.checked >= max_age)
+            which.push_back(i);
+        else
+            found[i] = &it->second;
+    }
+    check(paths, which, stat_paths, now, found);
+
+    // Then the cached paths that a merge would rest on, until every
+    // directory reached by more than one path is current
+    for (;;)
+    {
+        map<FileId, vector<size_t>> groups;
+        for (size_t i=0; i<paths.size(); i++)
+        {
+            if (found[i])
+                groups[found[i]->id].push_back(i);
+        }
+        which.clear();
+        for (auto it=groups.begin(); it!=groups.end(); ++it)
+        {
+            for (size_t k=0; it->second.size()>1 && k<it->second.size(); k++)
+            {
+                if (!found[it->second[k]]->current)
+                    which.push_back(it->second[k]);
+            }
+        }
+        if (which.empty())
+            break;
+        check(paths, which, stat_paths, now, found);
+    }
+
+    ids.assign(paths.size(), FileId());
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        if (found[i])
+            ids[i] = found[i]->id;
+    }
+}
+
+void IdentityCache::check(const vector<string>& paths, const vector<size_t>& which, const StatPaths& stat_paths,
+                          int64_t now, vector<Entry*>& found)
+{
+    if (which.empty())
+        return;
+    vector<string> batch;
+    for (size_t k=0; k<which.size(); k++)
+        batch.push_back(paths[which[k]]);
+    vector<StatBatch::Result> results;
+    stat_paths(batch, results);
+    for (size_t k=0; k<which.size(); k++)
+    {
+        size_t i = which[k];
+        const StatBatch::Result& result = results[k];
+        changed = true;
+        if (result.error != 0 || !result.is_directory || !result.id.valid())
+        {
+            entries.erase(paths[i]);
+            found[i] = nullptr;
+            continue;
+        }
+        // What the cache held goes, whatever it was
+        Entry& entry = entries[paths[i]];
+        entry.id = result.id;
+        entry.checked = now;
+        entry.current = true;
+        found[i] = &entry;
+    }
+}
+
+// vim:ff=unix
@@ -0,0 +1,144 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CDD_STAT_H
+#define CDD_STAT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <cstdint>
+#include <cerrno>
+using namespace std;
+
+// Identity of a file, the same by any path that reaches it through a
+// symlink or a bind mount
+struct FileId
+{
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+
+    bool valid(void) const { return ino != 0; }
+    bool operator==(const FileId& obj) const { return dev == obj.dev && ino == obj.ino; }
+    bool operator!=(const FileId& obj) const { return !(*this == obj); }
+    bool operator<(const FileId& obj) const { return dev < obj.dev || (dev == obj.dev && ino < obj.ino); }
+};
+
+// Checks whether many paths are directories in one sweep.  A stat can
+// block for a long time on a cold disk or a network file system, so
+// rather than one after the other the checks are all put in flight at
+// once: through io_uring with IORING_OP_STATX where the kernel has it,
+// otherwise spread over a pool of threads.
+struct StatBatch
+{
+    enum Engine
+    {
+        ENGINE_AUTO,    // io_uring when the kernel has it, else threads
+        ENGINE_THREADS, // a pool of threads calling stat
+    };
+
+    struct Result
+    {
+        int error = 0;  // errno of the stat, 0 when it worked
+        bool is_directory = false;
+        FileId id;
+
+        // Known not to be a directory.  A path that could not be checked,
+        // for want of permission or an I/O error, is not counted as gone.
+        bool gone(void) const
+        {
+            return error == ENOENT || error == ENOTDIR || (error == 0 && !is_directory);
+        }
+    };
+
+    Engine engine = ENGINE_AUTO;
+    // Threads in the pool, 0 for twice the number of cores
+    unsigned thread_count = 0;
+    // Checks in flight at once through io_uring
+    unsigned queue_depth = 256;
+    // Whether the last sweep went through io_uring
+    bool used_uring = false;
+    // Longest wait for the sweep, 0 for no limit.  With a limit the sweep
+    // runs on a worker thread, and when it is not done in time every
+    // path is left with ETIMEDOUT and the worker finishes on its own.
+    unsigned deadline_ms = 0;
+    bool timed_out = false;
+
+    void run(const vector<string>& paths, vector<Result>& results);
+    static Result stat_one(const string& path);
+    static bool has_uring(void);
+
+private:
+    void run_deadline(const vector<string>& paths, vector<Result>& results);
+    bool run_uring(const vector<string>& paths, vector<Result>& results);
+    void run_threads(const vector<string>& paths, vector<Result>& results);
+};
+
+// Identities of directories by path, kept from one run to the next in a
+// file.  A directory reached by many paths is only resolved once a run,
+// and one that is not the same as any other costs no stat at all once it
+// is in the cache.
+//
+// Only identities that are current are merged: when the cache has two
+// paths as one directory, or a path as the same directory as one just
+// resolved, the cached paths are stat'ed again and their entries replaced
+// with what is found, so a directory removed, or made again under the
+// same inode number, is not merged by what the cache held.  A cached path
+// that merges with nothing is trusted as it is, so one that has since
+// become another directory's alias is not merged until its entry is
+// resolved again, which is at least once every max_age seconds.
+struct IdentityCache
+{
+    struct Entry
+    {
+        FileId id;
+        // When it was last resolved, seconds since the epoch
+        int64_t checked = 0;
+        // Resolved or checked in this run
+        bool current = false;
+    };
+    static const int64_t max_age = 24 * 60 * 60;
+    // Entries kept beyond those used in a run
+    static const size_t max_extra = 65536;
+    // Checks a batch of paths, see StatBatch::run
+    typedef function<void(const vector<string>&, vector<StatBatch::Result>&)> StatPaths;
+
+    map<string, Entry> entries;
+    bool changed = false;
+
+    // The file in XDG_RUNTIME_DIR, as device numbers only hold until the
+    // next boot.  Empty when there is no such directory.
+    static string default_path(void);
+    bool load(const string& file_path);
+    bool save(const string& file_path);
+    // Identity of each path, not valid for a path that is not there
+    void resolve(const vector<string>& paths, const StatPaths& stat_paths, int64_t now, vector<FileId>& ids);
+
+private:
+    void check(const vector<string>& paths, const vector<size_t>& which, const StatPaths& stat_paths,
+               int64_t now, vector<Entry*>& found);
+};
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,656 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include "cdd_store.h"
+#include <cstring>
+#include <cstdio>
+#include <unordered_map>
+#include <algorithm>
+
+#include <ctime>
+
+#ifdef WIN32
+    #include <io.h>
+    #include <fcntl.h>
+    #include <process.h>
+    #define getpid _getpid
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/file.h>
+#endif
+
+const char HistoryStore::magic[8] = {'C', 'D', 'D', 'S', 'T', 'O', 'R', 'E'};
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~uint64_t(7);
+}
+
+// CRC-32 as used by zlib
+static uint32_t crc32(uint32_t crc, const void *data, size_t size)
+{
+    static const struct Table
+    {
+        uint32_t entries[256];
+        Table(void)
+        {
+            for (uint32_t i=0; i<256; i++)
+            {
+                uint32_t c = i;
+                for (int k=0; k<8; k++)
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                entries[i] = c;
+            }
+        }
+    } table;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    for (size_t i=0; i<size; i++)
+        crc = table.entries[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const LogRecord& record, const char *dir)
+{
+    uint32_t crc = crc32(0, &record.size, sizeof(record.size));
+    crc = crc32(crc, &record.time, sizeof(record.time));
+    return crc32(crc, dir, record.size);
+}
+
+bool MappedFile::map(const string& file_path)
+{
+    unmap();
+#ifdef WIN32
+    ifstream strm(file_path, ios::binary);
+    if (!strm)
+        return false;
+    buffer.assign(istreambuf_iterator<char>(strm), istreambuf_iterator<char>());
+    // Not null even when empty, the file is there
+    buffer.push_back('\0');
+    data = buffer.data();
+    size = buffer.size() - 1;
+#else
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    inode = st.st_ino;
+    mtime = st.st_mtime;
+    // An empty file cannot be mapped, it is still there
+    static const char empty = '\0';
+    void *p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : const_cast<char *>(&empty);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        size = 0;
+        return false;
+    }
+    data = static_cast<const char *>(p);
+#endif
+    return true;
+}
+
+void MappedFile::unmap(void)
+{
+#ifdef WIN32
+    buffer.clear();
+#else
+    if (data && size)
+        munmap(const_cast<char *>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+    inode = 0;
+    mtime = 0;
+}
+
+bool HistoryStore::open(const string& file_path)
+{
+    close();
+    // Map the log first, anything appended after the snapshot was
+    // written is then sure to be in it
+    log_file.map(log_path(file_path));
+    if (snapshot.map(file_path))
+    {
+        // Only the layout is checked here, each entry is checked as it is
+        // read so that opening does not touch the whole file
+        size_t size = snapshot.size;
+        if (size >= sizeof(StoreHeader))
+            memcpy(&header, snapshot.data, sizeof(header));
+        if (size < sizeof(StoreHeader)
+            || memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version
+            || header.heap_offset > size || header.heap_size > size - header.heap_offset
+            || header.paths_offset > size || header.path_count > (size - header.paths_offset) / sizeof(StorePath)
+            || header.steps_offset > size || header.step_count > (size - header.steps_offset) / sizeof(StoreStep)
+            || header.block_count != (header.step_count + block_size - 1) / block_size
+            || header.blocks_offset > size || header.block_count > (size - header.blocks_offset) / sizeof(StoreBlock))
+        {
+            // The log is still read, compaction replaces the snapshot
+            snapshot.unmap();
+            damaged = true;
+            header = StoreHeader();
+            read_log(0);
+            return false;
+        }
+    }
+    // A log shorter than the snapshot says was started again
+    read_log(header.log_offset <= log_file.size ? header.log_offset : 0);
+    return is_open();
+}
+
+void HistoryStore::close(void)
+{
+    snapshot.unmap();
+    log_file.unmap();
+    log.clear();
+    recorded.clear();
+    damaged = false;
+    log_begin = 0;
+    log_size = 0;
+    header = StoreHeader();
+}
+
+void HistoryStore::read_log(uint64_t offset)
+{
+    const char *data = log_file.data;
+    uint64_t size = log_file.size;
+    log_begin = offset;
+    log_size = size;
+    while (offset + sizeof(LogRecord) <= size)
+    {
+        LogRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        const char *dir = data + offset + sizeof(record);
+        if (record.marker == log_marker && record.size <= size - offset - sizeof(record)
+            && record.crc == record_crc(record, dir))
+        {
+            log.push_back(LogVisit{string_view(dir, record.size), record.time});
+            offset += sizeof(record) + record.size;
+            continue;
+        }
+        // A torn record, look for the start of the next one
+        const char *next = static_cast<const char *>(memchr(data + offset + 1, log_marker & 0xFF, size - offset - 1));
+        if (!next)
+            break;
+        offset = next - data;
+    }
+}
+
+StorePath HistoryStore::path_entry(uint32_t id) const
+{
+    StorePath entry = StorePath();
+    if (id < header.path_count)
+        memcpy(&entry, snapshot.data + header.paths_offset + id * sizeof(StorePath), sizeof(entry));
+    return entry;
+}
+
+string_view HistoryStore::path(uint32_t id) const
+{
+    if (id >= header.path_count)
+        return string_view();
+    StorePath entry = path_entry(id);
+    if (uint64_t(entry.offset) + entry.size > header.heap_size)
+        return string_view();
+    return string_view(snapshot.data + header.heap_offset + entry.offset, entry.size);
+}
+
+string_view HistoryStore::stack(uint64_t i, uint32_t& weight) const
+{
+    double frecency;
+    return stack(i, weight, frecency);
+}
+
+// The share of the score of a directory that one of its steps stands for,
+// see compact.  A directory visited more than once has a step of weight 1
+// at its first visit, and a step for the rest at its last.
+static double step_frecency(const StorePath& entry, uint32_t weight)
+{
+    double total = HistoryStore::frecency_at(entry.last_time) + entry.frecency;
+    double first = HistoryStore::frecency_at(entry.first_time);
+    if (entry.count <= 1)
+        return total;
+    // Both steps have weight 1, so they share the score equally
+    if (entry.count == 2)
+        return total - log(2.0);
+    if (weight == 1 || first >= total)
+        return first;
+    // log(exp(total) - exp(first))
+    return total + log1p(-exp(first - total));
+}
+
+string_view HistoryStore::stack(uint64_t i, uint32_t& weight, double& frecency) const
+{
+    weight = 1;
+    frecency = 0;
+    if (i < log.size())
+    {
+        const LogVisit& visit = log[log.size() - 1 - i];
+        frecency = frecency_at(visit.time);
+        return visit.dir;
+    }
+    i -= log.size();
+    if (i >= header.step_count)
+        return string_view();
+    StoreStep entry = step(i);
+    weight = entry.weight;
+    if (!weight)
+        return string_view();
+    frecency = step_frecency(path_entry(entry.path), weight);
+    return path(entry.path);
+}
+
+StoreStep HistoryStore::step(uint64_t i) const
+{
+    // A step past the end has no weight, as a damaged one does
+    StoreStep result = StoreStep();
+    if (i < header.step_count)
+        memcpy(&result, snapshot.data + header.steps_offset + i * sizeof(StoreStep), sizeof(result));
+    return result;
+}
+
+int64_t HistoryStore::stack_time(uint64_t i) const
+{
+    if (i < log.size())
+        return log[log.size() - 1 - i].time;
+    return step(i - log.size()).time;
+}
+
+uint64_t HistoryStore::next_since(uint64_t i, int64_t since) const
+{
+    // The log is never much more than compact_threshold, and only it is
+    // read one visit at a time
+    for (; i < log.size(); i++)
+    {
+        if (log[log.size() - 1 - i].time >= since)
+            return i;
+    }
+    uint64_t j = i - log.size();
+    while (j < header.step_count)
+    {
+        StoreBlock block;
+        memcpy(&block, snapshot.data + header.blocks_offset + j / block_size * sizeof(StoreBlock), sizeof(block));
+        // Nothing from here down is recent enough
+        if (block.max_time < since)
+            break;
+        if (block.min_time >= since)
+            return log.size() + j;
+        // The window starts in this block
+        uint64_t end = min((j / block_size + 1) * block_size, header.step_count);
+        for (; j < end; j++)
+        {
+            if (step(j).time >= since)
+                return log.size() + j;
+        }
+    }
+    return stack_size();
+}
+
+StoreState HistoryStore::state(void) const
+{
+    StoreState result;
+    result.has_snapshot = snapshot.data != nullptr;
+    result.snapshot_inode = snapshot.inode;
+    result.snapshot_mtime = snapshot.mtime;
+    result.has_log = log_file.data != nullptr;
+    result.log_inode = log_file.inode;
+    result.log_size = log_size;
+    return result;
+}
+
+StoreState HistoryStore::current_state(const string& file_path)
+{
+    StoreState result;
+#ifndef WIN32
+    struct stat st;
+    if (stat(file_path.c_str(), &st) == 0)
+    {
+        result.has_snapshot = true;
+        result.snapshot_inode = st.st_ino;
+        result.snapshot_mtime = st.st_mtime;
+    }
+    if (stat(log_path(file_path).c_str(), &st) == 0)
+    {
+        result.has_log = true;
+        result.log_inode = st.st_ino;
+        result.log_size = st.st_size;
+    }
+#endif
+    return result;
+}
+
+bool HistoryStore::changed(const string& file_path) const
+{
+#ifdef WIN32
+    return true;
+#else
+    return !(current_state(file_path) == state());
+#endif
+}
+
+bool HistoryStore::append(const string& file_path, const string& dir, int64_t time, uint64_t *end)
+{
+    LogRecord record = LogRecord();
+    record.marker = log_marker;
+    record.size = dir.size();
+    record.time = time;
+    record.crc = record_crc(record, dir.data());
+    string buffer(reinterpret_cast<const char *>(&record), sizeof(record));
+    buffer += dir;
+
+    // One write to a file opened for append, the record lands whole
+    // after whatever the other shells have added
+    string path = log_path(file_path);
+#ifdef WIN32
+    int fd = _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd < 0)
+        return false;
+    bool result = _write(fd, buffer.data(), unsigned(buffer.size())) == int(buffer.size());
+    if (end)
+        *end = _telli64(fd);
+    _close(fd);
+#else
+    int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return false;
+    bool result = ::write(fd, buffer.data(), buffer.size()) == ssize_t(buffer.size());
+    if (end)
+        *end = lseek(fd, 0, SEEK_CUR);
+    ::close(fd);
+#endif
+    return result;
+}
+
+bool HistoryStore::record(const string& file_path, const string& dir)
+{
+    int64_t now = ::time(nullptr);
+    uint64_t end = 0;
+    bool result = append(file_path, dir, now, &end);
+    // When nothing else was added to the log since it was read the
+    // visit is kept in memory, otherwise the log is read again
+    uint64_t size = sizeof(LogRecord) + dir.size();
+    StoreState current = current_state(file_path);
+    if (result && log_file.data && end == log_size + size && current.has_snapshot == (snapshot.data != nullptr)
+        && current.snapshot_inode == snapshot.inode && current.snapshot_mtime == snapshot.mtime)
+    {
+        recorded.push_back(dir);
+        log.push_back(LogVisit{recorded.back(), now});
+        log_size = end;
+        return true;
+    }
+    open(file_path);
+    return result;
+}
+
+// Held while a compaction runs.  Concurrent compactions would each
+// write a consistent snapshot, but one could release the log that the
+// snapshot of the other still needs.
+struct CompactLock
+{
+    int fd = -1;
+
+    bool acquire(const string& file_path, bool wait)
+    {
+#ifndef WIN32
+        fd = ::open((file_path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0)
+            return false;
+        if (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0)
+        {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    ~CompactLock(void)
+    {
+#ifndef WIN32
+        if (fd >= 0)
+            ::close(fd);
+#endif
+    }
+};
+
+bool HistoryStore::compact(const string& file_path, function<bool(string_view)> keep, bool wait, string *warning)
+{
+    CompactLock lock;
+    if (!lock.acquire(file_path, wait))
+        return false;
+    HistoryStore store;
+    store.open(file_path);
+    if (store.damaged)
+    {
+        // The new snapshot is built from the log alone.  Once a compaction
+        // has given back the start of the log, the older history is only
+        // in the damaged snapshot, which is then kept rather than replaced.
+        LogRecord record;
+        const char *data = store.log_file.data;
+        bool whole = store.log_file.size >= sizeof(record);
+        if (whole)
+        {
+            memcpy(&record, data, sizeof(record));
+            whole = record.marker == log_marker && record.size <= store.log_file.size - sizeof(record)
+                && record.crc == record_crc(record, data + sizeof(record));
+        }
+        if (!whole)
+        {
+            string damaged_path = file_path + ".damaged";
+#ifdef WIN32
+            remove(damaged_path.c_str());
+#endif
+            if (rename(file_path.c_str(), damaged_path.c_str()) != 0)
+            {
+                if (warning)
+                    *warning = "History store is damaged and its log does not hold all of it: " + file_path;
+                return false;
+            }
+            if (warning)
+                *warning = "History store is damaged, the history only it held is kept in " + damaged_path;
+        }
+    }
+
+    struct Summary
+    {
+        string_view dir;
+        StorePath entry;
+    };
+    vector<Summary> summaries;
+    unordered_map<string_view, size_t> numbers;
+    for (uint32_t id=0; id<store.path_count(); id++)
+    {
+        string_view dir = store.path(id);
+        StorePath entry = store.path_entry(id);
+        // Skip over any damaged entry
+        if (dir.empty() || entry.count == 0 || !numbers.insert(make_pair(dir, summaries.size())).second)
+            continue;
+        summaries.push_back(Summary{dir, entry});
+    }
+    const vector<LogVisit>& log = store.log_visits();
+    for (size_t i=0; i<log.size(); i++)
+    {
+        uint64_t seq = store.header.visit_count + i;
+        auto result = numbers.insert(make_pair(log[i].dir, summaries.size()));
+        if (result.second)
+        {
+            StorePath entry = StorePath();
+            entry.first_seq = seq;
+            entry.first_time = log[i].time;
+            summaries.push_back(Summary{log[i].dir, entry});
+        }
+        StorePath& entry = summaries[result.first->second].entry;
+        // The score is kept as of the last visit, so each visit ages it
+        // by the time since the one before
+        if (entry.count)
+            entry.frecency = PathIndex::log_add(entry.frecency - frecency_rate * (log[i].time - entry.last_time), 0);
+        else
+            entry.frecency = 0;
+        entry.count++;
+        entry.last_seq = seq;
+        entry.last_time = log[i].time;
+    }
+    if (keep)
+    {
+        summaries.erase(remove_if(summaries.begin(), summaries.end(),
+            [&keep](const Summary& summary) { return !keep(summary.dir); }), summaries.end());
+    }
+    sort(summaries.begin(), summaries.end(), [](const Summary& a, const Summary& b) {
+        return a.entry.first_seq < b.entry.first_seq;
+    });
+
+    // A directory visited more than once is a step at its last visit
+    // standing for all but the first, and a step at its first visit
+    string heap;
+    vector<StorePath> paths;
+    vector<pair<uint64_t, StoreStep>> steps;
+    for (size_t i=0; i<summaries.size(); i++)
+    {
+        StorePath entry = summaries[i].entry;
+        entry.offset = heap.size();
+        entry.size = summaries[i].dir.size();
+        heap += summaries[i].dir;
+        heap += '\0';
+        paths.push_back(entry);
+        uint32_t id = i;
+        steps.push_back(make_pair(entry.last_seq, StoreStep{id, entry.count > 1 ? entry.count - 1 : 1, entry.last_time}));
+        if (entry.count > 1)
+            steps.push_back(make_pair(entry.first_seq, StoreStep{id, 1, entry.first_time}));
+    }
+    sort(steps.begin(), steps.end(), [](const pair<uint64_t, StoreStep>& a, const pair<uint64_t, StoreStep>& b) {
+        return a.first > b.first;
+    });
+    // Filled from the bottom of the stack up, each block takes the latest
+    // time of those below it
+    vector<StoreBlock> blocks((steps.size() + block_size - 1) / block_size);
+    int64_t max_time = INT64_MIN;
+    for (size_t i=steps.size(); i-- > 0; )
+    {
+        StoreBlock& block = blocks[i / block_size];
+        if (i % block_size == block_size - 1 || i == steps.size() - 1)
+            block.min_time = INT64_MAX;
+        block.min_time = min(block.min_time, steps[i].second.time);
+        max_time = max(max_time, steps[i].second.time);
+        block.max_time = max_time;
+    }
+
+    StoreHeader header = StoreHeader();
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.path_count = paths.size();
+    header.visit_count = store.visit_count();
+    header.heap_offset = align8(sizeof(header));
+    header.heap_size = heap.size();
+    header.paths_offset = align8(header.heap_offset + header.heap_size);
+    header.steps_offset = align8(header.paths_offset + paths.size() * sizeof(StorePath));
+    header.step_count = steps.size();
+    header.log_offset = store.log_file.size;
+    header.blocks_offset = align8(header.steps_offset + steps.size() * sizeof(StoreStep));
+    header.block_count = blocks.size();
+
+    // Written beside the store and renamed over it, so a reader sees
+    // either the old store or the new one
+    string temp_path = file_path + ".tmp" + to_string(getpid());
+    {
+        ofstream strm(temp_path, ios::binary | ios::trunc);
+        auto pad = [&strm](uint64_t offset) {
+            while (uint64_t(strm.tellp()) < offset)
+                strm.put('\0');
+        };
+        strm.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        pad(header.heap_offset);
+        strm.write(heap.data(), heap.size());
+        pad(header.paths_offset);
+        strm.write(reinterpret_cast<const char *>(paths.data()), paths.size() * sizeof(StorePath));
+        pad(header.steps_offset);
+        for (size_t i=0; i<steps.size(); i++)
+            strm.write(reinterpret_cast<const char *>(&steps[i].second), sizeof(StoreStep));
+        pad(header.blocks_offset);
+        strm.write(reinterpret_cast<const char *>(blocks.data()), blocks.size() * sizeof(StoreBlock));
+        if (!strm.flush())
+        {
+            strm.close();
+            remove(temp_path.c_str());
+            return false;
+        }
+    }
+#ifdef WIN32
+    // rename does not replace an existing file on Windows
+    remove(file_path.c_str());
+#endif
+    if (rename(temp_path.c_str(), file_path.c_str()) != 0)
+    {
+        remove(temp_path.c_str());
+        return false;
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // Give back the space of the log that the replaced snapshot already
+    // held.  The log keeps its size, so the offsets in it stay good and
+    // shells keep appending without noticing.  A reader that opened the
+    // replaced snapshot may still be reading the log after it.
+    uint64_t release = store.header.log_offset & ~uint64_t(4095);
+    if (release > 0)
+    {
+        int fd = ::open(log_path(file_path).c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, release);
+            ::close(fd);
+        }
+    }
+#endif
+    return true;
+}
+
+void HistoryStore::compact_background(const string& file_path)
+{
+#ifdef WIN32
+    compact(file_path, nullptr, false);
+#else
+    pid_t pid = fork();
+    if (pid != 0)
+        return;
+    // Let go of the shell's pipes so that it does not wait on the
+    // compaction, and of its terminal
+    setsid();
+    int null_fd = ::open("/dev/null", O_RDWR);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+    }
+    _exit(compact(file_path, nullptr, false) ? 0 : 1);
+#endif
+}
+
+// vim:ff=unix
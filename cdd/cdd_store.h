@@ -0,0 +1,266 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CDD_STORE_H
+#define CDD_STORE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <functional>
+using namespace std;
+
+// Persistent history of visited directories, kept in files of its own
+// rather than in the shell's directory stack.
+//
+// New visits go to the log in FILE.log.  Each visit is one LogRecord
+// and its directory, added with a single write to a file opened for
+// append, so any number of shells can record at once without a lock and
+// without waiting on each other.  Each record carries its length and a
+// CRC, a reader skips a record that was torn by a writer that died and
+// finds the next one by its marker.
+//
+// Compaction folds the log into the snapshot in FILE, which is mapped
+// into memory and read in place, so opening it costs the same however
+// long the history is, and only the pages that are used are ever read.
+//
+//     StoreHeader
+//     string heap: each distinct directory followed by a NUL
+//     path table: a StorePath for each distinct directory, oldest first
+//     step table: a StoreStep for each first and last visit, newest first
+//     block table: a StoreBlock for each block_size steps
+//
+// The steps read as a directory stack in which repeated visits are
+// folded into one step with a weight, which keeps the orders of first
+// and last visits and the visit counts of the full history.  The blocks
+// index the steps by time, so a query for the visits since some time
+// passes over the blocks that hold none without reading their steps.
+// Sections start on 8 byte boundaries.  Numbers are in the byte order of the
+// machine that wrote the file.
+//
+// The history is the snapshot followed by the log from log_offset on.
+struct StoreHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t path_count;
+    // Visits in the snapshot, the sequence number of the next visit
+    uint64_t visit_count;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    uint64_t paths_offset;
+    uint64_t steps_offset;
+    uint64_t step_count;
+    // The part of the log already in the snapshot
+    uint64_t log_offset;
+    uint64_t blocks_offset;
+    uint64_t block_count;
+};
+
+struct StorePath
+{
+    uint32_t offset;    // in the string heap
+    uint32_t size;
+    uint32_t count;
+    // Log of the decayed visits, see HistoryStore::frecency_rate, as of
+    // the last visit.  Stores from before it was kept hold 0, the last
+    // visit alone, and those from when visits decayed by count hold that
+    // score until the directory is visited again.
+    float frecency;
+    uint64_t first_seq;
+    uint64_t last_seq;
+    int64_t first_time; // seconds since the epoch
+    int64_t last_time;
+};
+
+struct StoreStep
+{
+    uint32_t path;
+    uint32_t weight;
+    int64_t time;       // of the visit the step is at
+};
+
+struct StoreBlock
+{
+    // The earliest visit in the block
+    int64_t min_time;
+    // The latest visit in the block or any block after it, so that it
+    // only falls going down the stack even when the clock went back
+    int64_t max_time;
+};
+
+struct LogRecord
+{
+    uint32_t marker;
+    uint32_t size;      // of the directory that follows
+    uint32_t crc;       // of size, time and the directory
+    uint32_t flags;
+    int64_t time;       // seconds since the epoch
+};
+
+// Tells one state of the files of a store from another.  A compaction
+// renames a new snapshot over the old one, a visit grows the log.
+struct StoreState
+{
+    bool has_snapshot = false;
+    uint64_t snapshot_inode = 0;
+    int64_t snapshot_mtime = 0;
+    bool has_log = false;
+    uint64_t log_inode = 0;
+    uint64_t log_size = 0;
+
+    bool operator==(const StoreState& obj) const
+    {
+        return has_snapshot == obj.has_snapshot && snapshot_inode == obj.snapshot_inode
+            && snapshot_mtime == obj.snapshot_mtime && has_log == obj.has_log
+            && log_inode == obj.log_inode && log_size == obj.log_size;
+    }
+};
+
+// Read only view of a whole file
+struct MappedFile
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    // Tells one version of the file from another
+    uint64_t inode = 0;
+    int64_t mtime = 0;
+
+    MappedFile(void) {}
+    ~MappedFile(void) { unmap(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool map(const string& file_path);
+    void unmap(void);
+
+private:
+#ifdef WIN32
+    vector<char> buffer;
+#endif
+};
+
+struct HistoryStore
+{
+    static const char magic[8];
+    static const uint32_t version = 4;
+    static const uint32_t log_marker = 0x56444443;     // "CDDV"
+    // Size of the log past the snapshot at which it is compacted
+    static const uint64_t compact_threshold = 256 * 1024;
+    // Steps in each block of the time index
+    static const uint64_t block_size = 256;
+    // The store knows when each visit was, so frecent scores decay with
+    // time rather than by visits as a shell's stack does, see PathIndex.
+    // A visit counts half as much a week later.  Times are counted from
+    // a fixed epoch, which keeps the logs of the scores small.
+    static constexpr double frecency_half_life = 7 * 24 * 60 * 60;
+    static constexpr double frecency_rate = 0.69314718055994531 / frecency_half_life;
+    static const int64_t frecency_epoch = 1600000000;
+    // Log of the weight of a visit at time, seconds since the epoch
+    static double frecency_at(int64_t time) { return frecency_rate * (time - frecency_epoch); }
+
+    struct LogVisit
+    {
+        string_view dir;
+        int64_t time;
+    };
+
+    HistoryStore(void) {}
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    static string log_path(const string& file_path) { return file_path + ".log"; }
+
+    // Map the store in file_path and its log, false if there is neither
+    // or the snapshot is not a store
+    bool open(const string& file_path);
+    void close(void);
+    bool is_open(void) const { return snapshot.data != nullptr || log_file.data != nullptr; }
+    // There is a snapshot, but it failed its check and only the log is read
+    bool snapshot_damaged(void) const { return damaged; }
+
+    uint32_t path_count(void) const { return header.path_count; }
+    uint64_t visit_count(void) const { return header.visit_count + log.size(); }
+    // Empty for a damaged entry
+    string_view path(uint32_t id) const;
+    StorePath path_entry(uint32_t id) const;
+    // The history as a directory stack, top first, with the number of
+    // visits each step stands for.  Empty for a damaged entry.
+    uint64_t stack_size(void) const { return log.size() + header.step_count; }
+    string_view stack(uint64_t i, uint32_t& weight) const;
+    // Also the log of the decayed weight of the visits, see frecency_at
+    string_view stack(uint64_t i, uint32_t& weight, double& frecency) const;
+    // Time of the visit at step i, seconds since the epoch
+    int64_t stack_time(uint64_t i) const;
+    // The first step from i on with a visit at or after since, or
+    // stack_size() when there is none
+    uint64_t next_since(uint64_t i, int64_t since) const;
+    // Visits in the log past the snapshot, oldest first
+    const vector<LogVisit>& log_visits(void) const { return log; }
+    // Size of the log past the snapshot
+    uint64_t log_tail(void) const { return log_size - log_begin; }
+    // The files of the store as they were read, and as they are now
+    StoreState state(void) const;
+    static StoreState current_state(const string& file_path);
+    // True when another process has changed the store since it was
+    // opened, and it has to be opened again to be current
+    bool changed(const string& file_path) const;
+
+    // Append a visit to the log of the store in file_path, end is set
+    // to the size of the log just after the visit
+    static bool append(const string& file_path, const string& dir, int64_t time, uint64_t *end=nullptr);
+    // Append a visit and bring the store up to date
+    bool record(const string& file_path, const string& dir);
+    // Fold the log of the store in file_path into a new snapshot that
+    // replaces the old one in one step, leaving out directories that
+    // keep rejects.  Only one compaction runs at a time, unless wait is
+    // set a compaction that finds another running does nothing and
+    // returns false.  A damaged snapshot whose history the log no longer
+    // holds from its start is kept beside the store in FILE.damaged, and
+    // warning tells of it.
+    static bool compact(const string& file_path, function<bool(string_view)> keep=nullptr, bool wait=true,
+                        string *warning=nullptr);
+    // Compact without keeping the caller waiting
+    static void compact_background(const string& file_path);
+
+private:
+    StoreHeader header = StoreHeader();
+    MappedFile snapshot;
+    MappedFile log_file;
+    bool damaged = false;
+    uint64_t log_begin = 0;
+    // The log as far as it has been read or recorded
+    uint64_t log_size = 0;
+    vector<LogVisit> log;
+    // Directories recorded since the log was mapped, a deque so that
+    // the views in the log stay good
+    deque<string> recorded;
+
+    void read_log(uint64_t offset);
+    StoreStep step(uint64_t i) const;
+};
+
+#endif
+
+// vim:ff=unix
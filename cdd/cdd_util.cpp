@@ -27,6 +27,7 @@ along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
     #include <direct.h>
     #define MAX_PATH_LENGTH _MAX_PATH
     #define getcwd _getcwd
+    #define chdir _chdir
 #else
     #include <unistd.h>
     #include <sys/param.h>
@@ -39,6 +40,11 @@ std::string get_working_path()
    return ( getcwd(temp, sizeof(temp)) ? std::string( temp ) : std::string("") );
 }
 
+bool set_working_path(const std::string& path)
+{
+    return chdir(path.c_str()) == 0;
+}
+
 std::string get_environment(std::string var_name)
 {
     std::string result;
@@ -1,4 +1,5 @@
 #pragma once
 
 std::string get_working_path();
+bool set_working_path(const std::string& path);
 std::string get_environment(std::string var_name);
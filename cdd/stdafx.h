@@ -23,6 +23,8 @@
 #include <sstream>
 #include <vector>
 #include <iterator>
+#include <limits>
+#include <algorithm>
 // #include <experimental/filesystem>
 
 // vim:ff=unix
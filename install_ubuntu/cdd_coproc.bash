@@ -0,0 +1,48 @@
+# cd deluxe with _cdd running as a bash coprocess.
+#
+# _cdd is started once per shell with "_cdd --coproc" and stays running,
+# so a cdd costs no fork or exec.  Each call sends the arguments, the
+# working directory, CDD_OPTIONS and the directory stack, written by the
+# dirs builtin straight into the coprocess.  See INSTALL.
+#
+# bash rebuilds DIRSTACK on every use, so working out in the shell which
+# entries changed would cost more than sending them all.
+#
+# Source this from ~/.bashrc, setting cdd_exe first if _cdd is not in
+# /usr/local/bin.
+
+cdd_exe=${cdd_exe:-/usr/local/bin/_cdd}
+
+function cdd
+{
+    if [[ -z ${_CDD[1]-} ]]
+    then
+        coproc _CDD { exec "$cdd_exe" --coproc; }
+    fi
+
+    local line status count_out count_err i
+    {
+        printf '%s\n' "cdd-request $# 0 -" "$@" "$PWD" "${CDD_OPTIONS-}"
+        dirs -l -p
+        printf '\n'
+    } >&"${_CDD[1]}"
+    if ! IFS=' ' read -r -u "${_CDD[0]}" line status count_out count_err
+    then
+        # The coprocess went away, fall back to running _cdd directly
+        while read -r line; do eval "$line" >/dev/null; done < <(dirs -l -p | "$cdd_exe" "$@")
+        return
+    fi
+
+    for (( i=0; i<count_out; i++ ))
+    do
+        IFS= read -r -u "${_CDD[0]}" line
+        eval "$line" >/dev/null
+    done
+    for (( i=0; i<count_err; i++ ))
+    do
+        IFS= read -r -u "${_CDD[0]}" line
+        printf '%s\n' "$line" >&2
+    done
+}
+
+alias cd=cdd
@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Compare the time per cd of the usual fork per call cdd function with
+# the coprocess version in cdd_coproc.bash.
+#
+# usage: cdd_coproc_bench.sh [path to _cdd] [stack depth] [number of cd]
+
+cdd_exe=${1:-/usr/local/bin/_cdd}
+depth=${2:-1000}
+count=${3:-500}
+here=$(cd "$(dirname "$0")" && pwd)
+
+root=$(mktemp -d)
+trap 'rm -rf "$root"' EXIT
+for (( i=0; i<20; i++ ))
+do
+    mkdir -p "$root/dir$i"
+done
+
+function fill_stack
+{
+    dirs -c
+    cd "$root"
+    local i
+    for (( i=0; i<depth; i++ ))
+    do
+        pushd -n "$root/dir$(( i % 20 ))" >/dev/null
+    done
+}
+
+function run
+{
+    local i start end
+    fill_stack
+    start=${EPOCHREALTIME/./}
+    for (( i=0; i<count; i++ ))
+    do
+        cdd -2 2>/dev/null
+    done
+    end=${EPOCHREALTIME/./}
+    printf '%-10s %8d us per cd\n' "$1" $(( (end - start) / count ))
+}
+
+function cdd { while read x; do eval $x >/dev/null; done < <(dirs -l -p | "${cdd_exe}" "$@"); }
+run fork
+
+unset -f cdd
+source "$here/cdd_coproc.bash"
+run coproc
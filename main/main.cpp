@@ -32,26 +32,64 @@ along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
 
 int main(int argc, const char* argv[])
 {
+    // Only iostreams are used, let cin read the stack in large blocks
+    ios::sync_with_stdio(false);
     try
     {
         Cdd cdd;
         if (cdd.options(argc, argv, get_environment(Cdd::env_options_name)))
         {
-            if ( ! cdd.has_directory_stack )
+            if (cdd.opt_coproc)
             {
-                if (isatty(fileno(stdin)))
+                CoprocServer server;
+                server.serve(cin, cout);
+                return 0;
+            }
+            // A search's budget includes reading and indexing the stack
+            if (cdd.held_to_budget())
+                cdd.start_budget();
+            HistoryStore store;
+            if ( ! cdd.has_directory_stack && ! cdd.opt_store.empty() )
+            {
+                string current_path = get_working_path();
+                string socket_path = cdd.opt_socket.empty() ? HistoryServer::default_socket_path() : cdd.opt_socket;
+                vector<string> args(argv + 1, argv + argc);
+                string env_options = get_environment(Cdd::env_options_name);
+                string text_out, text_err;
+                // The index a running cdd-server publishes is read here
+                // when it is current, otherwise the server is asked, and
+                // without one the store is read here
+                if ( shared_request(socket_path, args, current_path, env_options, text_out, text_err)
+                     || server_request(socket_path, args, current_path, env_options, text_out, text_err) )
+                {
+                    cout << text_out;
+                    cerr << text_err;
+                    return 0;
+                }
+                store.open(cdd.opt_store);
+                cdd.process_store(store, current_path);
+            }
+            else
+            {
+                // Read whole rather than as far as needed, so that the
+                // shell's dirs command never sees a broken pipe, and so
+                // the stack can be looked up in the cache of its indexes
+                string lines;
+                if ( ! cdd.has_directory_stack )
                 {
-                    cout << "stdin is a terminal, expecting piped directory stack" << endl;
-                    Cdd::help();
-                    return 1;
+                    if (isatty(fileno(stdin)))
+                    {
+                        cout << "stdin is a terminal, expecting piped directory stack" << endl;
+                        Cdd::help();
+                        return 1;
+                    }
+                    char block[65536];
+                    while (cin.read(block, sizeof(block)) || cin.gcount() > 0)
+                        lines.append(block, cin.gcount());
+                    cdd.assign_cached(lines, get_working_path(), get_environment("XDG_RUNTIME_DIR"));
                 }
-                vector<string> vec_pushd;
-                string line;
-                while (getline(cin, line))
-                    vec_pushd.push_back(line);
-                cdd.assign(vec_pushd, get_working_path());
+                cdd.process();
             }
-            cdd.process();
         }
 
         cout << cdd.strm_out.str();
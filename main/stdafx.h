@@ -15,8 +15,11 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <limits>
 
 #include <cdd/cdd.h>
 #include <cdd/cdd_util.h>
+#include <cdd/cdd_coproc.h>
+#include <cdd/cdd_server.h>
 
 // vim:ff=unix
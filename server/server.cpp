@@ -0,0 +1,97 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <cdd/cdd.h>
+#include <cdd/cdd_util.h>
+#include <cdd/cdd_server.h>
+
+using namespace std;
+
+static HistoryServer server;
+
+static void on_signal(int)
+{
+    server.stop();
+}
+
+static void help(void)
+{
+    cout <<
+"Usage: cdd-server --store=FILE [--socket=PATH]\n"
+"\n"
+"Serve the cdd history store in FILE to the shells of this user.  _cdd\n"
+"asks the server when it is given the same store, and reads the store\n"
+"itself when there is no server.\n"
+"\n"
+"  --store=FILE            The history store to serve\n"
+"  --socket=PATH           Listen on PATH, by default cdd-server.sock in\n"
+"                          XDG_RUNTIME_DIR\n"
+"  --help                  Show help (this information)\n";
+}
+
+int main(int argc, const char* argv[])
+{
+    server.socket_path = HistoryServer::default_socket_path();
+    for (int i=1; i<argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.compare(0, 8, "--store=") == 0)
+            server.store_path = arg.substr(8);
+        else if (arg.compare(0, 9, "--socket=") == 0)
+            server.socket_path = arg.substr(9);
+        else
+        {
+            help();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    if (server.store_path.empty())
+    {
+        help();
+        return 1;
+    }
+    if (server.socket_path.empty())
+    {
+        cerr << "** No socket path, XDG_RUNTIME_DIR is not set" << endl;
+        return 1;
+    }
+
+    string error;
+    if (!server.listen(error))
+    {
+        cerr << "** " << error << endl;
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    // Compactions run in children that are never waited on
+    signal(SIGCHLD, SIG_IGN);
+    server.run();
+    return 0;
+}
+
+// vim:ff=unix
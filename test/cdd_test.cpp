@@ -105,6 +105,30 @@ SECTION("no_current_path")
     REQUIRE("/tmp/c" == cdd.vec_dir_first_to_last[2]);
 }
 
+SECTION("initialization_trailing_slash")
+{
+    string arr_dir[] = {
+        "/tmp/a/",  // third visited
+        "/tmp/b",   // second visited
+        "/tmp/a",   // first visited
+    };
+    Cdd cdd(arr_dir, countof(arr_dir));
+
+    // The spelling of the most recent visit is used going backwards
+    REQUIRE(2 == cdd.vec_dir_last_to_first.size());
+    REQUIRE("/tmp/a/" == cdd.vec_dir_last_to_first[0]);
+    REQUIRE("/tmp/b" == cdd.vec_dir_last_to_first[1]);
+
+    // and the spelling of the first visit going forwards
+    REQUIRE(2 == cdd.vec_dir_first_to_last.size());
+    REQUIRE("/tmp/a" == cdd.vec_dir_first_to_last[0]);
+    REQUIRE("/tmp/b" == cdd.vec_dir_first_to_last[1]);
+
+    REQUIRE(2 == cdd.vec_dir_most_to_least.size());
+    REQUIRE(Cdd::Common(2, 0, "/tmp/a/") == cdd.vec_dir_most_to_least[0]);
+    REQUIRE(Cdd::Common(1, 1, "/tmp/b") == cdd.vec_dir_most_to_least[1]);
+}
+
 //----------------------------------------------------------------------
 
 SECTION("back_none")
@@ -235,6 +259,28 @@ SECTION("back_four_dash")
     REQUIRE("No directory at -4\n" == cdd.strm_err.str());
 }
 
+SECTION("back_dash_lazy")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.opt_path = "-";
+    cdd.process();
+    REQUIRE("cdd: /tmp/b\n" == cdd.strm_err.str());
+    // Only the top of the stack is indexed, other lists are never built
+    REQUIRE(1 == cdd.vec_dir_stack.ids.size());
+    REQUIRE(cdd.vec_dir_first_to_last.ids.empty());
+    REQUIRE(cdd.vec_dir_most_to_least.ids.empty());
+}
+
+SECTION("back_dash_two_lazy")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.opt_path = "-2";
+    cdd.process();
+    REQUIRE("cdd: /tmp/c\n" == cdd.strm_err.str());
+    REQUIRE(2 == cdd.vec_dir_stack.ids.size());
+    REQUIRE(cdd.vec_dir_most_to_least.ids.empty());
+}
+
 //----------------------------------------------------------------------
 
 SECTION("forward_and_zero")
@@ -0,0 +1,183 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include <cdd/cdd_coproc.h>
+
+#include "catch.hpp"
+
+static string serve(CoprocServer& server, const string& request)
+{
+    istringstream in(request);
+    ostringstream out;
+    server.serve(in, out);
+    return out.str();
+}
+
+TEST_CASE("coproc_test")
+{
+
+SECTION("coproc_full_stack")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    string response = serve(server, "cdd-request 1 0 3\n-1\n/t/c\n\n/t/c\n/t/b\n/t/a\n");
+#ifdef WIN32
+    REQUIRE("cdd-response ok 1 1\npushd /t/b\ncdd: /t/b\n" == response);
+#else
+    REQUIRE("cdd-response ok 1 1\npushd '/t/b'\ncdd: /t/b\n" == response);
+#endif
+    REQUIRE(3 == server.stack.size());
+    REQUIRE("/t/c" == server.stack[0]);
+    REQUIRE("/t/a" == server.stack[2]);
+}
+
+SECTION("coproc_changed_entries")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    serve(server, "cdd-request 1 0 3\n-1\n/t/c\n\n/t/c\n/t/b\n/t/a\n");
+
+    // One directory pushed on top of the whole stack
+    string response = serve(server, "cdd-request 1 3 1\n-1\n/t/b\n\n/t/b\n");
+#ifdef WIN32
+    REQUIRE("cdd-response ok 1 1\npushd /t/c\ncdd: /t/c\n" == response);
+#else
+    REQUIRE("cdd-response ok 1 1\npushd '/t/c'\ncdd: /t/c\n" == response);
+#endif
+    REQUIRE(4 == server.stack.size());
+
+    // Two popped and one pushed
+    response = serve(server, "cdd-request 1 2 1\n--history\n/t/x\n\n/t/x\n");
+    REQUIRE("cdd-response ok 0 2\n -1: /t/b\n -2: /t/a\n" == response);
+    REQUIRE(3 == server.stack.size());
+}
+
+SECTION("coproc_full_stack_again")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    serve(server, "cdd-request 1 0 3\n-1\n/t/c\n\n/t/c\n/t/b\n/t/a\n");
+    // Sent whole again, the bottom that is held already stays
+    string response = serve(server, "cdd-request 1 0 3\n--history\n/t/x\n\n/t/x\n/t/b\n/t/a\n");
+    REQUIRE("cdd-response ok 0 2\n -1: /t/b\n -2: /t/a\n" == response);
+    REQUIRE(3 == server.stack.size());
+    REQUIRE("/t/x" == server.stack[0]);
+    response = serve(server, "cdd-request 1 0 1\n--history\n/t/y\n\n/t/y\n");
+    REQUIRE("cdd-response ok 0 1\nNo history of other directories\n" == response);
+    REQUIRE(1 == server.stack.size());
+}
+
+SECTION("coproc_delta")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    serve(server, "cdd-request 1 0 3\n-1\n/t/c\n\n/t/c\n/t/b\n/t/a\n");
+    REQUIRE("cdd-response ok 0 0\n" == serve(server, "cdd-delta push\n/t/d\n"));
+    REQUIRE(4 == server.stack.size());
+    REQUIRE("cdd-response ok 0 0\n" == serve(server, "cdd-delta delete 2\n"));
+    REQUIRE("cdd-response ok 0 0\n" == serve(server, "cdd-delta pop 1\n"));
+    // Applied to the stack that the next request keeps
+    string response = serve(server, "cdd-request 1 2 0\n--history\n/t/c\n\n");
+    REQUIRE("cdd-response ok 0 1\n -1: /t/a\n" == response);
+
+    REQUIRE("cdd-response resync 0 0\n" == serve(server, "cdd-delta pop 3\n"));
+    REQUIRE("cdd-response resync 0 0\n" == serve(server, "cdd-delta delete 2\n"));
+    REQUIRE(2 == server.stack.size());
+    REQUIRE("cdd-response error 0 1\n** Malformed coproc request: cdd-delta pop\n"
+            == serve(server, "cdd-delta pop\n"));
+    REQUIRE("cdd-response error 0 1\n** Malformed coproc request: cdd-delta push 1\n"
+            == serve(server, "cdd-delta push 1\n"));
+    REQUIRE("cdd-response error 0 1\n** Malformed coproc request: cdd-delta delete -1\n"
+            == serve(server, "cdd-delta delete -1\n"));
+    // A push cut short ends the session without a response
+    REQUIRE("" == serve(server, "cdd-delta push\n"));
+}
+
+SECTION("coproc_options")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    // CDD_OPTIONS travels with each request
+    string response = serve(server, "cdd-request 1 0 3\n--history\n/t/c\n--limit-backwards=1\n/t/c\n/t/b\n/t/a\n");
+    REQUIRE("cdd-response ok 0 2\n -1: /t/b\n ... showing last 1 of 2\n" == response);
+
+    response = serve(server, "cdd-request 1 3 0\n--no-such-option\n/t/c\n\n");
+    REQUIRE(0 == response.find("cdd-response ok 0 "));
+    REQUIRE(string::npos != response.find("no-such-option"));
+}
+
+SECTION("coproc_to_empty_line")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    // As sent by bash with dirs -l -p
+    string response = serve(server, "cdd-request 1 0 -\n-1\n/t/c\n\n/t/c\n/t/b\n/t/a\n\n");
+#ifdef WIN32
+    REQUIRE("cdd-response ok 1 1\npushd /t/b\ncdd: /t/b\n" == response);
+#else
+    REQUIRE("cdd-response ok 1 1\npushd '/t/b'\ncdd: /t/b\n" == response);
+#endif
+    REQUIRE(3 == server.stack.size());
+    REQUIRE("cdd-response error 0 1\n** Malformed coproc request: cdd-request 1 0 2x\n"
+            == serve(server, "cdd-request 1 0 2x\n"));
+}
+
+SECTION("coproc_resync")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    serve(server, "cdd-request 1 0 2\n-1\n/t/b\n\n/t/b\n/t/a\n");
+    // Asked to keep more than is held, the shell must send everything
+    REQUIRE("cdd-response resync 0 0\n" == serve(server, "cdd-request 1 5 1\n-1\n/t/c\n\n/t/c\n"));
+    REQUIRE(2 == server.stack.size());
+}
+
+SECTION("coproc_malformed")
+{
+    CoprocServer server;
+    server.change_directory = false;
+    REQUIRE("cdd-response error 0 1\n** Malformed coproc request: hello\n" == serve(server, "hello\n"));
+    REQUIRE("cdd-response error 0 1\n** Malformed coproc request: cdd-request 1 -1 0\n"
+            == serve(server, "cdd-request 1 -1 0\n"));
+    // A request cut short ends the session without a response
+    REQUIRE("" == serve(server, "cdd-request 2 0 0\n-1\n"));
+}
+
+SECTION("coproc_several")
+{
+    // Requests are served one after the other from the same stream
+    CoprocServer server;
+    server.change_directory = false;
+    string response = serve(server,
+        "cdd-request 1 0 2\n-1\n/t/b\n\n/t/b\n/t/a\n"
+        "cdd-request 1 2 1\n-1\n/t/a\n\n/t/a\n");
+#ifdef WIN32
+    REQUIRE("cdd-response ok 1 1\npushd /t/a\ncdd: /t/a\ncdd-response ok 1 1\npushd /t/b\ncdd: /t/b\n" == response);
+#else
+    REQUIRE("cdd-response ok 1 1\npushd '/t/a'\ncdd: /t/a\ncdd-response ok 1 1\npushd '/t/b'\ncdd: /t/b\n" == response);
+#endif
+}
+
+}
+
+// vim:ff=unix
@@ -0,0 +1,255 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include <cdd/cdd_discover.h>
+
+#include "catch.hpp"
+
+// The tree is made with POSIX calls, and symlinks are part of the test
+#ifndef WIN32
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define countof(x) (sizeof(x)/sizeof(x[0]))
+
+static const string root = "discover_test.tmp";
+
+static void make_tree(const char *dirs[], size_t count)
+{
+    system(("rm -rf " + root).c_str());
+    mkdir(root.c_str(), 0755);
+    for (size_t i=0; i<count; i++)
+        mkdir((root + "/" + dirs[i]).c_str(), 0755);
+}
+
+static string find(Discovery& discovery, const string& pattern)
+{
+    PathMatcher matcher;
+    matcher.compile(pattern);
+    return discovery.find(matcher);
+}
+
+// Finds nothing in the history, so that --discover is tried
+struct CddDiscover: Cdd
+{
+    vector<string> roots;
+    CddDiscover(string arr_pushd[], int count) : Cdd(arr_pushd, count) {}
+    virtual vector<string> discovery_roots(void) { return roots; }
+};
+
+TEST_CASE("discover_test")
+{
+
+const char *dirs[] = {
+    "src",
+    "src/app",
+    "src/app/widget",
+    "src/lib",
+    "src/lib/widget",
+    "docs",
+    "docs/widgets",
+    "node_modules",
+    "node_modules/gadget",
+    "deep",
+    "deep/a",
+    "deep/a/b",
+    "deep/a/b/c",
+    "deep/a/b/c/gizmo",
+};
+make_tree(dirs, countof(dirs));
+
+SECTION("discover_shallowest")
+{
+    // docs/widgets is nearer the root than either widget
+    Discovery discovery;
+    discovery.roots.push_back(root);
+    REQUIRE(root + "/docs/widgets" == find(discovery, "widget"));
+    // The first by name among matches at the same depth
+    REQUIRE(root + "/src/app/widget" == find(discovery, "/widget$"));
+    REQUIRE(root + "/src/lib" == find(discovery, "lib"));
+}
+
+SECTION("discover_threads")
+{
+    for (unsigned threads=1; threads<=4; threads++)
+    {
+        Discovery discovery;
+        discovery.roots.push_back(root);
+        discovery.thread_count = threads;
+        discovery.max_depth = 5;
+        REQUIRE(root + "/src/app/widget" == find(discovery, "/widget$"));
+        REQUIRE(root + "/deep/a/b/c/gizmo" == find(discovery, "gizmo"));
+        REQUIRE("" == find(discovery, "nothing"));
+    }
+}
+
+SECTION("discover_prune")
+{
+    Discovery discovery;
+    discovery.roots.push_back(root);
+    REQUIRE("" == find(discovery, "gadget"));
+    discovery.prune.clear();
+    REQUIRE(root + "/node_modules/gadget" == find(discovery, "gadget"));
+    discovery.prune.push_back("app");
+    REQUIRE(root + "/src/lib/widget" == find(discovery, "/widget$"));
+}
+
+SECTION("discover_depth")
+{
+    Discovery discovery;
+    discovery.roots.push_back(root);
+    discovery.max_depth = 4;
+    REQUIRE("" == find(discovery, "gizmo"));
+    discovery.max_depth = 5;
+    REQUIRE(root + "/deep/a/b/c/gizmo" == find(discovery, "gizmo"));
+}
+
+SECTION("discover_below_root")
+{
+    // Matched below the root, so the root does not match everything
+    Discovery discovery;
+    discovery.roots.push_back(root + "/src/");
+    REQUIRE("" == find(discovery, "src"));
+    REQUIRE(root + "/src/app" == find(discovery, "app"));
+}
+
+SECTION("discover_roots")
+{
+    // The first root with a match, and a root under another is walked once
+    Discovery discovery;
+    discovery.roots.push_back(root + "/docs");
+    discovery.roots.push_back(root);
+    discovery.roots.push_back(root + "/src");
+    REQUIRE(root + "/docs/widgets" == find(discovery, "widget"));
+    REQUIRE(root + "/src/app" == find(discovery, "app"));
+}
+
+SECTION("discover_symlink")
+{
+    symlink("deep/a/b/c", (root + "/link").c_str());
+    Discovery discovery;
+    discovery.roots.push_back(root);
+    discovery.max_depth = 5;
+    REQUIRE(root + "/deep/a/b/c/gizmo" == find(discovery, "gizmo"));
+    REQUIRE("" == find(discovery, "link"));
+}
+
+SECTION("discover_time")
+{
+    // The clock moves on each time it is read, the walk stops once it
+    // reads past the limit
+    int64_t now = 0;
+    Discovery discovery;
+    discovery.roots.push_back(root);
+    discovery.thread_count = 1;
+    discovery.max_depth = 5;
+    discovery.time_ms = 4;
+    discovery.clock = [&now]() { return now += 1; };
+    REQUIRE("" == find(discovery, "gizmo"));
+    REQUIRE(discovery.timed_out);
+    REQUIRE(3 == discovery.directory_count);
+    now = 0;
+    discovery.time_ms = 1000;
+    REQUIRE(root + "/deep/a/b/c/gizmo" == find(discovery, "gizmo"));
+    REQUIRE_FALSE(discovery.timed_out);
+}
+
+SECTION("discover_read_directory")
+{
+    vector<string> names;
+    REQUIRE(Discovery::read_directory(root + "/src", names));
+    sort(names.begin(), names.end());
+    REQUIRE((vector<string>{"app", "lib"}) == names);
+    REQUIRE_FALSE(Discovery::read_directory(root + "/none", names));
+}
+
+SECTION("discover_cdd")
+{
+    // A pattern with no match in the history changes to a directory on
+    // disk as a history match would
+    string arr_dirs[] = {"/aa/bb", "/cc/dd"};
+    CddDiscover cdd(arr_dirs, countof(arr_dirs));
+    cdd.roots.push_back(root);
+    cdd.opt_path = "gizmo";
+    cdd.opt_discover = true;
+    cdd.opt_discover_depth = 5;
+    cdd.process();
+    REQUIRE("pushd '" + root + "/deep/a/b/c/gizmo'\n" == cdd.strm_out.str());
+    REQUIRE("cdd: " + root + "/deep/a/b/c/gizmo\n" == cdd.strm_err.str());
+
+    SECTION("discover_cdd_off")
+    {
+        CddDiscover cdd_off(arr_dirs, countof(arr_dirs));
+        cdd_off.roots.push_back(root);
+        cdd_off.opt_path = "gizmo";
+        cdd_off.process();
+        REQUIRE("" == cdd_off.strm_out.str());
+        REQUIRE("Cannot match pattern: 'gizmo'\n" == cdd_off.strm_err.str());
+    }
+
+    SECTION("discover_cdd_prune")
+    {
+        CddDiscover cdd_prune(arr_dirs, countof(arr_dirs));
+        cdd_prune.roots.push_back(root);
+        cdd_prune.opt_path = "gizmo";
+        cdd_prune.opt_discover = true;
+        cdd_prune.opt_discover_depth = 5;
+        cdd_prune.opt_discover_prune = "b:other";
+        cdd_prune.process();
+        REQUIRE("" == cdd_prune.strm_out.str());
+    }
+}
+
+system(("rm -rf " + root).c_str());
+
+}
+
+// Directories read each second, run with "testmain [.bench]"
+TEST_CASE("discover_bench", "[.bench]")
+{
+    const char *roots[] = {"/usr", "/root"};
+    for (const char *dir : roots)
+    {
+        for (unsigned threads : {1u, 0u})
+        {
+            Discovery discovery;
+            discovery.roots.push_back(dir);
+            discovery.max_depth = 6;
+            discovery.thread_count = threads;
+            auto start = chrono::steady_clock::now();
+            find(discovery, "no such directory anywhere");
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            cout << dir << " threads " << threads << ": " << discovery.directory_count << " directories in " << ms << " ms" << endl;
+        }
+    }
+}
+
+#endif
+
+// vim:ff=unix
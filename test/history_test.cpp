@@ -149,6 +149,93 @@ SECTION("history_common_limit_all")
     REQUIRE(" ,0: ( 3) /var/a\n ,1: ( 2) /var/c\n ,2: ( 2) /var/b\n" == cdd.strm_err.str());
 }
 
+SECTION("history_common_top_k")
+{
+    // Lots of ties in count, the top entries must come out in the same
+    // order whether or not the whole list is sorted
+    vector<string> vec_dirs;
+    for (int i=0; i<500; i++)
+        vec_dirs.push_back("/var/" + to_string(i * 7919 % 61));
+
+    Cdd cdd_all(vec_dirs, string());
+    vector<Cdd::Common> vec_all;
+    for (size_t i=0; i<cdd_all.vec_dir_most_to_least.size(); i++)
+        vec_all.push_back(cdd_all.vec_dir_most_to_least[i]);
+    REQUIRE(61 == vec_all.size());
+    REQUIRE(is_sorted(vec_all.begin(), vec_all.end()));
+
+    Cdd cdd(vec_dirs, string());
+    cdd.fill_most_to_least(5);
+    REQUIRE(5 == cdd.vec_dir_most_to_least.ids.size());
+    for (size_t i=0; i<5; i++)
+        REQUIRE(vec_all[i] == cdd.vec_dir_most_to_least[i]);
+    // Walking further extends the selection
+    REQUIRE(vec_all[20] == cdd.vec_dir_most_to_least[20]);
+    REQUIRE(61 > cdd.vec_dir_most_to_least.ids.size());
+}
+
+SECTION("history_common_limit_partial")
+{
+    Cdd cdd(arr_common_dirs, countof(arr_common_dirs));
+    cdd.opt_history = true;
+    cdd.direction.assign(",");
+    cdd.opt_limit_common = 1;
+    cdd.process();
+    REQUIRE(" ,0: ( 3) /var/a\n ... showing top 1 of 3\n" == cdd.strm_err.str());
+    REQUIRE(1 == cdd.vec_dir_most_to_least.ids.size());
+}
+
+SECTION("history_frecent")
+{
+    // Many visits long ago count for less than a few recent ones
+    vector<string> vec_dirs(20, "/var/new");
+    for (int i=0; i<4000; i++)
+        vec_dirs.push_back("/var/x" + to_string(i));
+    vec_dirs.insert(vec_dirs.end(), 100, "/var/old");
+
+    Cdd cdd(vec_dirs, string());
+    cdd.opt_history = true;
+    cdd.direction.assign("%");
+    cdd.opt_limit_frecent = 2;
+    cdd.process();
+    REQUIRE(" %0: (20) /var/new\n %1: ( 1) /var/x0\n ... showing top 2 of 4002\n" == cdd.strm_err.str());
+    REQUIRE(Cdd::Common(100, 4001, "/var/old") == cdd.vec_dir_most_to_least[0]);
+
+    Cdd cdd_frecent(vec_dirs, string());
+    cdd_frecent.direction.assign("%");
+    cdd_frecent.set_opt_path("/var/[no]");
+    cdd_frecent.process();
+    REQUIRE("pushd '/var/new'\n" == cdd_frecent.strm_out.str());
+
+    Cdd cdd_common(vec_dirs, string());
+    cdd_common.direction.assign(",");
+    cdd_common.set_opt_path("/var/[no]");
+    cdd_common.process();
+    REQUIRE("pushd '/var/old'\n" == cdd_common.strm_out.str());
+}
+
+SECTION("history_frecent_top_k")
+{
+    vector<string> vec_dirs;
+    for (int i=0; i<3000; i++)
+        vec_dirs.push_back("/var/" + to_string(i * 7919 % 61));
+
+    Cdd cdd_all(vec_dirs, string());
+    vector<double> vec_all;
+    for (size_t i=0; i<cdd_all.vec_dir_frecent.size(); i++)
+        vec_all.push_back(-cdd_all.index().entry(cdd_all.vec_dir_frecent.ids[i]).frecency);
+    REQUIRE(61 == vec_all.size());
+    REQUIRE(is_sorted(vec_all.begin(), vec_all.end()));
+
+    Cdd cdd(vec_dirs, string());
+    cdd.fill_frecent(5);
+    REQUIRE(5 == cdd.vec_dir_frecent.ids.size());
+    for (size_t i=0; i<5; i++)
+        REQUIRE(cdd_all.vec_dir_frecent[i] == cdd.vec_dir_frecent[i]);
+    REQUIRE(cdd_all.vec_dir_frecent[20] == cdd.vec_dir_frecent[20]);
+    REQUIRE(61 > cdd.vec_dir_frecent.ids.size());
+}
+
 }
 
 // vim:ff=unix
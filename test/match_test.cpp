@@ -35,12 +35,13 @@ static string arr_test_dirs[] = {
     "/aa/bb",   // first visited
 };
 
-TEST_CASE("match_test")
+static void match_test(PathMatcher::Engine engine)
 {
 
 SECTION("simple_match")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
     cdd.opt_path = "ee";
     cdd.process();
 #ifdef WIN32
@@ -54,6 +55,7 @@ SECTION("simple_match")
 SECTION("multi_match_backwards")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
     cdd.opt_path = "bb";
     cdd.direction.assign("-");
     cdd.process();
@@ -68,6 +70,24 @@ SECTION("multi_match_backwards")
 SECTION("multi_match_backwards_limit")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_path = "bb";
+    cdd.opt_limit_backwards = 2;
+    cdd.direction.assign("-");
+    cdd.process();
+#ifdef WIN32
+    REQUIRE("pushd /bb/ee\n" == cdd.strm_out.str());
+#else
+    REQUIRE("pushd '/bb/ee'\n" == cdd.strm_out.str());
+#endif
+    REQUIRE("cdd: /bb/ee\n -3: /aa/bb\n ... showing last 2 matching, more matches available\n" == cdd.strm_err.str());
+}
+
+SECTION("multi_match_backwards_limit_exact")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_exact_count = true;
     cdd.opt_path = "bb";
     cdd.opt_limit_backwards = 2;
     cdd.direction.assign("-");
@@ -83,6 +103,7 @@ SECTION("multi_match_backwards_limit")
 SECTION("multi_match_default_backwards")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
     cdd.opt_path = "cc";
     cdd.process();
 #ifdef WIN32
@@ -96,6 +117,7 @@ SECTION("multi_match_default_backwards")
 SECTION("multi_match_forwards")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
     cdd.opt_path = "bb";
     cdd.direction.assign("+");
     cdd.process();
@@ -110,6 +132,24 @@ SECTION("multi_match_forwards")
 SECTION("multi_match_forwards_limit")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_path = "bb";
+    cdd.opt_limit_forwards = 2;
+    cdd.direction.assign("+");
+    cdd.process();
+#ifdef WIN32
+    REQUIRE("pushd /aa/bb\n" == cdd.strm_out.str());
+#else
+    REQUIRE("pushd '/aa/bb'\n" == cdd.strm_out.str());
+#endif
+    REQUIRE("cdd: /aa/bb\n  1: /bb/cc\n ... showing first 2 matching, more matches available\n" == cdd.strm_err.str());
+}
+
+SECTION("multi_match_forwards_limit_exact")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_exact_count = true;
     cdd.opt_path = "bb";
     cdd.opt_limit_forwards = 2;
     cdd.direction.assign("+");
@@ -125,6 +165,7 @@ SECTION("multi_match_forwards_limit")
 SECTION("multi_match_common")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
     cdd.opt_path = "cc";
     cdd.direction.assign(",");
     cdd.process();
@@ -139,6 +180,25 @@ SECTION("multi_match_common")
 SECTION("multi_match_common_limit")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_path = "cc";
+    cdd.opt_limit_common = 1;
+    cdd.direction.assign(",");
+    cdd.process();
+#ifdef WIN32
+    REQUIRE("pushd /cc/dd\n" == cdd.strm_out.str());
+#else
+    REQUIRE("pushd '/cc/dd'\n" == cdd.strm_out.str());
+#endif
+    // TODO this is wrong
+    REQUIRE("cdd: /cc/dd\n ... showing top 1 matching, more matches available\n" == cdd.strm_err.str());
+}
+
+SECTION("multi_match_common_limit_exact")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_exact_count = true;
     cdd.opt_path = "cc";
     cdd.opt_limit_common = 1;
     cdd.direction.assign(",");
@@ -152,6 +212,292 @@ SECTION("multi_match_common_limit")
     REQUIRE("cdd: /cc/dd\n ... showing top 1 matching of 2\n" == cdd.strm_err.str());
 }
 
+
+SECTION("multi_match_backwards_lazy")
+{
+    // Only the top of a deep stack is read when the limit is reached early
+    vector<string> vec_dirs;
+    for (int i=0; i<1000; i++)
+        vec_dirs.push_back("/deep/" + to_string(i));
+    Cdd cdd(vec_dirs, string());
+    cdd.match_engine = engine;
+    cdd.opt_path = "deep";
+    cdd.opt_limit_backwards = 3;
+    cdd.direction.assign("-");
+    cdd.process();
+    REQUIRE("cdd: /deep/0\n -2: /deep/1\n -3: /deep/2\n ... showing last 3 matching, more matches available\n" == cdd.strm_err.str());
+    REQUIRE(10 > cdd.vec_dir_stack.ids.size());
+}
+
+SECTION("budget_backwards")
+{
+    // The clock moves one millisecond each time it is read, once for each
+    // line of the stack and once for each match tried, so the cut is the
+    // same on every run
+    vector<string> vec_dirs;
+    for (int i=0; i<1000; i++)
+        vec_dirs.push_back("/deep/" + to_string(i));
+    Cdd cdd(vec_dirs, string());
+    int64_t now = 0;
+    cdd.clock = [&now]() { return now++; };
+    cdd.match_engine = engine;
+    cdd.opt_path = "deep";
+    cdd.opt_all = true;
+    cdd.opt_budget_ms = 7;
+    cdd.direction.assign("-");
+    cdd.process();
+#ifdef WIN32
+    REQUIRE("pushd /deep/0\n" == cdd.strm_out.str());
+#else
+    REQUIRE("pushd '/deep/0'\n" == cdd.strm_out.str());
+#endif
+    REQUIRE("cdd: /deep/0\n -2: /deep/1\n -3: /deep/2\n"
+            "cdd: over the budget of 7 ms, the result may be incomplete\n" == cdd.strm_err.str());
+    REQUIRE(3 == cdd.vec_dir_stack.ids.size());
+}
+
+SECTION("budget_none_found")
+{
+    vector<string> vec_dirs;
+    for (int i=0; i<1000; i++)
+        vec_dirs.push_back("/deep/" + to_string(i));
+    Cdd cdd(vec_dirs, string());
+    int64_t now = 0;
+    cdd.clock = [&now]() { return now++; };
+    cdd.match_engine = engine;
+    cdd.opt_path = "p/999";
+    cdd.opt_budget_ms = 100;
+    cdd.direction.assign("-");
+    cdd.process();
+    REQUIRE("" == cdd.strm_out.str());
+    REQUIRE("Cannot match pattern: 'p/999'\n"
+            "cdd: over the budget of 100 ms, the result may be incomplete\n" == cdd.strm_err.str());
+}
+
+SECTION("budget_within")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    int64_t now = 0;
+    cdd.clock = [&now]() { return now++; };
+    cdd.match_engine = engine;
+    cdd.opt_path = "cc";
+    cdd.opt_budget_ms = 100;
+    cdd.direction.assign(",");
+    cdd.process();
+    REQUIRE("cdd: /cc/dd\n ,3: ( 1) /bb/cc\n" == cdd.strm_err.str());
+    REQUIRE_FALSE(cdd.budget_exceeded);
+}
+
+SECTION("simple_match_case")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_path = "EE";
+    cdd.process();
+#ifdef WIN32
+    REQUIRE("pushd /bb/ee\n" == cdd.strm_out.str());
+#else
+    REQUIRE("pushd '/bb/ee'\n" == cdd.strm_out.str());
+#endif
+    REQUIRE("cdd: /bb/ee\n" == cdd.strm_err.str());
+}
+
+SECTION("bad_pattern")
+{
+    Cdd cdd(arr_test_dirs, countof(arr_test_dirs));
+    cdd.match_engine = engine;
+    cdd.opt_path = "bb(";
+    cdd.process();
+    REQUIRE("" == cdd.strm_out.str());
+    REQUIRE(0 == cdd.strm_err.str().find("Cannot process pattern: 'bb('"));
+}
+
+}
+
+TEST_CASE("match_test")
+{
+    match_test(PathMatcher::ENGINE_AUTO);
+}
+
+TEST_CASE("match_test_dfa")
+{
+    match_test(PathMatcher::ENGINE_DFA);
+}
+
+TEST_CASE("match_test_regex")
+{
+    match_test(PathMatcher::ENGINE_REGEX);
+}
+
+//----------------------------------------------------------------------
+
+static bool naive_find_icase(const string& haystack, const string& needle)
+{
+    string lower;
+    for (size_t i=0; i<haystack.size(); i++)
+        lower.push_back((haystack[i] >= 'A' && haystack[i] <= 'Z') ? haystack[i] - 'A' + 'a' : haystack[i]);
+    return lower.find(needle) != string::npos;
+}
+
+TEST_CASE("match_literal")
+{
+
+SECTION("literal_pattern")
+{
+    REQUIRE(PathMatcher::is_literal_pattern("src"));
+    REQUIRE(PathMatcher::is_literal_pattern("my dir-2"));
+    REQUIRE(!PathMatcher::is_literal_pattern("^src"));
+    REQUIRE(!PathMatcher::is_literal_pattern("a.b"));
+    REQUIRE(!PathMatcher::is_literal_pattern("a\\b"));
+    REQUIRE(!PathMatcher::is_literal_pattern("a|b"));
+
+    PathMatcher matcher;
+    matcher.compile("Src");
+    REQUIRE(matcher.is_literal());
+    REQUIRE(matcher.search("/home/SRC/x"));
+    REQUIRE(!matcher.search("/home/sr/c"));
+    matcher.compile("Src", PathMatcher::ENGINE_DFA);
+    REQUIRE(matcher.is_dfa());
+    REQUIRE(matcher.search("/home/SRC/x"));
+    matcher.compile("Src", PathMatcher::ENGINE_REGEX);
+    REQUIRE(!matcher.is_literal());
+    REQUIRE(!matcher.is_dfa());
+    REQUIRE(matcher.search("/home/SRC/x"));
+}
+
+SECTION("find_icase_random")
+{
+    // Every alignment and length around the vector block sizes, with a
+    // small alphabet so that partial matches are common
+    const char alphabet[] = "aAbB/[`@{Z";
+    unsigned seed = 12345;
+    for (int round=0; round<2000; round++)
+    {
+        string haystack, needle;
+        size_t haystack_size = round % 80;
+        size_t needle_size = 1 + round % 7;
+        for (size_t i=0; i<haystack_size; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            haystack.push_back(alphabet[(seed >> 16) % (countof(alphabet) - 1)]);
+        }
+        for (size_t i=0; i<needle_size; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            char c = alphabet[(seed >> 16) % (countof(alphabet) - 1)];
+            needle.push_back((c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c);
+        }
+        for (size_t offset=0; offset<4 && offset<=haystack.size(); offset++)
+        {
+            string sub = haystack.substr(offset);
+            bool expected = naive_find_icase(sub, needle);
+            REQUIRE(expected == find_icase(sub, needle));
+            REQUIRE(expected == find_icase_scalar(sub, needle));
+        }
+    }
+    REQUIRE(find_icase("anything", ""));
+    REQUIRE(!find_icase("", "a"));
+    REQUIRE(find_icase(string(100, 'x') + "ABC", "abc"));
+    REQUIRE(!find_icase(string(100, 'x') + "AB", "abc"));
+}
+
+}
+
+//----------------------------------------------------------------------
+
+TEST_CASE("match_dfa")
+{
+
+SECTION("dfa_same_as_regex")
+{
+    static const char *patterns[] = {
+        "a.c", "^/aa", "bb$", "^/aa/bb$", "^$", "$", "^", "a|b|", "(aa|bb)/(cc|dd)",
+        "(?:a|b)+c", "[a-c]+/[^/]*$", "[^A-C]", "\\d{2,3}", "x{2}", "x{2,}", "\\w+\\.txt",
+        "\\s", "\\S\\S\\S", "[\\d_]+", "a*?b", "(a*)*b", "((a|b)*)*c$", "[]a-]", "[.]", "\\/x",
+        "A[B-D]e", "(^a|b$)", "[-z]", "[z-]",
+    };
+    static const char *dirs[] = {
+        "", "a", "abc", "ABC", "/aa/bb", "/AA/BB", "/aa/bb/cc", "/x/bb", "aaab", "aaac", "bbbc",
+        "ababc", "a b", "12", "x123y", "xx", "xxx", "file_name.txt", "FILE.TXT", "-", "z-",
+        "/cc/dd", "aa/dd", "bb/cc", "d", "aBe", "AcE", "b", "a]", "a.", "a/x", "\\x",
+    };
+    for (size_t i=0; i<countof(patterns); i++)
+    {
+        DfaRegex dfa;
+        std::regex re;
+        bool regex_ok = true;
+        try
+        {
+            re.assign(patterns[i], std::regex_constants::icase);
+        }
+        catch (std::regex_error&)
+        {
+            regex_ok = false;
+        }
+        // Anything the DFA takes must also be valid for std::regex
+        if (!dfa.compile(patterns[i]))
+            continue;
+        REQUIRE(regex_ok);
+        for (size_t j=0; j<countof(dirs); j++)
+        {
+            INFO("pattern " << patterns[i] << " dir " << dirs[j]);
+            REQUIRE(std::regex_search(dirs[j], re) == dfa.search(dirs[j]));
+        }
+    }
+}
+
+SECTION("dfa_unsupported")
+{
+    DfaRegex dfa;
+    REQUIRE(!dfa.compile("(a)\\1"));
+    REQUIRE(!dfa.compile("\\bword"));
+    REQUIRE(!dfa.compile("a(?=b)"));
+    REQUIRE(!dfa.compile("[[:alpha:]]"));
+    REQUIRE(!dfa.compile("a{2"));
+    REQUIRE(!dfa.compile("*a"));
+    REQUIRE(!dfa.compile("(a"));
+    REQUIRE(!dfa.compile("a)"));
+    REQUIRE(dfa.compile("a{2,3}"));
+
+    // The pattern matcher falls back to std::regex
+    PathMatcher matcher;
+    matcher.compile("(b)\\1");
+    REQUIRE(!matcher.is_dfa());
+    REQUIRE(matcher.search("/abba"));
+    REQUIRE(!matcher.search("/abab"));
+}
+
+SECTION("dfa_linear")
+{
+    // Exponential for a backtracking engine
+    DfaRegex dfa;
+    REQUIRE(dfa.compile("(a*)*b"));
+    string dir(20000, 'a');
+    REQUIRE(!dfa.search(dir));
+    REQUIRE(dfa.search(dir + "b"));
+    REQUIRE(dfa.compile("(x+x+)+y"));
+    REQUIRE(!dfa.search(string(20000, 'x')));
+}
+
+SECTION("dfa_cache_flush")
+{
+    // Needs many more DFA states than are kept at once
+    DfaRegex dfa;
+    REQUIRE(dfa.compile("a.{12}$"));
+    unsigned seed = 1;
+    for (int i=0; i<200; i++)
+    {
+        string dir;
+        for (int j=0; j<40; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            dir.push_back((seed >> 16) & 1 ? 'a' : 'b');
+        }
+        REQUIRE((dir[dir.size()-13] == 'a') == dfa.search(dir));
+    }
+    REQUIRE(dfa.state_count() <= 2000);
+}
+
 }
 
 // vim:ff=unix
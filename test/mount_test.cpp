@@ -0,0 +1,139 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include <cdd/cdd_mount.h>
+#include <cdd/cdd_util.h>
+#include <cstdlib>
+
+#ifdef __linux__
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "catch.hpp"
+
+static const char mountinfo[] =
+    "22 1 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+    "23 22 0:22 / /proc rw,relatime shared:12 - proc proc rw\n"
+    "40 22 0:40 / /net/home rw,relatime shared:30 - nfs4 server:/home rw,vers=4.2\n"
+    "41 40 8:2 / /net/home/scratch rw,relatime - ext4 /dev/sdb1 rw\n"
+    "42 22 0:42 / /mnt/my\\040box rw,nosuid master:4 - fuse.sshfs user@box: rw\n"
+    "43 22 0:43 / /srv rw - cifs //nas/srv rw\n"
+    "44 22 8:3 / /srv rw - ext4 /dev/sdc1 rw\n"
+    "not a mount line\n";
+
+TEST_CASE("mount_test")
+{
+
+SECTION("mount_parse")
+{
+    MountTable table;
+    table.parse(mountinfo);
+    REQUIRE(6 == table.mounts.size());
+    REQUIRE("/net/home/scratch" == table.mounts[0].point);
+    REQUIRE("/" == table.mounts.back().point);
+    REQUIRE("/mnt/my box" == table.find("/mnt/my box/a")->point);
+    REQUIRE("fuse.sshfs" == table.find("/mnt/my box")->type);
+}
+
+SECTION("mount_remote")
+{
+    MountTable table;
+    table.parse(mountinfo);
+    REQUIRE(table.is_remote("/net/home"));
+    REQUIRE(table.is_remote("/net/home/u/src"));
+    REQUIRE(table.is_remote("/mnt/my box/a"));
+    // A local mount within a remote one
+    REQUIRE_FALSE(table.is_remote("/net/home/scratch/x"));
+    // Only at a whole name
+    REQUIRE_FALSE(table.is_remote("/net/homes"));
+    REQUIRE_FALSE(table.is_remote("/usr/lib"));
+    // The later mount on /srv hides the earlier one
+    REQUIRE_FALSE(table.is_remote("/srv/x"));
+    REQUIRE_FALSE(table.is_remote("relative"));
+}
+
+SECTION("mount_empty")
+{
+    MountTable table;
+    table.parse("");
+    REQUIRE(nullptr == table.find("/"));
+    REQUIRE_FALSE(table.is_remote("/net/home"));
+}
+
+SECTION("mount_current")
+{
+    // Read once and shared until a mount comes or goes
+    shared_ptr<const MountTable> table = MountTable::current();
+    REQUIRE(table == MountTable::current());
+#ifdef __linux__
+    REQUIRE(nullptr != table->find("/"));
+#endif
+}
+
+#ifdef __linux__
+SECTION("mount_resolve")
+{
+    // A local tree with links into a directory taken to be an NFS mount
+    string base = get_working_path() + "/mount_test.tmp";
+    system(("rm -rf " + base).c_str());
+    mkdir(base.c_str(), 0755);
+    mkdir((base + "/nfs").c_str(), 0755);
+    mkdir((base + "/nfs/sub").c_str(), 0755);
+    mkdir((base + "/local").c_str(), 0755);
+    symlink((base + "/nfs/sub").c_str(), (base + "/abs").c_str());
+    symlink("../nfs", (base + "/local/rel").c_str());
+    symlink("loop", (base + "/loop").c_str());
+    MountTable table;
+    table.parse("22 1 8:1 / / rw - ext4 /dev/sda1 rw\n"
+                "40 22 0:40 / " + base + "/nfs rw - nfs4 server:/export rw\n");
+
+    // Local by its spelling, on the mount once the link is followed
+    REQUIRE_FALSE(table.is_remote(base + "/abs/x"));
+    REQUIRE(base + "/nfs/sub/x" == table.resolve(base + "/abs/x"));
+    REQUIRE(table.is_remote(table.resolve(base + "/abs")));
+    REQUIRE(base + "/nfs/y" == table.resolve(base + "/local/rel/y"));
+    REQUIRE(base + "/local" == table.resolve(base + "/local/../local/./"));
+    // What is not there is kept as it is spelled
+    REQUIRE(base + "/none/../x" == table.resolve(base + "/none/../x"));
+    REQUIRE(base + "/loop" == table.resolve(base + "/loop"));
+    REQUIRE("relative" == table.resolve("relative"));
+
+    MountTable::ComponentCache cache;
+    REQUIRE(base + "/nfs/sub" == table.resolve(base + "/abs", &cache));
+    REQUIRE(cache.count(base + "/abs"));
+    REQUIRE(base + "/nfs/sub" == table.resolve(base + "/abs", &cache));
+
+    // So a stat through the link gets the deadline of a remote one
+    Cdd cdd;
+    cdd.mount_table = make_shared<MountTable>(table);
+    REQUIRE(cdd.is_remote_path(base + "/abs"));
+    REQUIRE_FALSE(cdd.is_remote_path(base + "/local"));
+    system(("rm -rf " + base).c_str());
+}
+#endif
+
+}
+
+// vim:ff=unix
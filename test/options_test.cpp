@@ -21,6 +21,7 @@ along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "stdafx.h"
+#include <ctime>
 
 #include "catch.hpp"
 
@@ -165,6 +166,26 @@ SECTION("options_limit_all")
     REQUIRE(true == cdd.opt_all);
 }
 
+SECTION("options_exact_count")
+{
+    Cdd cdd;
+    const char *av[] = {"_cdd", "--exact-count", "-", "src"};
+    bool rc = cdd.options(countof(av), av);
+    REQUIRE(true == rc);
+    REQUIRE(true == cdd.opt_exact_count);
+    REQUIRE("src" == cdd.opt_path);
+}
+
+SECTION("options_budget_ms")
+{
+    Cdd cdd;
+    const char *av[] = {"_cdd", "src"};
+    bool rc = cdd.options(countof(av), av, "--budget-ms=20");
+    REQUIRE(true == rc);
+    REQUIRE(20 == cdd.opt_budget_ms);
+    REQUIRE("src" == cdd.opt_path);
+}
+
 SECTION("options_limit_all_override")
 {
     Cdd cdd;
@@ -473,6 +494,18 @@ SECTION("freeform_history_comma_limit")
     REQUIRE(4 == cdd.opt_limit_common);
 }
 
+SECTION("freeform_history_percent_limit")
+{
+    Cdd cdd;
+    const char *av[] = {"_cdd", "%?", "3"};
+    bool rc = cdd.options(countof(av), av);
+    REQUIRE(true == rc);
+    REQUIRE(true == cdd.opt_history);
+    REQUIRE("%" == cdd.direction._direction);
+    REQUIRE(3 == cdd.opt_limit_frecent);
+    REQUIRE(10 == cdd.opt_limit_common);
+}
+
 SECTION("freeform_history_double_qmark")
 {
     Cdd cdd;
@@ -596,6 +629,15 @@ SECTION("env_all")
     REQUIRE(true == cdd.opt_all);
 }
 
+SECTION("env_exact_count")
+{
+    Cdd cdd;
+    const char *av[] = {"_cdd", };
+    bool rc = cdd.options(countof(av), av, "--exact-count");
+    REQUIRE(true == rc);
+    REQUIRE(true == cdd.opt_exact_count);
+}
+
 SECTION("env_direction")
 {
     Cdd cdd;
@@ -683,6 +725,54 @@ SECTION("reset")
     REQUIRE(true == cdd.opt_reset);
 }
 
+SECTION("since")
+{
+    Cdd cdd;
+    const char *av[] = {"_cdd", "--since", "2h", "--store", "history", "-?"};
+    bool rc = cdd.options(countof(av), av);
+    REQUIRE(true == rc);
+    REQUIRE(true == cdd.opt_history);
+    REQUIRE(cdd.opt_since > 0);
+
+    // Only a store has the times of visits
+    Cdd cdd_stack;
+    const char *av_stack[] = {"_cdd", "--since", "2h", "-?"};
+    REQUIRE(false == cdd_stack.options(countof(av_stack), av_stack));
+}
+
+SECTION("since_times")
+{
+    const int64_t now = 1600000000;
+    int64_t since;
+    REQUIRE(Cdd::parse_since("90s", now, since));
+    REQUIRE(now - 90 == since);
+    REQUIRE(Cdd::parse_since("2h", now, since));
+    REQUIRE(now - 2 * 3600 == since);
+    REQUIRE(Cdd::parse_since("3d", now, since));
+    REQUIRE(now - 3 * 86400 == since);
+    REQUIRE(Cdd::parse_since("1w", now, since));
+    REQUIRE(now - 7 * 86400 == since);
+
+    int64_t today, yesterday;
+    REQUIRE(Cdd::parse_since("today", now, today));
+    REQUIRE(Cdd::parse_since("yesterday", now, yesterday));
+    REQUIRE(today <= now);
+    REQUIRE(now - today < 86400);
+    // A day is an hour longer or shorter when the clocks change
+    REQUIRE(today - yesterday >= 23 * 3600);
+    REQUIRE(today - yesterday <= 25 * 3600);
+    // The date of now where the test runs
+    time_t t = now;
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d", localtime(&t));
+    REQUIRE(Cdd::parse_since(date, now, since));
+    REQUIRE(today == since);
+
+    const char *bad[] = {"", "h", "2", "2x", "2hours", "-2h", "tomorrow", "2020-13-01", "2020-09-13x"};
+    for (size_t i=0; i<countof(bad); i++)
+        REQUIRE(!Cdd::parse_since(bad[i], now, since));
+}
+
 }
 
 // vim:ff=unix
@@ -0,0 +1,263 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include <cdd/cdd_server.h>
+#include <cdd/cdd_util.h>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "catch.hpp"
+
+#define countof(x) (sizeof(x)/sizeof(x[0]))
+
+#ifdef __linux__
+
+static string arr_visits[] = {
+    "/opt/a",
+    "/opt/b",
+    "/opt/c",
+    "/opt/a",
+    "/opt/d",
+};
+
+// A store of the visits served on a socket of its own
+struct TestServer
+{
+    string store_path = get_working_path() + "/server_test.tmp";
+    string socket_path = "/tmp/cdd_server_test_" + to_string(getpid()) + ".sock";
+    HistoryServer server;
+    thread runner;
+
+    TestServer(void)
+    {
+        write_store();
+        server.store_path = store_path;
+        server.socket_path = socket_path;
+        server.change_directory = false;
+        string error;
+        REQUIRE(server.listen(error));
+        runner = thread([this]() { server.run(); });
+    }
+
+    ~TestServer(void)
+    {
+        server.stop();
+        runner.join();
+        remove_store();
+    }
+
+    void remove_store(void)
+    {
+        remove(store_path.c_str());
+        remove(HistoryStore::log_path(store_path).c_str());
+        remove((store_path + ".lock").c_str());
+        remove(HistoryServer::shared_index_path(socket_path).c_str());
+    }
+
+    void write_store(void)
+    {
+        remove_store();
+        for (size_t i=0; i<countof(arr_visits); i++)
+            REQUIRE(HistoryStore::append(store_path, arr_visits[i], i + 1));
+    }
+
+    uint64_t visit_count(void)
+    {
+        HistoryStore store;
+        store.open(store_path);
+        return store.visit_count();
+    }
+
+    // The server records where it sends a client after answering
+    bool wait_for_visits(uint64_t count)
+    {
+        for (int i=0; i<200 && visit_count() != count; i++)
+            this_thread::sleep_for(chrono::milliseconds(10));
+        return visit_count() == count;
+    }
+
+    bool request(const vector<string>& args, const string& cwd, string& text_out, string& text_err)
+    {
+        return server_request(socket_path, args, cwd, "--store=" + store_path, text_out, text_err);
+    }
+
+    // The same request answered from the store in process
+    void local(const vector<string>& args, const string& cwd, string& text_out, string& text_err)
+    {
+        Cdd cdd;
+        vector<const char *> av;
+        av.push_back("_cdd");
+        for (size_t i=0; i<args.size(); i++)
+            av.push_back(args[i].c_str());
+        HistoryStore store;
+        store.open(store_path);
+        if (cdd.options(av.size(), av.data(), "--store=" + store_path))
+            cdd.process_store(store, cwd);
+        text_out = cdd.strm_out.str();
+        text_err = cdd.strm_err.str();
+    }
+};
+
+TEST_CASE("server_test")
+{
+
+SECTION("server_same_as_local")
+{
+    TestServer test;
+    const char *specs[] = {"-", "-2", "+0", ",", ",1", "opt", "-?", ",?", "+?", "nowhere"};
+    for (size_t i=0; i<countof(specs); i++)
+    {
+        vector<string> args = {specs[i]};
+        string server_out, server_err, local_out, local_err;
+        test.write_store();
+        test.local(args, "/opt/d", local_out, local_err);
+        uint64_t visits = test.visit_count();
+
+        // The server finds the store written again
+        test.write_store();
+        REQUIRE(test.request(args, "/opt/d", server_out, server_err));
+        REQUIRE(local_out == server_out);
+        REQUIRE(local_err == server_err);
+        REQUIRE(test.wait_for_visits(visits));
+    }
+}
+
+SECTION("server_records_visits")
+{
+    TestServer test;
+    string text_out, text_err;
+    REQUIRE(test.request({"-?"}, "/opt/e", text_out, text_err));
+    REQUIRE(test.request({"-?"}, "/opt/e", text_out, text_err));
+    REQUIRE(test.request({"-"}, "/opt/b", text_out, text_err));
+    REQUIRE("pushd '/opt/e'\n" == text_out);
+
+    // Recorded once for each change of directory, and where the client
+    // was sent
+    REQUIRE(test.wait_for_visits(8));
+
+    // Visits by shells that do not use the server are seen
+    REQUIRE(HistoryStore::append(test.store_path, "/opt/f", 9));
+    REQUIRE(test.request({"-"}, "/opt/b", text_out, text_err));
+    REQUIRE("pushd '/opt/f'\n" == text_out);
+    REQUIRE(test.wait_for_visits(11));
+
+    // So is a compaction
+    REQUIRE(HistoryStore::compact(test.store_path));
+    REQUIRE(test.request({",?"}, "/opt/f", text_out, text_err));
+    REQUIRE(0 == text_err.find(" ,0: ( 3) /opt/b\n"));
+    HistoryStore store;
+    REQUIRE(store.open(test.store_path));
+    REQUIRE(0 == store.log_tail());
+    REQUIRE(11 == store.visit_count());
+}
+
+SECTION("server_shared_index")
+{
+    TestServer test;
+    string env_options = "--store=" + test.store_path;
+    string text_out, text_err, local_out, local_err;
+    // Only for a client at the top of the stack
+    REQUIRE(!shared_request(test.socket_path, {"-"}, "/opt/a", env_options, text_out, text_err));
+    REQUIRE(shared_request(test.socket_path, {"-"}, "/opt/d", env_options, text_out, text_err));
+    REQUIRE("pushd '/opt/a'\n" == text_out);
+    // The client records where it goes, the server publishes it
+    REQUIRE(6 == test.visit_count());
+    bool answered = false;
+    for (int i=0; i<200 && !answered; i++)
+    {
+        answered = shared_request(test.socket_path, {"-?"}, "/opt/a", env_options, text_out, text_err);
+        if (!answered)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    REQUIRE(answered);
+    test.local({"-?"}, "/opt/a", local_out, local_err);
+    REQUIRE(local_out == text_out);
+    REQUIRE(local_err == text_err);
+
+    // Not for another store, or a request that changes the store
+    REQUIRE(!shared_request(test.socket_path, {"-"}, "/opt/a", "--store=/elsewhere", text_out, text_err));
+    REQUIRE(!shared_request(test.socket_path, {"--gc"}, "/opt/a", env_options, text_out, text_err));
+    REQUIRE(!shared_request(test.socket_path + ".none", {"-"}, "/opt/a", env_options, text_out, text_err));
+}
+
+SECTION("server_declines")
+{
+    TestServer test;
+    string text_out, text_err;
+    // Not a request for the store it holds
+    REQUIRE(!server_request(test.socket_path, {"-"}, "/opt/d", "", text_out, text_err));
+    REQUIRE(!server_request(test.socket_path, {"-"}, "/opt/d", "--store=/elsewhere", text_out, text_err));
+    // No server
+    REQUIRE(!server_request(test.socket_path + ".none", {"-"}, "/opt/d", "--store=" + test.store_path, text_out, text_err));
+    REQUIRE(!server_request("", {"-"}, "/opt/d", "--store=" + test.store_path, text_out, text_err));
+    // Nor one that would hold up every other client while it runs
+    const char *slow[] = {"--discover", "--prune", "--gc", "--delete", "--reset", "--compact"};
+    for (size_t i=0; i<countof(slow); i++)
+        REQUIRE(!server_request(test.socket_path, {slow[i], "nowhere"}, "/opt/d", "--store=" + test.store_path, text_out, text_err));
+
+    REQUIRE(0 == test.server.handle("cdd-server-request\n").find("cdd-response error 0 1\n"));
+}
+
+SECTION("server_parallel_clients")
+{
+    TestServer test;
+    // None of these sends the client anywhere, so the store stays as it is
+    const char *specs[] = {"-?", ",?", "+?", "nowhere"};
+    vector<string> expect_out(countof(specs)), expect_err(countof(specs));
+    for (size_t i=0; i<countof(specs); i++)
+        test.local({specs[i]}, "/opt/d", expect_out[i], expect_err[i]);
+
+    // Many clients at once, all answered in full
+    const int client_count = 16;
+    const int request_count = 50;
+    atomic<int> failures(0);
+    vector<thread> clients;
+    for (int c=0; c<client_count; c++)
+    {
+        clients.push_back(thread([&, c]() {
+            for (int i=0; i<request_count; i++)
+            {
+                size_t k = (c + i) % countof(specs);
+                string text_out, text_err;
+                if (!test.request({specs[k]}, "/opt/d", text_out, text_err)
+                    || text_out != expect_out[k] || text_err != expect_err[k])
+                    failures++;
+            }
+        }));
+    }
+    for (size_t c=0; c<clients.size(); c++)
+        clients[c].join();
+    REQUIRE(0 == failures);
+}
+
+}
+
+#endif
+
+// vim:ff=unix
@@ -0,0 +1,444 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "stdafx.h"
+#include <cdd/cdd_snapshot.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <cstdio>
+
+#include "catch.hpp"
+
+#define countof(x) (sizeof(x)/sizeof(x[0]))
+
+// A directory stack, top first
+static string arr_stack[] = {
+    "/opt/d",
+    "/opt/a",
+    "/opt/c",
+    "/usr/b",
+    "/opt/a",
+    "/opt/e",
+};
+
+// A stack of size entries from count directories, top first
+static vector<string> make_stack(size_t size, size_t count, size_t seed)
+{
+    vector<string> result;
+    for (size_t i=0; i<size; i++)
+        result.push_back("/home/user/dir" + to_string((i * 7 + seed) % count));
+    return result;
+}
+
+// Every step of the snapshot is a spelling in its index, and the top
+// is the first directory of the stack it was built from
+static bool consistent(const IndexSnapshot& snapshot, const string& top)
+{
+    if (snapshot.stack_size() == 0 || snapshot.index.arena[snapshot.stack_name(0)] != top)
+        return false;
+    for (size_t i=0; i<snapshot.stack_size(); i++)
+    {
+        if (snapshot.stack_name(i) >= snapshot.index.arena.size()
+            || snapshot.index.stack_id(i) >= snapshot.index.entry_count())
+            return false;
+    }
+    return true;
+}
+
+TEST_CASE("snapshot_test")
+{
+
+SECTION("snapshot_same_as_stack")
+{
+    vector<string> stack(arr_stack, arr_stack + countof(arr_stack));
+    unique_ptr<IndexSnapshot> snapshot(IndexSnapshot::build(stack));
+    const char *directions[] = {"-", "+", ","};
+    const char *paths[] = {"-1", "-2", "+0", "+2", ",0", ",1", "opt", "usr", "nowhere"};
+    for (size_t i=0; i<countof(directions); i++)
+    {
+        Cdd cdd_snapshot;
+        cdd_snapshot.assign(*snapshot, "/opt/d");
+        cdd_snapshot.opt_history = true;
+        cdd_snapshot.direction.assign(directions[i]);
+        cdd_snapshot.process();
+
+        Cdd cdd_stack(arr_stack, countof(arr_stack), "/opt/d");
+        cdd_stack.opt_history = true;
+        cdd_stack.direction.assign(directions[i]);
+        cdd_stack.process();
+
+        REQUIRE(cdd_stack.strm_err.str() == cdd_snapshot.strm_err.str());
+    }
+    for (size_t i=0; i<countof(paths); i++)
+    {
+        // The same snapshot serves any number of requests
+        Cdd cdd_snapshot;
+        cdd_snapshot.assign(*snapshot, "/opt/d");
+        cdd_snapshot.set_opt_path(paths[i]);
+        cdd_snapshot.process();
+
+        Cdd cdd_stack(arr_stack, countof(arr_stack), "/opt/d");
+        cdd_stack.set_opt_path(paths[i]);
+        cdd_stack.process();
+
+        REQUIRE(cdd_stack.strm_out.str() == cdd_snapshot.strm_out.str());
+        REQUIRE(cdd_stack.strm_err.str() == cdd_snapshot.strm_err.str());
+    }
+}
+
+SECTION("snapshot_reclaim")
+{
+    SnapshotPublisher publisher;
+    SnapshotPublisher::Reader reader(publisher);
+    REQUIRE(nullptr == reader.acquire());
+    reader.release();
+
+    publisher.publish(IndexSnapshot::build(make_stack(10, 5, 0)));
+    const IndexSnapshot *held = reader.acquire();
+    REQUIRE(held != nullptr);
+
+    // Kept while the reader may still read it
+    publisher.publish(IndexSnapshot::build(make_stack(10, 5, 1)));
+    REQUIRE(1 == publisher.retired_count());
+    REQUIRE(consistent(*held, "/home/user/dir0"));
+
+    // A new acquire moves the reader on
+    const IndexSnapshot *current = reader.acquire();
+    REQUIRE(consistent(*current, "/home/user/dir1"));
+    publisher.reclaim();
+    REQUIRE(0 == publisher.retired_count());
+
+    reader.release();
+    publisher.publish(IndexSnapshot::build(make_stack(10, 5, 2)));
+    REQUIRE(0 == publisher.retired_count());
+}
+
+SECTION("snapshot_concurrent_readers")
+{
+    SnapshotPublisher publisher;
+    publisher.publish(IndexSnapshot::build(make_stack(200, 50, 0)));
+    atomic<bool> done(false);
+    atomic<int> failures(0);
+    atomic<long> reads(0);
+    vector<thread> readers;
+    for (int r=0; r<4; r++)
+    {
+        readers.push_back(thread([&]() {
+            SnapshotPublisher::Reader reader(publisher);
+            while (!done)
+            {
+                // Each snapshot is whole, whichever one is found
+                const IndexSnapshot *snapshot = reader.acquire();
+                string top(snapshot->index.arena[snapshot->stack[0]]);
+                size_t seed = stoul(top.substr(top.find("dir") + 3));
+                if (!consistent(*snapshot, top) || snapshot->stack.size() != 200
+                    || snapshot->index.arena[snapshot->stack[1]] != "/home/user/dir" + to_string((7 + seed) % 50))
+                    failures++;
+                reader.release();
+                reads++;
+                this_thread::yield();
+            }
+        }));
+    }
+    for (size_t i=1; i<=200; i++)
+    {
+        publisher.publish(IndexSnapshot::build(make_stack(200, 50, i)));
+        this_thread::yield();
+    }
+    done = true;
+    for (size_t r=0; r<readers.size(); r++)
+        readers[r].join();
+    REQUIRE(0 == failures);
+    REQUIRE(reads > 0);
+    // Nothing holds a replaced snapshot any more
+    publisher.reclaim();
+    REQUIRE(0 == publisher.retired_count());
+}
+
+SECTION("snapshot_shared")
+{
+    string file_path = "snapshot_test.tmp";
+    remove(file_path.c_str());
+    SharedIndex shared;
+    string error;
+    REQUIRE(shared.create(file_path, error));
+    // Nothing published yet
+    SharedIndexReader reader;
+    REQUIRE(reader.open(file_path));
+    REQUIRE(nullptr == reader.acquire("/store"));
+
+    vector<string> stack(arr_stack, arr_stack + countof(arr_stack));
+    unique_ptr<IndexSnapshot> snapshot(IndexSnapshot::build(stack));
+    REQUIRE(shared.publish(*snapshot, "/store"));
+    REQUIRE(nullptr == reader.acquire("/other"));
+    // Grown since it was opened
+    const IndexSnapshot *found = reader.acquire("/store");
+    REQUIRE(found);
+    const char *paths[] = {"-1", "-2", "+0", ",1", "opt", "nowhere"};
+    for (size_t i=0; i<countof(paths); i++)
+    {
+        Cdd cdd_shared;
+        cdd_shared.assign(*found, "/opt/d");
+        cdd_shared.set_opt_path(paths[i]);
+        cdd_shared.process();
+
+        Cdd cdd_stack(arr_stack, countof(arr_stack), "/opt/d");
+        cdd_stack.set_opt_path(paths[i]);
+        cdd_stack.process();
+
+        REQUIRE(cdd_stack.strm_out.str() == cdd_shared.strm_out.str());
+        REQUIRE(cdd_stack.strm_err.str() == cdd_shared.strm_err.str());
+    }
+    REQUIRE(reader.unchanged());
+    REQUIRE(shared.publish(*snapshot, "/store"));
+    REQUIRE(!reader.unchanged());
+
+    // What a reader finds is whole whenever the image did not change
+    // under it, while the file grows and images of other sizes are
+    // written over each other
+    atomic<bool> done(false);
+    atomic<int> failures(0);
+    atomic<int> reads(0);
+    thread reader_thread([&]() {
+        SharedIndexReader reader;
+        reader.open(file_path);
+        while (!done)
+        {
+            const IndexSnapshot *found = reader.acquire("/store");
+            // Or the image of arr_stack from before
+            if (!found || found->stack_size() == countof(arr_stack))
+                continue;
+            string top(found->index.arena[found->stack_name(0)]);
+            size_t size = found->stack_size();
+            size_t seed = top.find("dir") == string::npos ? 0 : stoul(top.substr(top.find("dir") + 3));
+            bool whole = consistent(*found, top) && size > 1
+                && found->index.arena[found->stack_name(size - 1)]
+                   == "/home/user/dir" + to_string(((size - 1) * 7 + seed) % (size / 2));
+            if (!reader.unchanged())
+                continue;
+            if (!whole)
+                failures++;
+            reads++;
+        }
+    });
+    for (size_t i=0; i<300; i++)
+    {
+        size_t size = 10 + (i * 37) % 2000;
+        unique_ptr<IndexSnapshot> next(IndexSnapshot::build(make_stack(size, size / 2, i)));
+        REQUIRE(shared.publish(*next, "/store"));
+    }
+    while (reads == 0)
+        this_thread::yield();
+    done = true;
+    reader_thread.join();
+    REQUIRE(0 == failures);
+
+    // Not a shared index at all
+    shared.close();
+    reader.close();
+    FILE *file = fopen(file_path.c_str(), "w");
+    fputs(string(1024, 'x').c_str(), file);
+    fclose(file);
+    REQUIRE(reader.open(file_path));
+    REQUIRE(nullptr == reader.acquire("/store"));
+    reader.close();
+    remove(file_path.c_str());
+}
+
+SECTION("snapshot_stack_cache")
+{
+    string lines;
+    for (size_t i=0; i<countof(arr_stack); i++)
+        lines += arr_stack[i] + "\n";
+    uint64_t hash = StackCache::hash(lines.data(), lines.size());
+    string file_path = StackCache::file_path(".", hash);
+    remove(file_path.c_str());
+
+    // Built and written the first time, read from the cache after.  The
+    // backwards and forwards positions only index the top of the stack
+    // and leave the cache alone.
+    const char *paths[] = {"-1", "+0", ",1", "%0", "opt", "nowhere"};
+    for (int pass=0; pass<2; pass++)
+    {
+        for (size_t i=0; i<countof(paths); i++)
+        {
+            Cdd cdd_cached;
+            cdd_cached.assign_cached(lines, "/opt/d", ".");
+            cdd_cached.set_opt_path(paths[i]);
+            cdd_cached.process();
+            REQUIRE((i >= 2) == bool(cdd_cached.snapshot));
+            REQUIRE((pass == 0 && i == 2) == bool(cdd_cached.built_snapshot));
+            if (pass == 0 && i < 2)
+                REQUIRE(nullptr == fopen(file_path.c_str(), "r"));
+
+            Cdd cdd_stack;
+            cdd_stack.assign_cached(lines, "/opt/d", "");
+            cdd_stack.set_opt_path(paths[i]);
+            cdd_stack.process();
+
+            REQUIRE(cdd_stack.strm_out.str() == cdd_cached.strm_out.str());
+            REQUIRE(cdd_stack.strm_err.str() == cdd_cached.strm_err.str());
+        }
+    }
+
+    // Another stack in the same file is not taken for this one
+    StackCache cache;
+    REQUIRE(cache.read(file_path, StackCache::key(hash, lines.size())));
+    REQUIRE(nullptr == cache.read(file_path, StackCache::key(hash + StackCache::slot_count, lines.size())));
+    string other = "/opt/x\n" + lines;
+    REQUIRE(StackCache::hash(other.data(), other.size()) != hash);
+
+    // Nor is a file that is not a cache
+    FILE *file = fopen(file_path.c_str(), "w");
+    fputs(string(1024, 'x').c_str(), file);
+    fclose(file);
+    Cdd cdd;
+    cdd.assign_cached(lines, "/opt/d", ".");
+    cdd.opt_history = true;
+    cdd.process();
+    REQUIRE(cdd.built_snapshot);
+    REQUIRE(cache.read(file_path, StackCache::key(hash, lines.size())));
+    remove(file_path.c_str());
+}
+
+SECTION("snapshot_stack_cache_budget")
+{
+    // Indexing for the cache is held to the budget started before it,
+    // one millisecond for each line, and a stack cut short is not cached
+    string lines;
+    for (int i=0; i<1000; i++)
+        lines += "/deep/" + to_string(i) + "\n";
+    uint64_t hash = StackCache::hash(lines.data(), lines.size());
+    string file_path = StackCache::file_path(".", hash);
+    remove(file_path.c_str());
+    Cdd cdd;
+    int64_t now = 0;
+    cdd.clock = [&now]() { return now++; };
+    cdd.opt_budget_ms = 20;
+    cdd.opt_all = true;
+    cdd.set_opt_path("deep");
+    cdd.direction.assign("-");
+    cdd.start_budget();
+    cdd.assign_cached(lines, "/opt/d", ".");
+    cdd.process();
+    REQUIRE(cdd.built_snapshot);
+    REQUIRE(20 > cdd.built_snapshot->stack_size());
+    REQUIRE(nullptr == fopen(file_path.c_str(), "r"));
+    string err = cdd.strm_err.str();
+    REQUIRE(err.substr(err.rfind("cdd: over")) == "cdd: over the budget of 20 ms, the result may be incomplete\n");
+}
+
+}
+
+// Reader throughput while a writer keeps publishing, run with
+// "testmain [.bench]"
+TEST_CASE("snapshot_bench", "[.bench]")
+{
+    const int thread_counts[] = {1, 2, 4, 8};
+    vector<IndexSnapshot *> built;
+    for (size_t i=0; i<8; i++)
+        built.push_back(IndexSnapshot::build(make_stack(40000, 20000, i)));
+    for (size_t t=0; t<countof(thread_counts); t++)
+    {
+        SnapshotPublisher publisher;
+        // The publisher owns each snapshot it is given, so it gets copies
+        publisher.publish(new IndexSnapshot(*built[0]));
+        atomic<bool> done(false);
+        atomic<long> reads(0);
+        vector<thread> readers;
+        for (int r=0; r<thread_counts[t]; r++)
+        {
+            readers.push_back(thread([&]() {
+                SnapshotPublisher::Reader reader(publisher);
+                long count = 0;
+                while (!done)
+                {
+                    Cdd cdd;
+                    cdd.assign(*reader.acquire(), "/home/user/dir0");
+                    cdd.set_opt_path("-3");
+                    cdd.process();
+                    reader.release();
+                    count++;
+                }
+                reads += count;
+            }));
+        }
+        auto start = chrono::steady_clock::now();
+        size_t published = 0;
+        while (chrono::steady_clock::now() - start < chrono::seconds(1))
+        {
+            publisher.publish(new IndexSnapshot(*built[++published % built.size()]));
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        done = true;
+        for (size_t r=0; r<readers.size(); r++)
+            readers[r].join();
+        cout << thread_counts[t] << " readers: " << reads << " requests/s, "
+             << published << " snapshots published" << endl;
+    }
+    for (size_t i=0; i<built.size(); i++)
+        delete built[i];
+}
+
+// The cost of "cdd -?" and "cdd -" on a stack of 50000 directories read
+// as lines, without a cache, when the cache misses and has to be written,
+// and when it hits, run with "testmain [.bench]"
+TEST_CASE("stack_cache_bench", "[.bench]")
+{
+    vector<string> stack = make_stack(50000, 20000, 1);
+    string lines;
+    for (size_t i=0; i<stack.size(); i++)
+        lines += stack[i] + "\n";
+    uint64_t hash = StackCache::hash(lines.data(), lines.size());
+    string file_path = StackCache::file_path(".", hash);
+    const char *commands[] = {"-?", "-"};
+    const char *modes[] = {"no cache", "miss", "hit"};
+    for (size_t c=0; c<countof(commands); c++)
+    {
+        for (size_t m=0; m<countof(modes); m++)
+        {
+            const int runs = 20;
+            auto start = chrono::steady_clock::now();
+            for (int i=0; i<runs; i++)
+            {
+                if (m == 1)
+                    remove(file_path.c_str());
+                Cdd cdd;
+                if (c == 0)
+                    cdd.opt_history = true;
+                else
+                    cdd.set_opt_path("-");
+                cdd.assign_cached(lines, stack[0], m == 0 ? "" : ".");
+                cdd.process();
+            }
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / runs;
+            cout << "cdd " << commands[c] << " " << modes[m] << ": " << ms << " ms" << endl;
+        }
+    }
+    remove(file_path.c_str());
+}
+
+// vim:ff=unix
@@ -21,6 +21,8 @@ along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "stdafx.h"
+#include <random>
+#include <set>
 
 #include "catch.hpp"
 
@@ -33,6 +35,15 @@ static string arr_test_dirs[] = {
     "aa",   // first visited,    0
 };
 
+static vector<string> commons(Cdd::LazyView<Cdd::CommonView>& view)
+{
+    // Entry numbers differ between indexes, so no sequence
+    vector<string> result;
+    for (size_t i=0; i<view.size(); i++)
+        result.push_back(to_string(view[i].count) + " " + string(view[i].dir));
+    return result;
+}
+
 vector<string> splitlines(stringstream& strm)
 {
     vector<string> result;
@@ -97,6 +108,61 @@ SECTION("delete_one")
     REQUIRE("cdd del: bb\n" == cdd.strm_err.str());
 }
 
+// Existence of directories without touching the file system
+struct CddExists : public Cdd
+{
+    set<string> existing;
+    vector<vector<string>> batches;
+    CddExists(string arr_pushd[], int count, string current_path) : Cdd(arr_pushd, count, current_path) {}
+    virtual vector<bool> are_directories(const vector<string>& paths)
+    {
+        batches.push_back(paths);
+        vector<bool> found;
+        for (size_t i=0; i<paths.size(); i++)
+            found.push_back(existing.count(paths[i]) > 0);
+        return found;
+    }
+};
+
+SECTION("prune")
+{
+    CddExists cdd(arr_test_dirs, countof(arr_test_dirs), "dd");
+    cdd.existing = {"aa", "cc"};
+    cdd.opt_prune = true;
+    cdd.process();
+    // Each directory is checked once, in one batch
+    REQUIRE(1 == cdd.batches.size());
+    REQUIRE(vector<string>({"aa", "bb", "cc"}) == cdd.batches[0]);
+    vector<string> act = splitlines(cdd.strm_out);
+    vector<string> exp = {
+#ifdef WIN32
+        "for /l %%i in (1,1,4) do popd",
+        "chdir/d aa 2>nul",
+        "pushd cc 2>nul",
+        "pushd aa 2>nul",
+        "pushd dd 2>nul",
+        "pushd dd",
+#else
+        "dirs -c",
+        "\\cd 'aa'",
+        "pushd 'cc'",
+        "pushd 'aa'",
+#endif
+    };
+    REQUIRE( exp == act );
+    REQUIRE("cdd prune: bb\n" == cdd.strm_err.str());
+}
+
+SECTION("prune_nothing")
+{
+    CddExists cdd(arr_test_dirs, countof(arr_test_dirs), "dd");
+    cdd.existing = {"aa", "bb", "cc", "dd"};
+    cdd.opt_prune = true;
+    cdd.process();
+    REQUIRE("" == cdd.strm_out.str());
+    REQUIRE("cdd prune: nothing to remove\n" == cdd.strm_err.str());
+}
+
 SECTION("reset")
 {
     Cdd cdd(arr_test_dirs, countof(arr_test_dirs), "dd");
@@ -191,6 +257,269 @@ SECTION("command_generator_3")
 
 //----------------------------------------------------------------------
 
+// Counts the stat calls made while filtering out the current path
+// (as the stack is indexed, here forced by taking the size of the list),
+// with inodes taken from a table instead of the file system.
+struct CddStat: Cdd
+{
+    map<string, int> inodes;
+    unsigned stat_count = 0;
+    // Paths under it are on a network file system
+    string remote_prefix;
+    CddStat(void) { identity_cache_path.clear(); }
+    virtual bool is_remote_path(const string& path)
+    {
+        return !remote_prefix.empty() && path.compare(0, remote_prefix.size(), remote_prefix) == 0;
+    }
+    virtual FileId get_file_id(const string& path)
+    {
+        stat_count++;
+        FileId id;
+        map<string, int>::iterator it = inodes.find(path);
+        if (it != inodes.end())
+            id.dev = 1, id.ino = it->second;
+        return id;
+    }
+    virtual void stat_paths(const vector<string>& paths, vector<StatBatch::Result>& results)
+    {
+        results.assign(paths.size(), StatBatch::Result());
+        for (size_t i=0; i<paths.size(); i++)
+        {
+            results[i].id = get_file_id(paths[i]);
+            results[i].is_directory = results[i].id.valid();
+            if (!results[i].is_directory)
+                results[i].error = ENOENT;
+        }
+    }
+};
+
+SECTION("stat_current_path_equal")
+{
+    // The top of the stack spells the current path the same way
+    CddStat cdd;
+    cdd.assign(arr_test_dirs, countof(arr_test_dirs), "aa");
+    REQUIRE(2 == cdd.vec_dir_last_to_first.size());
+    REQUIRE(0 == cdd.stat_count);
+}
+
+SECTION("stat_current_path_other")
+{
+    // Only the top of the stack needs a check, along with the current path
+    CddStat cdd;
+    cdd.inodes["dd"] = 4;
+    cdd.assign(arr_test_dirs, countof(arr_test_dirs), "dd");
+    REQUIRE(3 == cdd.vec_dir_last_to_first.size());
+    REQUIRE(2 == cdd.stat_count);
+}
+
+SECTION("stat_current_path_alias")
+{
+    string arr_dir[] = {
+        "/home/u/w",        // symlink to /data/work
+        "/data/other",
+        "/mnt/work",        // bind mount of /data/work
+        "/data/work",
+        "/data/other",
+        "/srv/other",
+    };
+    CddStat cdd;
+    cdd.inodes["/data/work"] = 7;
+    cdd.inodes["/home/u/w"] = 7;
+    cdd.inodes["/mnt/work"] = 7;
+    cdd.assign(arr_dir, countof(arr_dir), "/data/work");
+    REQUIRE(2 == cdd.vec_dir_last_to_first.size());
+    // current path, top of the stack and /mnt/work
+    REQUIRE(3 == cdd.stat_count);
+    REQUIRE("/data/other" == cdd.vec_dir_last_to_first[0]);
+    REQUIRE("/srv/other" == cdd.vec_dir_last_to_first[1]);
+}
+
+SECTION("stat_current_path_other_name")
+{
+    // An alias by another name below the top is not stat'ed, so it is
+    // not filtered out
+    string arr_dir[] = {
+        "/data/work",
+        "/data/other",
+        "/home/u/w",        // symlink to /data/work
+    };
+    CddStat cdd;
+    cdd.inodes["/data/work"] = 7;
+    cdd.inodes["/home/u/w"] = 7;
+    cdd.assign(arr_dir, countof(arr_dir), "/data/work");
+    REQUIRE(2 == cdd.vec_dir_last_to_first.size());
+    REQUIRE("/data/other" == cdd.vec_dir_last_to_first[0]);
+    REQUIRE("/home/u/w" == cdd.vec_dir_last_to_first[1]);
+    REQUIRE(0 == cdd.stat_count);
+}
+
+SECTION("stat_current_path_remote")
+{
+    // Paths on a network file system are only compared by name
+    string arr_dir[] = {
+        "/mnt/work",        // bind mount of /data/work
+        "/data/other",
+        "/net/work",        // NFS export of /data/work
+    };
+    CddStat cdd;
+    cdd.remote_prefix = "/net/";
+    cdd.inodes["/data/work"] = 7;
+    cdd.inodes["/mnt/work"] = 7;
+    cdd.inodes["/net/work"] = 7;
+    cdd.assign(arr_dir, countof(arr_dir), "/data/work");
+    REQUIRE(2 == cdd.vec_dir_last_to_first.size());
+    REQUIRE("/data/other" == cdd.vec_dir_last_to_first[0]);
+    REQUIRE("/net/work" == cdd.vec_dir_last_to_first[1]);
+    REQUIRE(2 == cdd.stat_count);
+
+    SECTION("stat_current_path_remote_opt")
+    {
+        CddStat cdd_remote;
+        cdd_remote.remote_prefix = "/net/";
+        cdd_remote.inodes = cdd.inodes;
+        cdd_remote.opt_stat_remote = true;
+        cdd_remote.assign(arr_dir, countof(arr_dir), "/net/work");
+        REQUIRE(1 == cdd_remote.vec_dir_last_to_first.size());
+        REQUIRE("/data/other" == cdd_remote.vec_dir_last_to_first[0]);
+    }
+}
+
+SECTION("dedupe")
+{
+    string arr_dir[] = {
+        "/home/u/w",        // symlink to /data/work
+        "/data/other",
+        "/mnt/work",        // bind mount of /data/work
+        "/data/work",
+        "/srv/other",
+        "/data/work",
+    };
+    CddStat cdd;
+    cdd.inodes["/home/u/w"] = 7;
+    cdd.inodes["/mnt/work"] = 7;
+    cdd.inodes["/data/work"] = 7;
+    cdd.inodes["/data/other"] = 8;
+    cdd.inodes["/srv/other"] = 9;
+    cdd.assign(arr_dir, countof(arr_dir), "/tmp");
+    cdd.opt_dedupe = true;
+    cdd.opt_history = true;
+    cdd.direction.assign(",");
+    cdd.process();
+    // Every alias counts as the path at its most recent visit
+    REQUIRE(" ,0: ( 4) /home/u/w\n ,1: ( 1) /data/other\n ,2: ( 1) /srv/other\n" == cdd.strm_err.str());
+
+    SECTION("dedupe_off")
+    {
+        CddStat cdd_off;
+        cdd_off.inodes = cdd.inodes;
+        cdd_off.assign(arr_dir, countof(arr_dir), "/tmp");
+        cdd_off.opt_history = true;
+        cdd_off.direction.assign(",");
+        cdd_off.process();
+        REQUIRE(" ,0: ( 2) /data/work\n ,1: ( 1) /home/u/w\n ,2: ( 1) /data/other\n"
+                " ,3: ( 1) /mnt/work\n ,4: ( 1) /srv/other\n" == cdd_off.strm_err.str());
+    }
+
+    SECTION("dedupe_remote")
+    {
+        // Left apart when on a network file system
+        CddStat cdd_remote;
+        cdd_remote.inodes = cdd.inodes;
+        cdd_remote.remote_prefix = "/mnt/";
+        cdd_remote.assign(arr_dir, countof(arr_dir), "/tmp");
+        cdd_remote.opt_dedupe = true;
+        cdd_remote.opt_history = true;
+        cdd_remote.direction.assign(",");
+        cdd_remote.process();
+        REQUIRE(" ,0: ( 3) /home/u/w\n ,1: ( 1) /data/other\n ,2: ( 1) /mnt/work\n ,3: ( 1) /srv/other\n"
+                == cdd_remote.strm_err.str());
+    }
+}
+
+SECTION("stack_index_delta")
+{
+    // Random pushes, pops and deletes, checked each time against the
+    // same stack indexed from scratch
+    const char *names[] = {"/r/a", "/r/b", "/r/b/", "/r/c", "/r/d", "/r/e", "/r/f", "/r/g"};
+    StackIndex stack_index;
+    vector<string> stack;
+    // The tick of each visit, one more than the one below it had
+    vector<uint64_t> ticks;
+    mt19937 random(20);
+    for (int step=0; step<2000; step++)
+    {
+        unsigned op = random() % 10;
+        if (op < 6 || stack.empty())
+        {
+            string dir = names[random() % countof(names)];
+            stack_index.push(dir);
+            ticks.insert(ticks.begin(), stack.empty() ? 0 : ticks[0] + 1);
+            stack.insert(stack.begin(), dir);
+        }
+        else if (op < 8)
+        {
+            size_t count = min<size_t>(random() % 2 + 1, stack.size());
+            REQUIRE(stack_index.pop(count));
+            stack.erase(stack.begin(), stack.begin() + count);
+            ticks.erase(ticks.begin(), ticks.begin() + count);
+        }
+        else
+        {
+            size_t position = random() % stack.size();
+            REQUIRE(stack_index.erase(position));
+            stack.erase(stack.begin() + position);
+            ticks.erase(ticks.begin() + position);
+        }
+        REQUIRE_FALSE(stack_index.pop(stack.size() + 1));
+        REQUIRE_FALSE(stack_index.erase(stack.size()));
+        REQUIRE(stack.size() == stack_index.size());
+
+        CddStat cdd_rebuilt;
+        cdd_rebuilt.inodes["/r/c"] = 3;
+        cdd_rebuilt.inodes["/r/g"] = 3;
+        cdd_rebuilt.assign(stack, "/r/c");
+        CddStat cdd_delta;
+        cdd_delta.inodes = cdd_rebuilt.inodes;
+        cdd_delta.assign(stack_index, "/r/c");
+
+        REQUIRE(cdd_rebuilt.vec_dir_stack.strings() == cdd_delta.vec_dir_stack.strings());
+        REQUIRE(cdd_rebuilt.vec_dir_last_to_first.strings() == cdd_delta.vec_dir_last_to_first.strings());
+        REQUIRE(cdd_rebuilt.vec_dir_first_to_last.strings() == cdd_delta.vec_dir_first_to_last.strings());
+        REQUIRE(commons(cdd_rebuilt.vec_dir_most_to_least) == commons(cdd_delta.vec_dir_most_to_least));
+        // A visit deleted from the middle leaves a gap in the ticks that
+        // counts as a visit, here to a directory of its own
+        vector<string> ticked;
+        for (size_t i=0; i<stack.size(); i++)
+        {
+            ticked.push_back(stack[i]);
+            for (uint64_t tick=ticks[i]; i+1<stack.size() && --tick>ticks[i+1]; )
+                ticked.push_back("/gap/" + to_string(tick));
+        }
+        CddStat cdd_ticked;
+        cdd_ticked.inodes = cdd_rebuilt.inodes;
+        cdd_ticked.assign(ticked, "/r/c");
+        vector<string> frecent;
+        for (const string& common : commons(cdd_ticked.vec_dir_frecent))
+        {
+            if (common.find("/gap/") == string::npos)
+                frecent.push_back(common);
+        }
+        REQUIRE(frecent == commons(cdd_delta.vec_dir_frecent));
+        REQUIRE(cdd_rebuilt.distinct_count() == stack_index.distinct_count());
+        const PathIndex& index = cdd_rebuilt.path_index;
+        for (size_t i=0; i<stack.size(); i++)
+        {
+            const PathIndex::Entry& entry = index.entry(index.stack_id(i));
+            uint32_t id = stack_index.stack_id(i);
+            REQUIRE(entry.first == stack_index.first(id));
+            REQUIRE(entry.last == stack_index.last(id));
+            REQUIRE(entry.count == stack_index.count(id));
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+
 }
 
 // vim:ff=unix
@@ -0,0 +1,237 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include <cdd/cdd_stat.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+
+#include "catch.hpp"
+
+static const string file_path = "stat_test.tmp";
+
+// A directory, a file, a missing path and a path through a file
+static vector<string> make_paths(size_t count)
+{
+    const char *kinds[] = {".", "stat_test.tmp", "stat_test.tmp.none", "stat_test.tmp/x"};
+    vector<string> paths;
+    for (size_t i=0; i<count; i++)
+        paths.push_back(kinds[i % 4]);
+    return paths;
+}
+
+TEST_CASE("stat_test")
+{
+
+SECTION("stat_batch")
+{
+    FILE *file = fopen(file_path.c_str(), "w");
+    fclose(file);
+    StatBatch::Engine engines[] = {StatBatch::ENGINE_AUTO, StatBatch::ENGINE_THREADS};
+    size_t counts[] = {1, 4, 1000};
+    for (StatBatch::Engine engine : engines)
+    {
+        for (size_t count : counts)
+        {
+            StatBatch batch;
+            batch.engine = engine;
+            // Fewer slots than paths, so that they are used again
+            batch.queue_depth = 16;
+            vector<string> paths = make_paths(count);
+            vector<StatBatch::Result> results;
+            batch.run(paths, results);
+            REQUIRE(paths.size() == results.size());
+            REQUIRE((engine == StatBatch::ENGINE_AUTO && count > 1 && StatBatch::has_uring()) == batch.used_uring);
+            for (size_t i=0; i<count; i++)
+            {
+                const StatBatch::Result& result = results[i];
+                switch (i % 4)
+                {
+                case 0:
+                    REQUIRE(0 == result.error);
+                    REQUIRE(result.is_directory);
+                    break;
+                case 1:
+                    REQUIRE(0 == result.error);
+                    REQUIRE_FALSE(result.is_directory);
+                    break;
+                case 2:
+                    REQUIRE(ENOENT == result.error);
+                    break;
+                case 3:
+                    REQUIRE(ENOTDIR == result.error);
+                    break;
+                }
+                REQUIRE((i % 4 != 0) == result.gone());
+            }
+        }
+    }
+    remove(file_path.c_str());
+}
+
+SECTION("stat_deadline")
+{
+    // Done well within the deadline, on a worker of its own
+    StatBatch batch;
+    batch.deadline_ms = 10000;
+    vector<string> paths = {".", "stat_test.tmp.none"};
+    vector<StatBatch::Result> results;
+    batch.run(paths, results);
+    REQUIRE_FALSE(batch.timed_out);
+    REQUIRE(2 == results.size());
+    REQUIRE(results[0].is_directory);
+    REQUIRE(ENOENT == results[1].error);
+    // Not known either way
+    StatBatch::Result result;
+    result.error = ETIMEDOUT;
+    REQUIRE_FALSE(result.gone());
+}
+
+SECTION("stat_gone")
+{
+    StatBatch::Result result;
+    REQUIRE(result.gone());
+    result.is_directory = true;
+    REQUIRE_FALSE(result.gone());
+    // Not known either way
+    result.is_directory = false;
+    result.error = EACCES;
+    REQUIRE_FALSE(result.gone());
+    result.error = EIO;
+    REQUIRE_FALSE(result.gone());
+    result.error = ENOENT;
+    REQUIRE(result.gone());
+}
+
+SECTION("identity_cache")
+{
+    // Paths stat'ed against a table of identities, counting each path
+    map<string, FileId> table;
+    table["/data/work"] = FileId{1, 7};
+    table["/home/u/w"] = FileId{1, 7};
+    table["/data/other"] = FileId{1, 8};
+    map<string, int> stats;
+    IdentityCache::StatPaths stat_paths = [&](const vector<string>& paths, vector<StatBatch::Result>& results) {
+        results.assign(paths.size(), StatBatch::Result());
+        for (size_t i=0; i<paths.size(); i++)
+        {
+            stats[paths[i]]++;
+            auto it = table.find(paths[i]);
+            if (it == table.end())
+                results[i].error = ENOENT;
+            else
+            {
+                results[i].is_directory = true;
+                results[i].id = it->second;
+            }
+        }
+    };
+    vector<string> paths = {"/data/other", "/data/work", "/gone", "/home/u/w"};
+    vector<FileId> ids;
+    IdentityCache cache;
+    cache.resolve(paths, stat_paths, 1000, ids);
+    REQUIRE(4 == stats.size());
+    REQUIRE(ids[1] == ids[3]);
+    REQUIRE(ids[0] != ids[1]);
+    REQUIRE_FALSE(ids[2].valid());
+    REQUIRE(cache.changed);
+    REQUIRE(cache.save(file_path));
+
+    IdentityCache loaded;
+    REQUIRE(loaded.load(file_path));
+    REQUIRE(3 == loaded.entries.size());
+    REQUIRE(FileId{1, 8} == loaded.entries["/data/other"].id);
+    REQUIRE(1000 == loaded.entries["/data/other"].checked);
+
+    SECTION("identity_cache_unique")
+    {
+        // A directory reached by one path alone is taken from the cache,
+        // its aliases are checked again
+        stats.clear();
+        loaded.resolve(paths, stat_paths, 2000, ids);
+        REQUIRE(0 == stats.count("/data/other"));
+        REQUIRE(1 == stats["/data/work"]);
+        REQUIRE(1 == stats["/home/u/w"]);
+        REQUIRE(1 == stats["/gone"]);
+        REQUIRE(ids[1] == ids[3]);
+    }
+
+    SECTION("identity_cache_moved")
+    {
+        // A symlink that points elsewhere now is not merged
+        table["/home/u/w"] = FileId{1, 9};
+        loaded.resolve(paths, stat_paths, 2000, ids);
+        REQUIRE(ids[1] != ids[3]);
+        REQUIRE(FileId{1, 9} == ids[3]);
+    }
+
+    SECTION("identity_cache_expired")
+    {
+        stats.clear();
+        loaded.resolve(paths, stat_paths, 1000 + IdentityCache::max_age, ids);
+        REQUIRE(4 == stats.size());
+    }
+
+    SECTION("identity_cache_damaged")
+    {
+        FILE *file = fopen(file_path.c_str(), "w");
+        fputs("cdd-identity 2\n1 2\n1 7 1000 /data/work\n1 8", file);
+        fclose(file);
+        REQUIRE(loaded.load(file_path));
+        REQUIRE(1 == loaded.entries.size());
+        REQUIRE(FileId{1, 7} == loaded.entries["/data/work"].id);
+
+        // A file in the older format, which also kept ctime, is not read
+        file = fopen(file_path.c_str(), "w");
+        fputs("cdd-identity 1\n1 7 100 1000 /data/work\n", file);
+        fclose(file);
+        REQUIRE_FALSE(loaded.load(file_path));
+        REQUIRE(loaded.entries.empty());
+    }
+    remove(file_path.c_str());
+}
+
+}
+
+// One sweep over 50000 paths, half of them missing, against one stat
+// after the other, run with "testmain [.bench]"
+TEST_CASE("stat_bench", "[.bench]")
+{
+    vector<string> paths;
+    for (size_t i=0; i<50000; i++)
+        paths.push_back(i % 2 ? "/usr/lib" : "/usr/lib/none" + to_string(i));
+    const char *names[] = {"serial", "threads", "auto"};
+    for (int mode=0; mode<3; mode++)
+    {
+        StatBatch batch;
+        batch.engine = mode == 2 ? StatBatch::ENGINE_AUTO : StatBatch::ENGINE_THREADS;
+        batch.thread_count = mode == 0 ? 1 : 0;
+        vector<StatBatch::Result> results;
+        auto start = chrono::steady_clock::now();
+        batch.run(paths, results);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << names[mode] << (batch.used_uring ? " (io_uring)" : "") << ": " << ms << " ms" << endl;
+    }
+}
+
+// vim:ff=unix
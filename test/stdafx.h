@@ -10,4 +10,5 @@
 #include <cdd/cdd.h>
 
 #include <iostream>
+#include <map>
 
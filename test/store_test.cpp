@@ -0,0 +1,699 @@
+/*
+
+Copyright 2010-2021 Michael Graz
+http://www.plan10.com/cdd
+
+This file is part of Cd Deluxe.
+
+Cd Deluxe is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Cd Deluxe is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Cd Deluxe.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "stdafx.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#ifndef WIN32
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "catch.hpp"
+
+#define countof(x) (sizeof(x)/sizeof(x[0]))
+
+static const string store_file = "store_test.tmp";
+
+// Visits in the order they happened, oldest first
+static string arr_visits[] = {
+    "/opt/a",
+    "/opt/b",
+    "/opt/c",
+    "/opt/a",
+    "/opt/d",
+};
+
+// The same history as a directory stack, top first
+static string arr_stack[] = {
+    "/opt/d",
+    "/opt/a",
+    "/opt/c",
+    "/opt/b",
+    "/opt/a",
+};
+
+static void remove_store(void)
+{
+    remove(store_file.c_str());
+    remove(HistoryStore::log_path(store_file).c_str());
+    remove((store_file + ".lock").c_str());
+}
+
+// Log the visits, the time of each is its number from 1
+static void write_store(bool compacted)
+{
+    remove_store();
+    for (size_t i=0; i<countof(arr_visits); i++)
+        REQUIRE(HistoryStore::append(store_file, arr_visits[i], i + 1));
+    if (compacted)
+        REQUIRE(HistoryStore::compact(store_file));
+}
+
+static vector<string> log_dirs(const HistoryStore& store)
+{
+    vector<string> result;
+    for (size_t i=0; i<store.log_visits().size(); i++)
+        result.push_back(string(store.log_visits()[i].dir));
+    return result;
+}
+
+// The stack of the store with each step repeated by its weight
+static vector<string> expanded_stack(const HistoryStore& store)
+{
+    vector<string> result;
+    for (uint64_t i=0; i<store.stack_size(); i++)
+    {
+        uint32_t weight;
+        string dir(store.stack(i, weight));
+        result.insert(result.end(), weight, dir);
+    }
+    return result;
+}
+
+TEST_CASE("store_test")
+{
+
+SECTION("store_log_only")
+{
+    write_store(false);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(0 == store.path_count());
+    REQUIRE(5 == store.visit_count());
+    REQUIRE(5 == store.stack_size());
+    vector<string> visits(arr_visits, arr_visits + countof(arr_visits));
+    REQUIRE(visits == log_dirs(store));
+    REQUIRE(4 == store.log_visits()[3].time);
+    vector<string> stack(arr_stack, arr_stack + countof(arr_stack));
+    REQUIRE(stack == expanded_stack(store));
+    uint32_t weight;
+    REQUIRE(store.stack(5, weight).empty());
+    store.close();
+    remove_store();
+}
+
+SECTION("store_compact")
+{
+    write_store(true);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(0 == store.log_tail());
+    REQUIRE(4 == store.path_count());
+    REQUIRE(5 == store.visit_count());
+    // Paths oldest first, with their counts, sequence numbers and times
+    REQUIRE("/opt/a" == store.path(0));
+    REQUIRE("/opt/d" == store.path(3));
+    REQUIRE(store.path(4).empty());
+    StorePath entry = store.path_entry(0);
+    REQUIRE(2 == entry.count);
+    REQUIRE(0 == entry.first_seq);
+    REQUIRE(3 == entry.last_seq);
+    REQUIRE(1 == entry.first_time);
+    REQUIRE(4 == entry.last_time);
+    entry = store.path_entry(2);
+    REQUIRE(1 == entry.count);
+    REQUIRE(2 == entry.first_seq);
+    REQUIRE(2 == entry.last_seq);
+    // Repeated visits are folded into one step
+    REQUIRE(5 == store.stack_size());
+    uint32_t weight;
+    REQUIRE("/opt/d" == store.stack(0, weight));
+    REQUIRE(1 == weight);
+    REQUIRE("/opt/a" == store.stack(1, weight));
+    REQUIRE(1 == weight);
+
+    // Later visits are logged after the snapshot and folded in by the
+    // next compaction
+    REQUIRE(HistoryStore::append(store_file, "/opt/a", 6));
+    REQUIRE(HistoryStore::append(store_file, "/opt/e", 7));
+    REQUIRE(store.open(store_file));
+    REQUIRE(7 == store.visit_count());
+    REQUIRE("/opt/e" == store.stack(0, weight));
+    REQUIRE(HistoryStore::compact(store_file));
+    REQUIRE(store.open(store_file));
+    REQUIRE(0 == store.log_tail());
+    REQUIRE(5 == store.path_count());
+    REQUIRE(7 == store.visit_count());
+    entry = store.path_entry(0);
+    REQUIRE(3 == entry.count);
+    REQUIRE(5 == entry.last_seq);
+    REQUIRE(6 == entry.last_time);
+    REQUIRE("/opt/a" == store.stack(1, weight));
+    REQUIRE(2 == weight);
+    // The score of the visits is kept as of the last one, each folded
+    // step has its share of it
+    double rate = HistoryStore::frecency_rate;
+    REQUIRE(Approx(log(exp(-5 * rate) + exp(-2 * rate) + 1)) == store.path_entry(0).frecency);
+    double frecency;
+    store.stack(1, weight, frecency);
+    REQUIRE(Approx(HistoryStore::frecency_at(6) + log(exp(-2 * rate) + 1)) == frecency);
+    store.stack(5, weight, frecency);
+    REQUIRE(1 == weight);
+    REQUIRE(Approx(HistoryStore::frecency_at(1)) == frecency);
+    store.close();
+    remove_store();
+}
+
+SECTION("store_frecency_by_time")
+{
+    // Many visits half a year ago, then a few this week with hardly any
+    // cds in between.  A store ranks by time, a shell's stack can only
+    // rank by visits.
+    const int64_t day = 24 * 60 * 60;
+    const int64_t now = HistoryStore::frecency_epoch + 1000 * day;
+    vector<string> visits;
+    vector<int64_t> times;
+    for (int i=0; i<50; i++)
+    {
+        visits.push_back("/opt/old");
+        times.push_back(now - 180 * day + i * 60);
+    }
+    for (int i=0; i<3; i++)
+    {
+        visits.push_back("/opt/new");
+        times.push_back(now - 2 * day + i * 60);
+    }
+    vector<string> stack(visits.rbegin(), visits.rend());
+    Cdd cdd_stack(stack, "/opt/x");
+    cdd_stack.set_opt_path("%0");
+    cdd_stack.process();
+#ifdef WIN32
+    REQUIRE("pushd /opt/old\n" == cdd_stack.strm_out.str());
+#else
+    REQUIRE("pushd '/opt/old'\n" == cdd_stack.strm_out.str());
+#endif
+
+    for (int compacted=0; compacted<2; compacted++)
+    {
+        remove_store();
+        for (size_t i=0; i<visits.size(); i++)
+            REQUIRE(HistoryStore::append(store_file, visits[i], times[i]));
+        if (compacted)
+            REQUIRE(HistoryStore::compact(store_file));
+        HistoryStore store;
+        REQUIRE(store.open(store_file));
+        if (!compacted)
+        {
+            // A visit a week older weighs half as much
+            uint32_t weight;
+            double frecency;
+            store.stack(0, weight, frecency);
+            REQUIRE(Approx(HistoryStore::frecency_at(times.back())) == frecency);
+            REQUIRE(Approx(HistoryStore::frecency_at(now - 7 * day) + log(2.0)) == HistoryStore::frecency_at(now));
+        }
+        Cdd cdd(store, "/opt/x");
+        cdd.set_opt_path("%0");
+        cdd.process();
+#ifdef WIN32
+        REQUIRE("pushd /opt/new\n" == cdd.strm_out.str());
+#else
+        REQUIRE("pushd '/opt/new'\n" == cdd.strm_out.str());
+#endif
+        store.close();
+    }
+    remove_store();
+}
+
+SECTION("store_same_as_stack")
+{
+    const char *directions[] = {"-", "+", ",", "%"};
+    const char *paths[] = {"-1", "-2", "+0", "+2", ",0", ",1", "%0", "%2", "opt"};
+    for (int compacted=0; compacted<2; compacted++)
+    {
+        write_store(compacted != 0);
+        HistoryStore store;
+        REQUIRE(store.open(store_file));
+        for (size_t i=0; i<countof(directions); i++)
+        {
+            Cdd cdd_store(store, "/opt/d");
+            cdd_store.opt_history = true;
+            cdd_store.direction.assign(directions[i]);
+            cdd_store.process();
+
+            Cdd cdd_stack(arr_stack, countof(arr_stack), "/opt/d");
+            cdd_stack.opt_history = true;
+            cdd_stack.direction.assign(directions[i]);
+            cdd_stack.process();
+
+            REQUIRE(cdd_stack.strm_err.str() == cdd_store.strm_err.str());
+        }
+        for (size_t i=0; i<countof(paths); i++)
+        {
+            Cdd cdd_store(store, "/opt/d");
+            cdd_store.set_opt_path(paths[i]);
+            cdd_store.process();
+
+            Cdd cdd_stack(arr_stack, countof(arr_stack), "/opt/d");
+            cdd_stack.set_opt_path(paths[i]);
+            cdd_stack.process();
+
+            REQUIRE(cdd_stack.strm_out.str() == cdd_store.strm_out.str());
+            REQUIRE(cdd_stack.strm_err.str() == cdd_store.strm_err.str());
+        }
+        store.close();
+    }
+    remove_store();
+}
+
+SECTION("store_since")
+{
+    // Visits a minute apart, enough for a few blocks of the time index,
+    // except that the clock was ahead for one of them
+    remove_store();
+    for (int i=0; i<1000; i++)
+        REQUIRE(HistoryStore::append(store_file, "/opt/" + to_string(i), 60 * (i == 100 ? 5000 : i)));
+    REQUIRE(HistoryStore::compact(store_file));
+    REQUIRE(HistoryStore::append(store_file, "/opt/log", 60 * 1000));
+    REQUIRE(HistoryStore::append(store_file, "/opt/late", 0));
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(1002 == store.stack_size());
+    REQUIRE(0 == store.stack_time(0));
+    REQUIRE(60 * 999 == store.stack_time(2));
+
+    int64_t since = 60 * 995;
+    REQUIRE(1 == store.next_since(0, since));
+    REQUIRE(2 == store.next_since(2, since));
+    REQUIRE(6 == store.next_since(6, since));
+    REQUIRE(2 + 999 - 100 == store.next_since(7, since));
+    REQUIRE(1002 == store.next_since(2 + 999 - 100 + 1, since));
+    REQUIRE(1002 == store.next_since(0, 60 * 6000));
+
+    Cdd cdd;
+    cdd.opt_since = since;
+    cdd.opt_history = true;
+    cdd.opt_limit_backwards = 0;
+    cdd.assign(store, "/opt/log");
+    cdd.process();
+    REQUIRE(" -1: /opt/999\n -2: /opt/998\n -3: /opt/997\n -4: /opt/996\n -5: /opt/995\n -6: /opt/100\n" == cdd.strm_err.str());
+    store.close();
+    remove_store();
+}
+
+SECTION("store_lazy")
+{
+    write_store(true);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    Cdd cdd(store, "/opt/d");
+    cdd.opt_path = "-";
+    cdd.process();
+#ifdef WIN32
+    REQUIRE("pushd /opt/a\n" == cdd.strm_out.str());
+#else
+    REQUIRE("pushd '/opt/a'\n" == cdd.strm_out.str());
+#endif
+    // Only the most recent steps were read
+    REQUIRE(cdd.vec_dir_stack.ids.size() < store.stack_size());
+    store.close();
+    remove_store();
+}
+
+SECTION("store_record")
+{
+    write_store(true);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(store.record(store_file, "/opt/e"));
+    REQUIRE(store.record(store_file, "/opt/a"));
+    REQUIRE(7 == store.visit_count());
+    // New visits are logged, the snapshot is left alone
+    REQUIRE(4 == store.path_count());
+    uint32_t weight;
+    REQUIRE("/opt/a" == store.stack(0, weight));
+    REQUIRE("/opt/e" == store.stack(1, weight));
+
+    // Without the snapshot all of the log is read
+    remove(store_file.c_str());
+    REQUIRE(store.open(store_file));
+    REQUIRE(7 == store.visit_count());
+    REQUIRE("/opt/e" == store.stack(1, weight));
+    store.close();
+    remove_store();
+}
+
+SECTION("store_log_restarted")
+{
+    write_store(true);
+    // The log was started again and is shorter, all of it is read
+    remove(HistoryStore::log_path(store_file).c_str());
+    REQUIRE(HistoryStore::append(store_file, "/g", 6));
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(6 == store.visit_count());
+    uint32_t weight;
+    REQUIRE("/g" == store.stack(0, weight));
+    store.close();
+    remove_store();
+}
+
+SECTION("store_gc")
+{
+    // With a store, gc compacts and keeps the visit counts
+    write_store(false);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    Cdd cdd(store, "/opt/d");
+    cdd.opt_store = store_file;
+    cdd.opt_gc = true;
+    cdd.process();
+    REQUIRE("" == cdd.strm_out.str());
+    REQUIRE("cdd gc\n" == cdd.strm_err.str());
+    REQUIRE(store.open(store_file));
+    REQUIRE(0 == store.log_tail());
+    REQUIRE(4 == store.path_count());
+    REQUIRE(2 == store.path_entry(0).count);
+    store.close();
+    remove_store();
+}
+
+SECTION("store_compact_option")
+{
+    write_store(false);
+    {
+        Cdd cdd;
+        const char *av[] = {"_cdd", "--compact"};
+        REQUIRE(cdd.options(countof(av), av, "--store=" + store_file));
+        cdd.process();
+        REQUIRE("cdd compact\n" == cdd.strm_err.str());
+    }
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(0 == store.log_tail());
+    REQUIRE(4 == store.path_count());
+    store.close();
+    remove_store();
+
+    // Only a store can be compacted
+    Cdd cdd;
+    const char *av[] = {"_cdd", "--compact"};
+    REQUIRE(cdd.options(countof(av), av));
+    cdd.process();
+    REQUIRE("** Compaction needs a history store, see --store\n" == cdd.strm_err.str());
+}
+
+SECTION("store_delete")
+{
+    write_store(false);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    Cdd cdd(store, "/opt/d");
+    cdd.opt_store = store_file;
+    cdd.opt_delete = true;
+    cdd.opt_path = "/opt/c";
+    cdd.process();
+    // Nothing for the shell to do, the store is compacted without it
+    REQUIRE("" == cdd.strm_out.str());
+    REQUIRE("cdd del: /opt/c\n" == cdd.strm_err.str());
+
+    REQUIRE(store.open(store_file));
+    REQUIRE(3 == store.path_count());
+    vector<string> expect = {"/opt/d", "/opt/a", "/opt/b", "/opt/a"};
+    REQUIRE(expect == expanded_stack(store));
+    store.close();
+    remove_store();
+}
+
+SECTION("store_prune")
+{
+    write_store(true);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    struct CddExists : public Cdd
+    {
+        CddExists(const HistoryStore& store) : Cdd(store, "/opt/d") {}
+        virtual vector<bool> are_directories(const vector<string>& paths)
+        {
+            vector<bool> found;
+            for (size_t i=0; i<paths.size(); i++)
+                found.push_back(paths[i] != "/opt/a" && paths[i] != "/opt/b");
+            return found;
+        }
+    } cdd(store);
+    cdd.opt_store = store_file;
+    cdd.opt_prune = true;
+    cdd.process();
+    REQUIRE("" == cdd.strm_out.str());
+    REQUIRE("cdd prune: /opt/a\ncdd prune: /opt/b\n" == cdd.strm_err.str());
+
+    REQUIRE(store.open(store_file));
+    vector<string> expect = {"/opt/d", "/opt/c"};
+    REQUIRE(expect == expanded_stack(store));
+    store.close();
+    remove_store();
+}
+
+SECTION("store_reset")
+{
+    write_store(true);
+    REQUIRE(HistoryStore::append(store_file, "/opt/e", 6));
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    Cdd cdd(store, "/opt/e");
+    cdd.opt_store = store_file;
+    cdd.opt_reset = true;
+    cdd.process();
+    REQUIRE("cdd reset\n" == cdd.strm_err.str());
+    REQUIRE(store.open(store_file));
+    REQUIRE(0 == store.path_count());
+    REQUIRE(0 == store.stack_size());
+    store.close();
+    remove_store();
+}
+
+SECTION("store_log_torn")
+{
+    remove_store();
+    REQUIRE(HistoryStore::append(store_file, "/opt/a", 1));
+    {
+        // A record cut short by a writer that died
+        LogRecord record = LogRecord();
+        record.marker = HistoryStore::log_marker;
+        record.size = 40;
+        ofstream strm(HistoryStore::log_path(store_file), ios::binary | ios::app);
+        strm.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        strm << "/opt/Cut";
+    }
+    REQUIRE(HistoryStore::append(store_file, "/opt/b", 2));
+    {
+        // A record with a bad CRC
+        ofstream strm(HistoryStore::log_path(store_file), ios::binary | ios::app);
+        LogRecord record = LogRecord();
+        record.marker = HistoryStore::log_marker;
+        record.size = 6;
+        strm.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        strm << "/opt/x";
+    }
+    REQUIRE(HistoryStore::append(store_file, "/opt/c", 3));
+    {
+        // A torn tail
+        ofstream strm(HistoryStore::log_path(store_file), ios::binary | ios::app);
+        strm << "CDD";
+    }
+
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    vector<string> expect = {"/opt/a", "/opt/b", "/opt/c"};
+    REQUIRE(expect == log_dirs(store));
+    store.close();
+    remove_store();
+}
+
+#ifndef WIN32
+SECTION("store_concurrent_writers")
+{
+    // Writers in separate processes append at the same time, every
+    // record is kept whole and in the order each writer added them
+    remove_store();
+    const int writer_count = 16;
+    const int record_count = 500;
+    vector<pid_t> pids;
+    for (int w=0; w<writer_count; w++)
+    {
+        pid_t pid = fork();
+        REQUIRE(pid >= 0);
+        if (pid == 0)
+        {
+            // Writers differ in length so that torn records would show
+            string padding(w * 7, 'x');
+            bool ok = true;
+            for (int i=0; i<record_count; i++)
+                ok = HistoryStore::append(store_file, "/w" + to_string(w) + "/" + padding + "/" + to_string(i), i) && ok;
+            _exit(ok ? 0 : 1);
+        }
+        pids.push_back(pid);
+    }
+    for (size_t i=0; i<pids.size(); i++)
+    {
+        int status = 0;
+        REQUIRE(waitpid(pids[i], &status, 0) == pids[i]);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(0 == WEXITSTATUS(status));
+    }
+
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE(size_t(writer_count * record_count) == store.visit_count());
+    vector<int> next(writer_count, 0);
+    for (uint64_t i=0; i<store.visit_count(); i++)
+    {
+        string dir(store.log_visits()[i].dir);
+        size_t slash = dir.find('/', 1);
+        REQUIRE(slash != string::npos);
+        int w = stoi(dir.substr(2, slash - 2));
+        REQUIRE(w < writer_count);
+        string expect = "/w" + to_string(w) + "/" + string(w * 7, 'x') + "/" + to_string(next[w]++);
+        REQUIRE(expect == dir);
+    }
+    for (int w=0; w<writer_count; w++)
+        REQUIRE(record_count == next[w]);
+    store.close();
+    remove_store();
+}
+#endif
+
+#ifndef WIN32
+SECTION("store_compact_busy")
+{
+    // A compaction that does not wait gives way to one that is running
+    write_store(false);
+    int fd = open((store_file + ".lock").c_str(), O_RDWR | O_CREAT, 0666);
+    REQUIRE(fd >= 0);
+    REQUIRE(0 == flock(fd, LOCK_EX));
+    REQUIRE(!HistoryStore::compact(store_file, nullptr, false));
+    close(fd);
+    REQUIRE(HistoryStore::compact(store_file, nullptr, false));
+    remove_store();
+}
+#endif
+
+SECTION("store_missing_or_damaged")
+{
+    HistoryStore store;
+    remove_store();
+    REQUIRE(!store.open(store_file));
+    REQUIRE(0 == store.visit_count());
+
+    // Not a store at all
+    {
+        ofstream strm(store_file, ios::binary | ios::trunc);
+        strm << "/opt/a\n/opt/b\n";
+    }
+    REQUIRE(!store.open(store_file));
+
+    // Cut short, the sections no longer fit in the file.  The log is
+    // still read, and compaction replaces the snapshot.
+    write_store(true);
+    REQUIRE(HistoryStore::append(store_file, "/opt/e", 6));
+    string contents;
+    {
+        ifstream strm(store_file, ios::binary);
+        contents.assign(istreambuf_iterator<char>(strm), istreambuf_iterator<char>());
+    }
+    {
+        ofstream strm(store_file, ios::binary | ios::trunc);
+        strm.write(contents.data(), contents.size() - 4);
+    }
+    REQUIRE(!store.open(store_file));
+    REQUIRE(store.snapshot_damaged());
+    REQUIRE(6 == store.visit_count());
+    string warning;
+    REQUIRE(HistoryStore::compact(store_file, nullptr, true, &warning));
+    // The log holds all of the history still
+    REQUIRE("" == warning);
+    REQUIRE(!ifstream(store_file + ".damaged"));
+    REQUIRE(store.open(store_file));
+    REQUIRE(5 == store.path_count());
+
+    // A step to a path that does not exist is skipped, this is the
+    // snapshot from before /opt/e was logged
+    {
+        ofstream strm(store_file, ios::binary | ios::trunc);
+        // The oldest step, the first visit to /opt/a
+        StoreHeader header;
+        memcpy(&header, contents.data(), sizeof(header));
+        contents[header.steps_offset + (header.step_count - 1) * sizeof(StoreStep)] = 100;
+        strm.write(contents.data(), contents.size());
+    }
+    REQUIRE(store.open(store_file));
+    REQUIRE(6 == store.stack_size());
+    uint32_t weight;
+    REQUIRE(store.stack(5, weight).empty());
+    Cdd cdd(store, "/opt/e");
+    cdd.opt_history = true;
+    cdd.process();
+    REQUIRE(" -1: /opt/d\n -2: /opt/a\n -3: /opt/c\n -4: /opt/b\n" == cdd.strm_err.str());
+    store.close();
+    remove_store();
+}
+
+SECTION("store_damaged_log_released")
+{
+    // A damaged snapshot, and a log whose start has been given back as
+    // it was in the snapshot
+    write_store(true);
+    REQUIRE(HistoryStore::append(store_file, "/opt/e", 6));
+    string contents;
+    {
+        ifstream strm(store_file, ios::binary);
+        contents.assign(istreambuf_iterator<char>(strm), istreambuf_iterator<char>());
+    }
+    {
+        ofstream strm(store_file, ios::binary | ios::trunc);
+        strm.write(contents.data(), contents.size() - 4);
+    }
+    {
+        fstream strm(HistoryStore::log_path(store_file), ios::binary | ios::in | ios::out);
+        strm.write(string(sizeof(LogRecord), '\0').data(), sizeof(LogRecord));
+    }
+
+    // The damaged snapshot is kept aside, with a warning
+    remove((store_file + ".damaged").c_str());
+    Cdd cdd;
+    cdd.opt_store = store_file;
+    cdd.opt_compact = true;
+    cdd.process();
+    REQUIRE(("** History store is damaged, the history only it held is kept in " + store_file + ".damaged\n"
+             "cdd compact\n") == cdd.strm_err.str());
+    string kept;
+    {
+        ifstream strm(store_file + ".damaged", ios::binary);
+        kept.assign(istreambuf_iterator<char>(strm), istreambuf_iterator<char>());
+    }
+    REQUIRE(contents.substr(0, contents.size() - 4) == kept);
+    HistoryStore store;
+    REQUIRE(store.open(store_file));
+    REQUIRE_FALSE(store.snapshot_damaged());
+    // Only the zeroed record is lost, the file system here may not punch holes
+    REQUIRE((vector<string>{"/opt/e", "/opt/d", "/opt/a", "/opt/c", "/opt/b"}) == expanded_stack(store));
+    store.close();
+    remove((store_file + ".damaged").c_str());
+    remove_store();
+}
+
+}
+
+// vim:ff=unix
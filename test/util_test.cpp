@@ -72,10 +72,52 @@ SECTION("expand_dots")
     REQUIRE("...def" == fun("...def"));
     REQUIRE("abc...def" == fun("abc...def"));
     REQUIRE("abc/../../def" == fun("abc/.../def"));
+#ifdef WIN32
+    // Backslash is only a separator (and normalized away) on Windows
     REQUIRE("abc/../../../def" == fun("abc\\....\\def"));
     REQUIRE("abc/../../def/../../ghi" == fun("abc\\...\\def/.../ghi"));
+#endif
 
-    // TODO add tests for path_separator
+    auto fun_separator = [](string s) {
+        Cdd cdd;
+        cdd.opt_separator = '\\';
+        return cdd.expand_dots(s);
+    };
+    REQUIRE("abc/..\\..\\../def" == fun_separator("abc/..../def"));
+    REQUIRE("..\\../" == fun_separator(".../"));
+    REQUIRE("" == fun_separator(""));
+}
+
+SECTION("path_spec")
+{
+    auto kind = [](const char *s) { return Cdd::PathSpec::parse(s).kind; };
+    auto amount = [](const char *s) { return Cdd::PathSpec::parse(s).amount; };
+
+    REQUIRE(Cdd::PathSpec::SPEC_NUMBER == kind("12"));
+    REQUIRE(12 == amount("12"));
+    REQUIRE(Cdd::PathSpec::SPEC_DASHES == kind("---"));
+    REQUIRE(3 == amount("---"));
+    REQUIRE(Cdd::PathSpec::SPEC_DASH_NUMBER == kind("-7"));
+    REQUIRE(7 == amount("-7"));
+    REQUIRE(Cdd::PathSpec::SPEC_PLUSES == kind("+"));
+    REQUIRE(1 == amount("+"));
+    REQUIRE(Cdd::PathSpec::SPEC_PLUS_NUMBER == kind("+0"));
+    REQUIRE(0 == amount("+0"));
+    REQUIRE(Cdd::PathSpec::SPEC_COMMAS == kind(",,"));
+    REQUIRE(2 == amount(",,"));
+    REQUIRE(Cdd::PathSpec::SPEC_COMMA_NUMBER == kind(",3"));
+    REQUIRE(3 == amount(",3"));
+
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind(""));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("src"));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("12a"));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("--3"));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("-+"));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("+-3"));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind(",a"));
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("-3x"));
+    // Too large to be a position, so taken as a pattern
+    REQUIRE(Cdd::PathSpec::SPEC_OTHER == kind("99999999999999999999"));
 }
 
 }